@@ -1,10 +1,14 @@
 // SPDX-License-Identifier: Apache-2.0
 
 #pragma once
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+  #define _GNU_SOURCE // syscall, pread, MAP_ANON etc. are not visible with -std=c11
+#endif
 #include <playsys.h>
 #include <playwgpu.h> // backend interface
 
 #define SYS_API_VERSION 1
+#define SPECIAL_FS_PREFIX "/sys"
 
 #define static_assert _Static_assert
 
@@ -29,6 +33,9 @@
 #endif
 
 #define USIZE_MAX ((usize)-1)
+#define I32_MAX   ((i32)0x7fffffff)
+#define U32_MAX   ((u32)-1)
+#define U64_MAX   ((u64)-1)
 
 #if __has_attribute(musttail)
   #define MUSTTAIL __attribute__((musttail))
@@ -132,6 +139,8 @@ struct vfile_ops {
 struct vfile {
   fd_t        fd;
   u32         flags; // vfile_flag_t
+  u32         gen;   // tells the file apart from later files stored in the same vfile_t
+  u32         pins;  // vfile_pin count; VFILE_PIN_CLOSED once closed
   void*       data;  // use depends on flags
   const char* name;
   const vfile_ops_t* fops;
@@ -139,23 +148,76 @@ struct vfile {
 
 // virtual file functions
 fd_t vfile_open(vfile_t** fp, const char* name, const vfile_ops_t*, vfile_flag_t);
+// vfile_adopt routes calls on an existing host file descriptor to fops
+fd_t vfile_adopt(vfile_t** fp, fd_t hostfd, const char* name, const vfile_ops_t*);
 err_t vfile_close(vfile_t*);
 EXTERNC vfile_t* vfile_lookup(fd_t); // returns NULL if not found
-
-// VFILE_JUMP_FOP routes a call to a vfile's fops if found for fd
+// vfile_lookup_hold is vfile_lookup which keeps files from being closed until
+// vfile_lookup_done, e.g. while taking a reference to the file's data.
+// The caller must not block or open or close files in between.
+vfile_t* vfile_lookup_hold(fd_t);
+void vfile_lookup_done();
+// vfile_lookup_gen is vfile_lookup which also stores the file's gen, for vfile_pin
+vfile_t* vfile_lookup_gen(fd_t, u32* gen);
+// vfile_pin keeps a file looked up earlier, when it had generation gen, from being
+// released until vfile_unpin, e.g. while calling one of its fops, which may block.
+// Returns false if the file has been closed since. Closing a pinned file removes it
+// from the map at once, and the last vfile_unpin releases it.
+bool vfile_pin(vfile_t*, u32 gen);
+void vfile_unpin(vfile_t*);
+
+// VFILE_JUMP_FOP routes a call to a vfile's fops if found for fd.
+// fops of a vfile closed by another thread in the meantime are NULL.
 #define VFILE_JUMP_FOP(FOP, fd, err_res, ...) { \
   vfile_t* f = vfile_lookup(fd);                \
-  if (f)                                        \
-    return f->fops->FOP ? f->fops->FOP(f, ##__VA_ARGS__) : \
-             err_res; \
+  if (f) {                                      \
+    const vfile_ops_t* fops = READ_ONCE(f->fops); \
+    if (!fops)                                  \
+      return p_err_badfd;                       \
+    return fops->FOP ? fops->FOP(f, ##__VA_ARGS__) : err_res; \
+  } \
 }
 
 
 // -----------------------------------------------------------------------------------
 // syscall implementations
+fd_t _psys_openat(psysop_t, fd_t atfd, const char* path, usize flags, isize mode);
+isize _psys_read(psysop_t, fd_t, void* data, usize size);
+isize _psys_write(psysop_t, fd_t, const void* data, usize size);
+isize _psys_pread(psysop_t, fd_t, void* data, usize size, u64 offs); // vfiles ignore offs
+isize _psys_pwrite(psysop_t, fd_t, const void* data, usize size, u64 offs);
 err_t _psys_pipe(psysop_t, fd_t* fdp, u32 flags);
 err_t _psys_close(psysop_t, fd_t);
 err_t _psys_close_host(psysop_t, fd_t); // does not consider vfiles
+// host_fd_close_count returns a number which changes when _psys_close_host closes fd
+// (or another fd sharing its bucket.) Properties of a host fd, e.g. its file type, may
+// be cached along with the number read before looking them up, until it changes.
+u32 host_fd_close_count(fd_t);
+// err_from_errno returns the error for a host errno value (POSIX hosts)
+err_t err_from_errno(int);
+// _psys_{pread,pwrite}_host do not consider vfiles; offs -1 uses the file position
+isize _psys_pread_host(psysop_t, fd_t, void* data, usize size, u64 offs);
+isize _psys_pwrite_host(psysop_t, fd_t, const void* data, usize size, u64 offs);
+// _psys_psplice moves up to len bytes from fd_in to fd_out without passing them through
+// application memory; offs -1 uses the file position. Virtual files ignore offs.
+isize _psys_psplice(psysop_t, fd_t fd_in, u64 off_in, fd_t fd_out, u64 off_out, usize len);
+isize _psys_splice(psysop_t, fd_t fd_in, i64* off_in, fd_t fd_out, i64* off_out, usize len);
+isize _psys_tee(psysop_t, fd_t fd_in, fd_t fd_out, usize len, u32 flags);
+err_t _psys_statat(psysop_t, fd_t base, const char* path, p_statx_t* st, u32 flags);
+err_t _psys_removeat(psysop_t, fd_t base, const char* path, u32 flags);
+err_t _psys_renameat(
+  psysop_t, fd_t oldbase, const char* oldpath, fd_t newbase, const char* newpath);
 fd_t _psys_ioring_setup(psysop_t, u32 entries, p_ioring_params_t* params);
-isize _psys_ioring_enter(psysop_t, fd_t ring, u32 to_submit, u32 min_complete, u32 flags);
+isize _psys_ioring_enter(
+  psysop_t, fd_t ring, u32 to_submit, u32 min_complete, u32 flags, const void* arg);
 isize _psys_ioring_register(psysop_t, fd_t ring, u32 opcode, const void* arg, u32 nr_args);
+
+// ioring limits (ioring_base.c)
+// ioring_max_entries returns the max number of SQ entries of a ring (IORING_MAX_ENTRIES
+// in Linux); CQ rings may have twice as many. Configurable at runtime with
+// ioring_set_max_entries (/sys/ioring/max_entries), which takes a power of two.
+u32 ioring_max_entries();
+err_t ioring_set_max_entries(u32 n);
+// ioring_stats_format writes counters and latency histograms of the open rings of the
+// portable driver to buf (/sys/ioring/stats); returns the full length, like snprintf
+usize ioring_stats_format(char* buf, usize cap);
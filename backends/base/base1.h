@@ -130,6 +130,16 @@ inline static bool copy_to_user(void *to, const void *from, usize n) {
   return true;
 }
 
+// READ_ONCE & WRITE_ONCE prevent the compiler from merging, refetching or tearing
+// loads and stores of memory shared with another thread or the application.
+#define READ_ONCE(x)     __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define WRITE_ONCE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+
+// smp_load_acquire loads *p; no later memory operations are reordered before it.
+// smp_store_release stores v to *p; no earlier memory operations are reordered after it.
+#define smp_load_acquire(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define smp_store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
 // fls finds the last (most-significant) bit set
 #define fls(x) (x ? sizeof(x) * 8 - __builtin_clz(x) : 0)
 
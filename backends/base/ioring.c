@@ -7,15 +7,35 @@
 
 #include "base.h"
 
+// The portable driver is always included: it is used as a fallback on hosts
+// where the native driver is unavailable (e.g. Linux with io_uring disabled.)
+#include "ioring_base.c"
+
 #if defined(__linux__)
-  #include "ioring_linux.c"
+  #include "ioring_linux.c" // defines IORING_NATIVE
+#elif defined(__wasm__)
+  #include "ioring_wasm.c"
+#elif defined(__MACH__) && defined(__APPLE__)
+  #include "ioring_darwin.c"
 #else
-  #include "ioring_base.c"
-  #if defined(__wasm__)
-    #include "ioring_wasm.c"
-  #elif defined(__MACH__) && defined(__APPLE__)
-    #include "ioring_darwin.c"
-  #else
-    #error ioring not available for target platform
-  #endif
+  #error ioring not available for target platform
+#endif
+
+
+#if !defined(IORING_NATIVE)
+
+fd_t _psys_ioring_setup(psysop_t _, u32 entries, p_ioring_params_t* params) {
+  return ioring_base_setup(entries, params);
+}
+
+isize _psys_ioring_enter(
+  psysop_t _, fd_t ring, u32 to_submit, u32 min_complete, u32 flags, const void* arg)
+{
+  return ioring_base_enter(ring, to_submit, min_complete, flags, arg);
+}
+
+isize _psys_ioring_register(psysop_t _, fd_t ring, u32 opcode, const void* arg, u32 nr_args) {
+  return ioring_base_register(ring, opcode, arg, nr_args);
+}
+
 #endif
@@ -1,7 +1,7 @@
 // SPDX-License-Identifier: Apache-2.0
-// This file is conditionally included by ioring.c
+// This file is included by ioring.c
 
-// ioring driver
+// portable ioring driver
 //
 // Shared application/driver submission and completion ring pairs, for supporting
 // fast & efficient IO. Based on and compatible with Linux io_uring.
@@ -29,15 +29,26 @@
 // TODO: wasm
 #if defined(HAS_LIBC)
   #include <stdlib.h>
+  #include <errno.h>
+  #include <fcntl.h>    // fcntl
   #include <sys/mman.h>
+  #include <sys/stat.h> // fstat
+  #include <pthread.h>
+  #include <sched.h>  // sched_yield
+  #include <time.h>   // clock_gettime
+  #include <unistd.h> // sysconf
 #endif
 
 
-#define IORING_MAX_ENTRIES              32768 // value from Linux 5.15
-#define IORING_MAX_CQ_ENTRIES           (2 * IORING_MAX_ENTRIES)
+#define IORING_MAX_ENTRIES              32768 // default max entries; value from Linux 5.15
+#define IORING_MAX_ENTRIES_LIMIT        (1U << 24) // upper bound of ioring_max_entries
 #define IORING_SQPOLL_CAP_ENTRIES_VALUE 8
+#define IORING_SQ_THREAD_IDLE_DEFAULT   1000 // milliseconds (HZ in Linux)
+#define IORING_RELEASE_RETRY_INTERVAL   1000000 // nanoseconds; see _ioring_release
 
 static_assert(IORING_MAX_ENTRIES == ceil_pow2(IORING_MAX_ENTRIES), "must be power of 2");
+static_assert(IORING_MAX_ENTRIES_LIMIT == ceil_pow2(IORING_MAX_ENTRIES_LIMIT),
+              "must be power of 2");
 
 
 // flags for ioringctx_t, in addition to p_ioring_setupflag
@@ -88,9 +99,8 @@ typedef struct iorings {
   // Written by the application, read-only by driver.
   u32 cq_flags;
 
-  // cq_overflow: number of completion events lost because the queue was full;
-  // this should be avoided by the application by making sure there are not more
-  // requests pending than there is space in the completion queue.
+  // cq_overflow: number of completion events lost because the queue was full and
+  // the driver could not allocate memory to hold them back (P_IORING_FEAT_NODROP).
   // Written by the driver, read-only by application.
   // (i.e. get number of "new events" by comparing to cached value).
   // As completion events come in out of order this counter is not ordered with
@@ -104,76 +114,559 @@ typedef struct iorings {
 } iorings_t;
 
 
+#if defined(HAS_LIBC)
+// io_wq_t: async worker pool, implemented in ioring_iowq.c
+#define IO_WQ_FD_CACHE 32 // number of host fds whose worker group is cached; power of 2
+enum {
+  IO_WQ_ACCT_BOUND,   // workers for operations on regular files
+  IO_WQ_ACCT_UNBOUND, // workers for operations which may wait indefinitely
+  IO_WQ_ACCT_NR
+};
+
+typedef struct io_wq_acct {
+  struct io_wq*  wq;
+  struct ioreq*  head; // queue of operations waiting for a worker
+  struct ioreq** tailp;
+  pthread_cond_t cond; // idle workers wait here
+  u32            nr_workers;
+  u32            nr_idle;
+  u32            max_workers;
+} io_wq_acct_t;
+
+// io_wq_fd_acct_t: cached worker group of a host fd (io_wq_fd_acct)
+typedef struct io_wq_fd_acct {
+  fd_t fd;     // -1 for empty entries
+  u32  closes; // host_fd_close_count(fd) when the group was determined
+  u32  acct;
+} io_wq_fd_acct_t;
+
+typedef struct io_wq {
+  pthread_mutex_t       lock;
+  pthread_cond_t        exit_cond;
+  struct p_ioringctx*   ctx; // NULL until initialized
+  io_wq_acct_t          acct[IO_WQ_ACCT_NR];
+  struct io_wq_running* running; // requests being executed by workers
+  // worker group of recently used host fds; guarded by ctx->uring_lock
+  io_wq_fd_acct_t       fd_acct[IO_WQ_FD_CACHE];
+  u8                    cpumask[128]; // worker CPU affinity (up to 1024 CPUs)
+  u32                   cpumask_len;  // number of valid bytes in cpumask; 0 if not set
+  u32                   cpumask_gen;  // incremented when cpumask changes
+  bool                  exit;
+} io_wq_t;
+
+// io_timer_wheel_t: hierarchical timer wheel of timeouts, implemented in ioring_timeout.c
+#define IO_WHEEL_BITS   6
+#define IO_WHEEL_SIZE   (1u << IO_WHEEL_BITS) // slots per level (bits of a u64 bitmap)
+#define IO_WHEEL_MASK   (IO_WHEEL_SIZE - 1)
+#define IO_WHEEL_LEVELS 4 // the wheel spans 2^24 ticks (4.6 hours)
+
+typedef struct io_timer {
+  struct io_timer*  next;
+  struct io_timer** pprev;   // NULL when not in the wheel
+  u64               expires; // tick
+  u16               slot;    // level * IO_WHEEL_SIZE + index
+} io_timer_t;
+
+typedef struct io_timer_wheel {
+  u64         clk; // next tick to process
+  u32         nr_timers;
+  u64         pending[IO_WHEEL_LEVELS]; // bitmaps of non-empty slots
+  io_timer_t* slots[IO_WHEEL_LEVELS][IO_WHEEL_SIZE];
+} io_timer_wheel_t;
+#endif
+
+
+// io_stats_t: counters of a ring, read through /sys/ioring/stats (ioring_stats.c)
+#define IO_STATS_BUCKETS 24 // latency histogram buckets; see io_stats_bucket
+typedef struct io_stats {
+  // guarded by uring_lock
+  struct {
+    u64 nr_submitted; // SQEs consumed
+    u64 nr_inline;    // requests issued by the submitting thread
+    u64 nr_async;     // requests handed to io-wq workers
+    u64 submit_ns;    // when the current batch of SQEs was submitted (monotonic ns)
+  } _p_cacheline_aligned;
+  // guarded by completion_lock
+  struct {
+    u64 nr_completed;
+    u64 nr_overflowed; // completions held back while the CQ ring was full
+    u32 latency[P_IORING_OP_LAST][IO_STATS_BUCKETS]; // submit to completion, by opcode
+  } _p_cacheline_aligned;
+  // guarded by fsync_lock
+  struct {
+    u64 nr_fsync;         // requests flushed by group commit
+    u64 nr_fsync_flushes; // host flushes they took (see ioring_fsync.c)
+  } _p_cacheline_aligned;
+} io_stats_t;
+
+
 // ioringctx_t: ioring instance data
 typedef struct p_ioringctx {
-  iorings_t* rings;
+  iorings_t* rings;     // start of the ring memory (rings followed by SQEs)
+  usize      rings_size; // size of the ring memory
   u32 flags; // enum ioring_setupflag
+  fd_t fd;   // of the ring's vfile
+  u32  refs;   // threads using the context, plus one of the ring's vfile (ioringctx_lookup)
+  bool closed; // the ring's vfile has been closed; the context is being torn down
 
   // submission data
   struct {
     u32*            sq_array;
     p_ioring_sqe_t* sq_sqes;
     u32             sq_entries;
+    u32             cached_sq_head; // next sq entry to consume
   } _p_cacheline_aligned;
 
   // completion data
   struct {
     u32 cq_entries;
+    u32 cached_cq_tail; // next cq entry to produce
+    u32 nr_completed;   // number of requests completed (guarded by completion_lock)
+    // completion events held back while the CQ ring is full (guarded by completion_lock)
+    struct io_overflow_cqe*  cq_overflow_head;
+    struct io_overflow_cqe** cq_overflow_tailp;
+  } _p_cacheline_aligned;
+
+  // requests waiting for earlier requests to complete (P_IORING_SQE_IO_DRAIN);
+  // guarded by uring_lock
+  struct ioreq*  defer_head;
+  struct ioreq** defer_tailp;
+  u32            sq_seq;     // number of requests submitted
+  bool           drain_next; // the next chain drains (IO_DRAIN on a non-head member)
+
+  // registered resources (ioring_rsrc.c)
+  p_iovec_t*            user_bufs;
+  u32                   nr_user_bufs;
+  struct io_fixed_file* file_table;
+  u32                   nr_user_files;
+
+  // provided buffer groups (ioring_kbuf.c)
+  struct io_buffer_list* io_bl;
+  u32                    nr_io_bl;
+  u32                    io_bl_cap;
+
+  io_stats_t stats;
+
+  #if defined(HAS_LIBC)
+  // held while submitting SQEs and while registering resources
+  pthread_mutex_t uring_lock;
+
+  // completions are posted both by the submitting thread and by io-wq workers
+  pthread_mutex_t completion_lock;
+
+  // guards provided buffer groups, which are used by io-wq workers
+  pthread_mutex_t kbuf_lock;
+
+  // eventfd notified of completions (P_IORING_REGISTER_EVENTFD);
+  // guarded by completion_lock
+  int  cq_ev_fd;       // our duplicate of the registered fd
+  u32  cq_ev_tail;     // CQ tail when cq_ev_fd was last notified
+  bool cq_ev_fd_set;
+  bool cq_ev_fd_async; // P_IORING_REGISTER_EVENTFD_ASYNC
+
+  // completion waiters (ioring_wait.c)
+  struct {
+    u32             cq_waiters;  // number of threads parked in io_cqring_wait
+    u32             cq_spin_ns;  // how long io_cqring_wait spins before parking (ns)
+    #if !defined(__linux__)
+    pthread_mutex_t cq_wait_lock; // on Linux, waiters park on a futex instead
+    pthread_cond_t  cq_wait_cond;
+    #endif
+  } _p_cacheline_aligned;
+
+  // SQ poll thread (P_IORING_SETUP_SQPOLL)
+  struct {
+    pthread_t       sq_thread;
+    pthread_mutex_t sq_thread_lock;
+    pthread_cond_t  sq_thread_cond;
+    u32             sq_thread_idle; // milliseconds
+    u32             sq_thread_cpu;  // with P_IORING_SETUP_SQ_AFF
+    bool            sq_thread_started;
+    bool            sq_thread_wakeup; // P_IORING_ENTER_SQ_WAKEUP was requested
+    bool            sq_thread_stop;
+  } _p_cacheline_aligned;
+
+  io_wq_t wq;
+
+  // FSYNC group commit (ioring_fsync.c)
+  pthread_mutex_t        fsync_lock;
+  struct io_fsync_group* fsync_groups; // files with FSYNCs in flight
+
+  // timeouts (ioring_timeout.c); guarded by completion_lock
+  struct {
+    io_timer_wheel_t    timer_wheel;
+    struct io_timeout*  timeout_list;     // TIMEOUTs without a completion count
+    struct io_timeout*  timeout_seq_list; // TIMEOUTs with a completion count, by target
+    struct io_timeout*  timeout_fired;    // to be completed by the timer thread
+    u32                 cq_timeouts;      // number of TIMEOUTs completed
+    pthread_t           timer_thread;
+    pthread_cond_t      timer_cond;
+    u64                 timer_deadline;   // when the timer thread wakes up, if sleeping
+    bool                timer_started;
+    bool                timer_stop;
+  } _p_cacheline_aligned;
+
+  // polls and multishot operations (ioring_poll.c); guarded by completion_lock
+  struct {
+    struct io_poll* poll_list;       // armed on host files; serviced by the poll thread
+    struct io_poll* poll_vfile_list; // armed on vfiles; serviced by the vfile thread
+    pthread_t       poll_thread;
+    pthread_t       poll_vfile_thread;
+    pthread_cond_t  poll_vfile_cond; // wakes the vfile thread
+    int             poll_wake_fd[2]; // pipe which interrupts the poll thread
+    bool            poll_started;
+    bool            poll_vfile_started;
+    bool            poll_stop;
+    bool            poll_rearm;      // multishot polls are waiting for ioring_enter
   } _p_cacheline_aligned;
+  #endif
 } ioringctx_t;
 
 
-// memalloc_header_t: mem_alloc metadata
-typedef struct memalloc_header {
-  usize size;
-} _p_cacheline_aligned memalloc_header_t;
+#if defined(HAS_LIBC)
+// SQ poll thread, implemented in ioring_sqpoll.c
+static err_t io_sq_thread_check(p_ioring_params_t* p);
+static err_t io_sq_thread_start(ioringctx_t* ctx);
+static void io_sq_thread_stop(ioringctx_t* ctx);
+
+// io-wq, implemented in ioring_iowq.c
+static void io_wq_init(io_wq_t* wq, ioringctx_t* ctx);
+static void io_wq_exit(io_wq_t* wq);
+
+#define io_ring_lock(ctx)   pthread_mutex_lock(&(ctx)->uring_lock)
+#define io_ring_unlock(ctx) pthread_mutex_unlock(&(ctx)->uring_lock)
+#define io_cq_lock(ctx)     pthread_mutex_lock(&(ctx)->completion_lock)
+#define io_cq_unlock(ctx)   pthread_mutex_unlock(&(ctx)->completion_lock)
+#else
+#define io_ring_lock(ctx)   ((void)0)
+#define io_ring_unlock(ctx) ((void)0)
+#define io_cq_lock(ctx)     ((void)0)
+#define io_cq_unlock(ctx)   ((void)0)
+#endif
+
+// io_ring_submit_lock takes ctx->uring_lock for an operation which needs it, unless the
+// request is executed by a thread which already holds it (i.e. not an io-wq worker)
+#define io_ring_submit_lock(ctx, req) \
+  ({ if ((req)->flags & IOREQ_F_ASYNC) io_ring_lock(ctx); })
+#define io_ring_submit_unlock(ctx, req) \
+  ({ if ((req)->flags & IOREQ_F_ASYNC) io_ring_unlock(ctx); })
+
+
+// ioreq_flag_t: ioreq_t.flags
+typedef enum ioreq_flag {
+  IOREQ_F_FIXED_FILE = 1 << 0, // file was taken from the registered file table
+  IOREQ_F_BOUND      = 1 << 1, // file is a regular or block file (io-wq bound work)
+  IOREQ_F_ALLOC      = 1 << 2, // allocated by io_req_alloc; freed when completed
+  IOREQ_F_ASYNC      = 1 << 3, // executed by an io-wq worker, without ctx->uring_lock
+  IOREQ_F_IO_DRAIN   = 1 << 4, // don't issue until all earlier requests have completed
+  IOREQ_F_FAIL       = 1 << 5, // failed; severs a link chain (e.g. short read)
+  IOREQ_F_FD_REF     = 1 << 6, // holds fd_ref, a duplicate of host fd fd (io_wq_punt)
+} ioreq_flag_t;
+
+// ioreq_t: a request being processed by the driver.
+// The SQE is copied so that the application may reuse its slot as soon as the
+// SQ head has been advanced past it.
+typedef struct ioreq {
+  p_ioring_sqe_t sqe;
+  fd_t           fd;   // host fd or vfile fd operated on (for needs_file operations)
+  fd_t           fd_ref; // with IOREQ_F_FD_REF; use io_req_hostfd
+  vfile_t*       file; // non-NULL if fd is a vfile
+  u32            file_gen; // file->gen when the file was looked up, for vfile_pin
+  u32            flags; // ioreq_flag_t
+  u32            cflags; // P_IORING_CQE_F_ flags of the completion
+  u32            seq;  // number of requests submitted before this one
+  u64            submit_ns; // when it was submitted (io_stats_t.submit_ns)
+  struct ioreq*  link; // next request of a link chain, issued when this one completes
+  struct ioreq*  next; // io-wq queue link or defer list link
+  struct io_timeout* timeout;      // TIMEOUT, LINK_TIMEOUT: timer state
+  struct io_timeout* link_timeout; // LINK_TIMEOUT guarding this request
+} ioreq_t;
+
+// io_fixed_file_t: entry of the registered file table (ioring_rsrc.c)
+typedef struct io_fixed_file {
+  vfile_t* file;  // non-NULL for vfiles
+  u32      gen;   // file->gen when the vfile was registered
+  fd_t     fd;    // -1 for empty slots
+  u32      flags; // ioreq_flag_t to apply to requests using the file
+} io_fixed_file_t;
+
+
+// io_overflow_cqe_t: a completion event held back while the CQ ring is full
+typedef struct io_overflow_cqe {
+  struct io_overflow_cqe* next;
+  p_ioring_cqe_t          cqe;
+} io_overflow_cqe_t;
+
+
+// ioringctx_slot_t: registry entry of a ring context.
+// Contexts are allocated on demand and kept in a lock-free list, g_ioring_slots.
+// A context is never returned to the heap; the context of a closed ring is recycled
+// by a later ioring_setup. Threads using a ring hold a reference to its context
+// (ioringctx_lookup) and closing the ring waits for them to drop it before tearing
+// the context down, so a context is not recycled while it is in use.
+// Entries are never unlinked, which makes the list free of ABA problems: a context is
+// claimed by swapping its slot's inuse from 0 to 1, and new slots are pushed at the head.
+typedef struct ioringctx_slot {
+  ioringctx_t            ctx; // must be first
+  struct ioringctx_slot* next; // immutable once published
+  u32                    inuse;
+  #if defined(HAS_LIBC)
+  // signalled when ctx.refs drops to zero. Outlive the context, so that a thread
+  // dropping the last reference can signal after the context has been torn down.
+  pthread_mutex_t        ref_lock;
+  pthread_cond_t         ref_cond;
+  #endif
+} ioringctx_slot_t;
+
+static ioringctx_slot_t* g_ioring_slots = NULL;
+
+// max number of SQ entries of a ring; CQ rings may have twice as many
+static u32 g_ioring_max_entries = IORING_MAX_ENTRIES;
+
+
+u32 ioring_max_entries() {
+  return __atomic_load_n(&g_ioring_max_entries, __ATOMIC_RELAXED);
+}
+
+
+err_t ioring_set_max_entries(u32 n) {
+  if (n == 0 || n > IORING_MAX_ENTRIES_LIMIT || n != ceil_pow2(n))
+    return p_err_invalid;
+  __atomic_store_n(&g_ioring_max_entries, n, __ATOMIC_RELAXED);
+  return 0;
+}
 
 
-// ioring instances as globals as most programs will only use one, maybe two, iorings.
-// TODO: something more flexible
-static ioringctx_t g_ioringv[8] = {0};
-static u32         g_ioringc = 0;
+#include "ioring_mem.c"
 
 
-static void* mem_alloc(usize size) {
-  memalloc_header_t* h = mmap(NULL, size + sizeof(memalloc_header_t),
-    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
-  if (h == MAP_FAILED)
-    return NULL;
-  h->size = size;
-  return &h[1];
+// io_req_alloc allocates a request which outlives its submission: a member of a
+// link chain, a deferred request or one handed to an io-wq worker
+static ioreq_t* io_req_alloc() {
+  #if defined(HAS_LIBC)
+  ioreq_t* req = malloc(sizeof(ioreq_t));
+  #else
+  ioreq_t* req = mem_alloc(sizeof(ioreq_t));
+  #endif
+  if (req)
+    req->flags = IOREQ_F_ALLOC;
+  return req;
+}
+
+
+// io_req_hostfd returns the host fd to perform the operation of req on
+static inline fd_t io_req_hostfd(const ioreq_t* req) {
+  return (req->flags & IOREQ_F_FD_REF) ? req->fd_ref : req->fd;
 }
 
 
-static void mem_free(void* p) {
-  if (!p)
+static void io_req_free(ioreq_t* req) {
+  if (!(req->flags & IOREQ_F_ALLOC))
     return;
-  memalloc_header_t* h = ((memalloc_header_t*)p) - 1;
-  munmap(h, h->size);
+  #if defined(HAS_LIBC)
+  if (req->flags & IOREQ_F_FD_REF)
+    close((int)req->fd_ref);
+  free(req);
+  #else
+  mem_free(req, sizeof(ioreq_t));
+  #endif
+}
+
+
+// io_req_free_chain frees req and the requests linked to it, without completing them
+static void io_req_free_chain(ioreq_t* req) {
+  while (req) {
+    ioreq_t* link = req->link;
+    io_req_free(req);
+    req = link;
+  }
 }
 
 
+// io_req_persist returns req, or a copy of it if it's on the submitter's stack, for a
+// request which completes after io_issue_sqe has returned. Returns NULL if out of memory.
+static ioreq_t* io_req_persist(ioreq_t* req) {
+  if (req->flags & IOREQ_F_ALLOC)
+    return req;
+  ioreq_t* r = io_req_alloc();
+  if (r) {
+    memcpy(r, req, sizeof(ioreq_t));
+    r->flags |= IOREQ_F_ALLOC;
+  }
+  return r;
+}
+
+
+static ioringctx_t* ioringctx_lookup(fd_t ring);
+static void ioringctx_put(ioringctx_t* ctx);
+static void io_destroy_buffers(ioringctx_t* ctx); // ioring_kbuf.c
+static isize io_msg_ring(ioringctx_t* ctx, ioreq_t* req); // with the CQ ring functions
+
+#if defined(HAS_LIBC)
+// timeouts, implemented in ioring_timeout.c
+struct io_timeout;
+static u64 io_nanotime();
+static void io_timer_init(ioringctx_t* ctx);
+static void io_timer_exit(ioringctx_t* ctx);
+static void io_timeout_free(struct io_timeout* t);
+static void io_flush_timeouts(ioringctx_t* ctx);
+static struct io_timeout* io_disarm_link_timeout(ioringctx_t* ctx, ioreq_t* req);
+static void io_arm_link_timeout(ioringctx_t* ctx, ioreq_t* req);
+static isize io_timeout(ioringctx_t* ctx, ioreq_t* req);
+static isize io_timeout_remove(ioringctx_t* ctx, ioreq_t* req);
+static isize io_link_timeout(ioringctx_t* ctx, ioreq_t* req);
+
+// completion waits, implemented in ioring_wait.c
+static void io_cqring_wake(ioringctx_t* ctx);
+
+// cancellation, implemented in ioring_cancel.c
+typedef struct io_cancel_data {
+  u64      data;  // user_data to match
+  fd_t     fd;    // file to match, with P_IORING_ASYNC_CANCEL_FD
+  u32      flags; // P_IORING_ASYNC_CANCEL_ flags
+  ioreq_t* self;  // the cancel request, which never matches itself
+  ioreq_t* req;   // if non-NULL, the only request to match (LINK_TIMEOUT expiry)
+} io_cancel_data_t;
+static bool io_cancel_match(const ioreq_t* req, const io_cancel_data_t* cd);
+static bool io_cancel_all(const io_cancel_data_t* cd);
+static isize io_async_cancel(ioringctx_t* ctx, ioreq_t* req);
+static void io_cancel_ring_exit(ioringctx_t* ctx);
+
+// polls and multishot operations, implemented in ioring_poll.c
+static void io_poll_init(ioringctx_t* ctx);
+static void io_poll_exit(ioringctx_t* ctx);
+static u32 __io_poll_cancel(ioringctx_t* ctx, const io_cancel_data_t* cd);
+static void io_poll_rearm(ioringctx_t* ctx);
+static isize io_poll_add_req(ioringctx_t* ctx, ioreq_t* req, u32 events, bool multishot);
+static isize io_poll_add(ioringctx_t* ctx, ioreq_t* req);
+static isize io_poll_remove(ioringctx_t* ctx, ioreq_t* req);
+static isize io_read_multishot(ioringctx_t* ctx, ioreq_t* req);
+
+// file sync operations, implemented in ioring_fsync.c
+static err_t io_prep_fsync(ioringctx_t* ctx, ioreq_t* req);
+static isize io_fsync(ioringctx_t* ctx, ioreq_t* req);
+static isize io_sync_file_range(ioringctx_t* ctx, ioreq_t* req);
+#endif
+
+#include "ioring_rsrc.c"
+#include "ioring_stats.c"
+
+
 static void ioringctx_free(ioringctx_t* ctx) {
-  mem_free(ctx->rings); ctx->rings = NULL;
-  mem_free(ctx->sq_sqes); ctx->sq_sqes = NULL;
+  #if defined(HAS_LIBC)
+  io_sq_thread_stop(ctx);
+  io_poll_exit(ctx);
+  io_wq_exit(&ctx->wq);
+  io_timer_exit(ctx);
+  #endif
+
+  // requests which never got to run (e.g. waiting for a drain request)
+  while (ctx->defer_head) {
+    ioreq_t* req = ctx->defer_head;
+    ctx->defer_head = req->next;
+    io_req_free_chain(req);
+  }
+
+  // completion events held back while the CQ ring was full
+  while (ctx->cq_overflow_head) {
+    io_overflow_cqe_t* ocqe = ctx->cq_overflow_head;
+    ctx->cq_overflow_head = ocqe->next;
+    #if defined(HAS_LIBC)
+    free(ocqe);
+    #else
+    mem_free(ocqe, sizeof(*ocqe));
+    #endif
+  }
+
+  #if defined(HAS_LIBC)
+  if (ctx->cq_ev_fd_set)
+    close(ctx->cq_ev_fd);
+  pthread_mutex_destroy(&ctx->uring_lock);
+  pthread_mutex_destroy(&ctx->completion_lock);
+  pthread_mutex_destroy(&ctx->kbuf_lock);
+  pthread_mutex_destroy(&ctx->sq_thread_lock);
+  pthread_cond_destroy(&ctx->sq_thread_cond);
+  pthread_mutex_destroy(&ctx->fsync_lock);
+  #if !defined(__linux__)
+  pthread_mutex_destroy(&ctx->cq_wait_lock);
+  pthread_cond_destroy(&ctx->cq_wait_cond);
+  #endif
+  #endif
+
+  io_sqe_buffers_free(ctx);
+  io_sqe_files_free(ctx);
+  io_destroy_buffers(ctx);
+  mem_ring_free(ctx->rings, ctx->rings_size);
+  ctx->rings = NULL;
+  ctx->sq_sqes = NULL;
 
   ctx->flags = 0; // mark as free
+  ctx->fd = -1;
+
+  // hand the context back to the registry
+  ioringctx_slot_t* slot = (ioringctx_slot_t*)ctx;
+  __atomic_store_n(&slot->inuse, 0, __ATOMIC_RELEASE);
+}
+
 
-  // free up entries in g_ioringv
-  i32 i = (i32)(g_ioringc - 1);
-  if (&g_ioringv[i] == ctx) { // unwind
-    for (; i >= 0 && g_ioringv[i].flags == 0; i--)
-      g_ioringc--;
+// ioringctx_slot_claim takes the context of a closed ring, or allocates a new one
+static ioringctx_slot_t* ioringctx_slot_claim() {
+  ioringctx_slot_t* slot = __atomic_load_n(&g_ioring_slots, __ATOMIC_ACQUIRE);
+  for (; slot; slot = slot->next) {
+    u32 inuse = 0;
+    if (READ_ONCE(slot->inuse) == 0 &&
+        __atomic_compare_exchange_n(
+          &slot->inuse, &inuse, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    {
+      return slot;
+    }
   }
+
+  // ioringctx_slot_t is larger than a slab object; mem_alloc maps it on its own,
+  // aligned to a page as ioringctx_t needs
+  slot = mem_alloc(sizeof(ioringctx_slot_t));
+  if (!slot)
+    return NULL;
+  dlog("new ring context %p", slot);
+  slot->inuse = 1;
+  #if defined(HAS_LIBC)
+  pthread_mutex_init(&slot->ref_lock, NULL);
+  pthread_cond_init(&slot->ref_cond, NULL);
+  #endif
+  slot->next = __atomic_load_n(&g_ioring_slots, __ATOMIC_RELAXED);
+  // publish; orders the stores to *slot with loads of other threads walking the list
+  while (!__atomic_compare_exchange_n(
+           &g_ioring_slots, &slot->next, slot, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+  {}
+  return slot;
 }
 
 
 static ioringctx_t* ioringctx_alloc(p_ioring_params_t* p) {
-  dlog("index %u", (u32)g_ioringc);
-  if (g_ioringc >= ARRAY_LEN(g_ioringv))
+  ioringctx_slot_t* slot = ioringctx_slot_claim();
+  if (!slot)
     return NULL;
-  ioringctx_t* ctx = &g_ioringv[g_ioringc++];
+  ioringctx_t* ctx = &slot->ctx;
+  memset(ctx, 0, sizeof(*ctx)); // may have been used by a closed ring
   ctx->flags = p->flags | IORING_CTX_INIT;
+  ctx->fd = -1; // set by ioring_base_setup
+  ctx->refs = 1; // dropped by _ioring_release
+  ctx->defer_tailp = &ctx->defer_head;
+  ctx->cq_overflow_tailp = &ctx->cq_overflow_head;
+  #if defined(HAS_LIBC)
+  pthread_mutex_init(&ctx->uring_lock, NULL);
+  pthread_mutex_init(&ctx->completion_lock, NULL);
+  pthread_mutex_init(&ctx->kbuf_lock, NULL);
+  pthread_mutex_init(&ctx->sq_thread_lock, NULL);
+  pthread_cond_init(&ctx->sq_thread_cond, NULL);
+  pthread_mutex_init(&ctx->fsync_lock, NULL);
+  #if !defined(__linux__)
+  pthread_mutex_init(&ctx->cq_wait_lock, NULL);
+  pthread_cond_init(&ctx->cq_wait_cond, NULL);
+  #endif
+  io_timer_init(ctx);
+  io_poll_init(ctx);
+  #endif
   return ctx;
 }
 
@@ -203,67 +696,97 @@ static usize iorings_size(u32 sq_entries, u32 cq_entries, usize* sq_offset) {
 
 
 // alloc_rings allocates ctx->rings and ctx->sq_sqes (submission queue entries)
+// The SQEs follow the rings in the same memory region.
 static err_t alloc_rings(ioringctx_t* ctx, p_ioring_params_t* p) {
   ctx->sq_entries = p->sq_entries;
   ctx->cq_entries = p->cq_entries;
 
-  // allocate memory for rings
   usize sq_array_offset;
   usize size = iorings_size(p->sq_entries, p->cq_entries, &sq_array_offset);
   if (size == USIZE_MAX)
     return p_err_overflow;
 
-  iorings_t* rings = mem_alloc(size);
+  usize sqes_offset = ALIGN(size, L1_CACHELINE_NBYTE);
+  usize sqes_size = array_size(sizeof(p_ioring_sqe_t), p->sq_entries);
+  if (sqes_offset == 0 || sqes_size == USIZE_MAX ||
+      check_add_overflow(sqes_offset, sqes_size, &size))
+  {
+    return p_err_overflow;
+  }
+
+  iorings_t* rings = mem_ring_alloc(size);
   if (!rings)
     return p_err_nomem;
 
+  // the memory may have been used by a closed ring
+  memset(rings, 0, offsetof(iorings_t, cqes));
+
   ctx->rings = rings;
+  ctx->rings_size = size;
   ctx->sq_array = (u32*)((char*)rings + sq_array_offset);
+  ctx->sq_sqes = (p_ioring_sqe_t*)((char*)rings + sqes_offset);
   rings->sq_ring_mask = p->sq_entries - 1;
   rings->cq_ring_mask = p->cq_entries - 1;
   rings->sq_ring_entries = p->sq_entries;
   rings->cq_ring_entries = p->cq_entries;
+  return 0;
+}
 
-  // allocate memory for submission queue entries
-  size = array_size(sizeof(p_ioring_sqe_t), p->sq_entries);
-  if (size == USIZE_MAX)
-    goto err;
 
-  ctx->sq_sqes = mem_alloc(size);
-  if (!ctx->sq_sqes)
-    goto err;
+// io_ring_entries checks the ring sizes requested with ioring_setup against
+// ioring_max_entries and sets p->sq_entries and p->cq_entries.
+// By default the CQ ring is twice the size of the SQ ring; with P_IORING_SETUP_CQSIZE
+// it has p->cq_entries entries, which must be at least as many as the SQ ring has.
+// With P_IORING_SETUP_CLAMP, sizes are limited rather than rejected.
+static err_t io_ring_entries(u32 entries, p_ioring_params_t* p) {
+  u32 max_entries = ioring_max_entries();
+  if (entries == 0)
+    return p_err_invalid;
+  if (entries > max_entries) {
+    if (!(p->flags & P_IORING_SETUP_CLAMP))
+      return p_err_invalid;
+    entries = max_entries;
+  }
+  p->sq_entries = ceil_pow2(entries);
 
+  if (!(p->flags & P_IORING_SETUP_CQSIZE)) {
+    p->cq_entries = 2 * p->sq_entries;
+    return 0;
+  }
+  if (p->cq_entries == 0)
+    return p_err_invalid;
+  if (p->cq_entries > 2 * max_entries) {
+    if (!(p->flags & P_IORING_SETUP_CLAMP))
+      return p_err_invalid;
+    p->cq_entries = 2 * max_entries;
+  }
+  p->cq_entries = ceil_pow2(p->cq_entries);
+  if (p->cq_entries < p->sq_entries)
+    return p_err_invalid;
   return 0;
-err:
-  mem_free(ctx->rings);
-  ctx->rings = NULL;
-  return p_err_nomem;
 }
 
 
 static err_t ioring_create(ioringctx_t** ctx_out, u32 entries, p_ioring_params_t* p) {
   // check for unsupported flags
   if (p->flags & ( P_IORING_SETUP_IOPOLL
-                 | P_IORING_SETUP_SQPOLL
-                 | P_IORING_SETUP_CQSIZE
-                 | P_IORING_SETUP_SQ_AFF
                  | P_IORING_SETUP_ATTACH_WQ
   )) {
     return p_err_not_supported;
   }
 
-  // check that entries count is within limits
-  if (entries == 0) {
-    return p_err_invalid;
-  } else if (entries > IORING_MAX_ENTRIES) {
-    if (!(p->flags & P_IORING_SETUP_CLAMP))
-      return p_err_invalid;
-    entries = IORING_MAX_ENTRIES;
-  }
+  #if defined(HAS_LIBC)
+  err_t e = io_sq_thread_check(p);
+  #else
+  err_t e = (p->flags & (P_IORING_SETUP_SQPOLL | P_IORING_SETUP_SQ_AFF)) ?
+            p_err_not_supported : 0;
+  #endif
+  if (e)
+    return e;
 
-  // use twice as many entries for the CQ ring
-  p->sq_entries = ceil_pow2(entries);
-  p->cq_entries = 2 * p->sq_entries;
+  e = io_ring_entries(entries, p);
+  if (e)
+    return e;
 
   // allocate a ioring context structure
   ioringctx_t* ctx = ioringctx_alloc(p);
@@ -271,11 +794,21 @@ static err_t ioring_create(ioringctx_t** ctx_out, u32 entries, p_ioring_params_t
     return p_err_nomem;
 
   // allocate ring memory
-  err_t e = alloc_rings(ctx, p);
+  e = alloc_rings(ctx, p);
   if (e)
     goto err;
 
-  // Note: no support for SQPOLL, so not doing any work to set that up
+  // the SQ poll thread is started by ioring_base_setup, or by
+  // P_IORING_REGISTER_ENABLE_RINGS when the ring starts disabled
+  #if defined(HAS_LIBC)
+  io_wq_init(&ctx->wq, ctx);
+  if (p->flags & P_IORING_SETUP_SQPOLL) {
+    if (p->sq_thread_idle == 0)
+      p->sq_thread_idle = IORING_SQ_THREAD_IDLE_DEFAULT;
+    ctx->sq_thread_idle = p->sq_thread_idle;
+    ctx->sq_thread_cpu = p->sq_thread_cpu;
+  }
+  #endif
 
   // update p with submission queue offsets
   memset(&p->sq_off, 0, sizeof(p->sq_off));
@@ -300,13 +833,15 @@ static err_t ioring_create(ioringctx_t** ctx_out, u32 entries, p_ioring_params_t
   // tell the application what features are supported
   p->features = P_IORING_FEAT_SINGLE_MMAP
               | P_IORING_FEAT_NODROP
-              // | P_IORING_FEAT_SUBMIT_STABLE
-              // | P_IORING_FEAT_RW_CUR_POS
+              | P_IORING_FEAT_SUBMIT_STABLE
+              | P_IORING_FEAT_RW_CUR_POS
               // | P_IORING_FEAT_CUR_PERSONALITY
               // | P_IORING_FEAT_FAST_POLL
               // | P_IORING_FEAT_POLL_32BITS
-              // | P_IORING_FEAT_SQPOLL_NONFIXED
-              // | P_IORING_FEAT_EXT_ARG
+              #if defined(HAS_LIBC)
+              | P_IORING_FEAT_SQPOLL_NONFIXED
+              #endif
+              | P_IORING_FEAT_EXT_ARG
               // | P_IORING_FEAT_NATIVE_WORKERS
               // | P_IORING_FEAT_RSRC_TAGS
               ;
@@ -319,8 +854,36 @@ err:
 }
 
 
+// _ioring_release is called once the ring's vfile is out of the map, so no more
+// references can be taken. It waits for the threads using the ring to drop theirs;
+// threads waiting for completions are woken up and fail with p_err_badfd.
 static err_t _ioring_release(vfile_t* f) {
   ioringctx_t* ctx = f->data;
+  #if defined(HAS_LIBC)
+  ioringctx_slot_t* slot = (ioringctx_slot_t*)ctx;
+  WRITE_ONCE(ctx->closed, true);
+  ioringctx_put(ctx);
+  pthread_mutex_lock(&slot->ref_lock);
+  while (__atomic_load_n(&ctx->refs, __ATOMIC_ACQUIRE)) {
+    // a waiter may have checked ctx->closed just before we set it and parked after
+    // the wakeup, so keep waking waiters up
+    io_cqring_wake(ctx);
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    u64 t = (u64)ts.tv_sec*1000000000ull + (u64)ts.tv_nsec + IORING_RELEASE_RETRY_INTERVAL;
+    ts.tv_sec = (time_t)(t / 1000000000ull);
+    ts.tv_nsec = (long)(t % 1000000000ull);
+    pthread_cond_timedwait(&slot->ref_cond, &slot->ref_lock, &ts);
+  }
+  pthread_mutex_unlock(&slot->ref_lock);
+  // requests may be blocked in host syscalls which never return, e.g. a read of a
+  // pipe; cancel them (after stopping the SQ thread, which would submit more)
+  io_sq_thread_stop(ctx);
+  io_cancel_ring_exit(ctx);
+  #else
+  ioringctx_put(ctx);
+  assert(ctx->refs == 0); // without threads, nothing else can be using the ring
+  #endif
   ioringctx_free(ctx);
   return 0;
 }
@@ -330,6 +893,7 @@ static err_t _ioring_mmap(vfile_t* f, void** addr, usize sz, mmapflag_t flag, us
   ioringctx_t* ctx = f->data;
   switch (offs) {
     case P_IORING_OFF_SQ_RING:
+    case P_IORING_OFF_CQ_RING: // P_IORING_FEAT_SINGLE_MMAP
       // TODO check sz argument
       *addr = ctx->rings;
       return 0;
@@ -349,7 +913,7 @@ static const vfile_ops_t fops = {
 };
 
 
-fd_t _psys_ioring_setup(psysop_t _, u32 entries, p_ioring_params_t* params) {
+static fd_t ioring_base_setup(u32 entries, p_ioring_params_t* params) {
   p_ioring_params_t p;
   if (!copy_from_user(&p, params, sizeof(p)))
     return p_err_mfault;
@@ -379,16 +943,1130 @@ fd_t _psys_ioring_setup(psysop_t _, u32 entries, p_ioring_params_t* params) {
     ioringctx_free(ctx);
     return fd;
   }
-  f->data = ctx;
+  ctx->fd = fd;
+  // pairs with ioringctx_lookup; f->data is NULL until the context is ready
+  __atomic_store_n(&f->data, ctx, __ATOMIC_RELEASE);
+
+  #if defined(HAS_LIBC)
+  if ((ctx->flags & P_IORING_SETUP_SQPOLL) && !(ctx->flags & P_IORING_SETUP_R_DISABLED)) {
+    if ((err = io_sq_thread_start(ctx))) {
+      vfile_close(f);
+      return err;
+    }
+  }
+  #endif
+
   return fd;
 }
 
 
-isize _psys_ioring_enter(psysop_t _, fd_t ring, u32 to_submit, u32 min_complete, u32 flags) {
-  return p_err_not_supported;
+// ioringctx_lookup returns the context of the ring fd ring with a reference, to be
+// dropped with ioringctx_put, or NULL if ring is not a ring. The reference is taken
+// while the vfile map is locked, which keeps the ring from being closed in between.
+static ioringctx_t* ioringctx_lookup(fd_t ring) {
+  ioringctx_t* ctx = NULL;
+  vfile_t* f = vfile_lookup_hold(ring);
+  if (f && f->fops == &fops) {
+    ctx = __atomic_load_n(&f->data, __ATOMIC_ACQUIRE);
+    if (ctx)
+      __atomic_fetch_add(&ctx->refs, 1, __ATOMIC_RELAXED);
+  }
+  vfile_lookup_done();
+  return ctx;
+}
+
+
+static void ioringctx_put(ioringctx_t* ctx) {
+  if (__atomic_sub_fetch(&ctx->refs, 1, __ATOMIC_ACQ_REL))
+    return;
+  // the ring has been closed; wake up _ioring_release
+  #if defined(HAS_LIBC)
+  ioringctx_slot_t* slot = (ioringctx_slot_t*)ctx;
+  pthread_mutex_lock(&slot->ref_lock);
+  pthread_cond_broadcast(&slot->ref_cond);
+  pthread_mutex_unlock(&slot->ref_lock);
+  #endif
+}
+
+
+// ---------------------------------------------------------------------------------------
+// operations
+
+
+// MAX_RW_COUNT: max number of bytes transferred by one read or write operation,
+// making sure the result fits in p_ioring_cqe_t.res (value from Linux)
+#define MAX_RW_COUNT ((usize)0x7ffff000)
+
+// IO_ISSUE_QUEUED is returned by an operation's issue function when the request
+// completes later (e.g. a timeout); not a valid result of any operation.
+#define IO_ISSUE_QUEUED ((isize)-0x1000)
+
+
+static isize io_nop(ioringctx_t* ctx, ioreq_t* req) {
+  return 0;
+}
+
+
+// io_do_read reads from the file resolved by io_file_get.
+// sqe->off -1 reads from the current file position (P_IORING_FEAT_RW_CUR_POS).
+// Virtual files are streams and ignore sqe->off.
+// A short read or write severs a link chain, like a failed one (as in Linux.)
+static isize io_do_read(ioreq_t* req) {
+  void* buf = (void*)(usize)req->sqe.addr;
+  usize len = MIN((usize)req->sqe.len, MAX_RW_COUNT);
+  isize res;
+  if (req->file) {
+    // keeps the file from being released, and its vfile_t reused, during the read
+    if (!vfile_pin(req->file, req->file_gen)) // closed since io_file_get
+      return p_err_badfd;
+    const vfile_ops_t* ops = req->file->fops;
+    res = ops->read ? ops->read(req->file, buf, len) : p_err_not_supported;
+    vfile_unpin(req->file);
+  } else {
+    res = _psys_pread_host(0, io_req_hostfd(req), buf, len, req->sqe.off);
+  }
+  if (res >= 0 && (usize)res < len)
+    req->flags |= IOREQ_F_FAIL;
+  return res;
+}
+
+
+static isize io_do_write(ioreq_t* req) {
+  const void* buf = (const void*)(usize)req->sqe.addr;
+  usize len = MIN((usize)req->sqe.len, MAX_RW_COUNT);
+  isize res;
+  if (req->file) {
+    if (!vfile_pin(req->file, req->file_gen)) // closed since io_file_get
+      return p_err_badfd;
+    const vfile_ops_t* ops = req->file->fops;
+    res = ops->write ? ops->write(req->file, buf, len) : p_err_not_supported;
+    vfile_unpin(req->file);
+  } else {
+    res = _psys_pwrite_host(0, io_req_hostfd(req), buf, len, req->sqe.off);
+  }
+  if (res >= 0 && (usize)res < len)
+    req->flags |= IOREQ_F_FAIL;
+  return res;
+}
+
+
+#include "ioring_kbuf.c"
+
+
+static isize io_read(ioringctx_t* ctx, ioreq_t* req) {
+  if (req->sqe.rw_flags)
+    return p_err_invalid;
+  if (req->sqe.flags & P_IORING_SQE_BUFFER_SELECT)
+    return io_read_select(ctx, req);
+  if (req->sqe.buf_index)
+    return p_err_invalid;
+  return io_do_read(req);
+}
+
+
+static isize io_write(ioringctx_t* ctx, ioreq_t* req) {
+  if (req->sqe.rw_flags || req->sqe.buf_index)
+    return p_err_invalid;
+  return io_do_write(req);
+}
+
+
+// READ_FIXED and WRITE_FIXED use a registered buffer, checked by io_prep_rw_fixed
+static err_t io_prep_rw_fixed(ioringctx_t* ctx, ioreq_t* req) {
+  if (req->sqe.rw_flags)
+    return p_err_invalid;
+  return io_import_fixed(ctx, &req->sqe);
+}
+
+
+static isize io_read_fixed(ioringctx_t* ctx, ioreq_t* req) {
+  return io_do_read(req);
+}
+
+
+static isize io_write_fixed(ioringctx_t* ctx, ioreq_t* req) {
+  return io_do_write(req);
+}
+
+
+// With sqe->file_index, OPENAT installs the new file into slot file_index-1 of the
+// registered file table rather than returning a file descriptor, so that operations
+// linked to it can use the file with P_IORING_SQE_FIXED_FILE.
+static isize io_openat(ioringctx_t* ctx, ioreq_t* req) {
+  const p_ioring_sqe_t* sqe = &req->sqe;
+  if (sqe->ioprio || sqe->buf_index)
+    return p_err_invalid;
+  if (sqe->file_index && !ctx) // the native driver's file table lives in the kernel
+    return p_err_not_supported;
+  const char* path = (const char*)(usize)sqe->addr;
+  fd_t fd = _psys_openat(0, sqe->fd, path, sqe->open_flags, (isize)sqe->len);
+  if (fd < 0 || !sqe->file_index)
+    return fd;
+  io_ring_submit_lock(ctx, req);
+  err_t err = io_install_fixed_file(ctx, sqe->file_index - 1, fd);
+  io_ring_submit_unlock(ctx, req);
+  return err;
+}
+
+
+static isize io_close(ioringctx_t* ctx, ioreq_t* req) {
+  const p_ioring_sqe_t* sqe = &req->sqe;
+  if (sqe->ioprio || sqe->off || sqe->addr || sqe->len || sqe->rw_flags || sqe->buf_index)
+    return p_err_invalid;
+  if (sqe->flags & P_IORING_SQE_FIXED_FILE)
+    return p_err_invalid;
+  // with file_index, close the registered file in slot file_index-1
+  if (sqe->file_index) {
+    if (sqe->fd)
+      return p_err_invalid;
+    if (!ctx)
+      return p_err_not_supported;
+    io_ring_submit_lock(ctx, req);
+    err_t err = io_close_fixed(ctx, sqe->file_index - 1);
+    io_ring_submit_unlock(ctx, req);
+    return err;
+  }
+  // rings can't be closed by ring operations: closing a ring waits for the threads
+  // using it, which may include this one
+  ioringctx_t* target = ioringctx_lookup(sqe->fd);
+  if (target) {
+    ioringctx_put(target);
+    return p_err_badfd;
+  }
+  return _psys_close(0, sqe->fd);
+}
+
+
+// STATX, UNLINKAT and RENAMEAT operate on paths relative to the directory sqe->fd
+// (P_AT_FDCWD for the current directory) like the statat, removeat and renameat
+// syscalls. They always run on io-wq workers so that many of them, e.g. of a
+// directory scan, overlap. Paths must stay valid until the request completes.
+
+// STATX fills in the p_statx_t at addr2 with the status of the file at path addr.
+// len (a P_STATX_ mask) is a hint; the driver fills in what it can (see stx_mask).
+static isize io_statx(ioringctx_t* ctx, ioreq_t* req) {
+  const p_ioring_sqe_t* sqe = &req->sqe;
+  if (sqe->ioprio || sqe->buf_index || sqe->splice_fd_in)
+    return p_err_invalid;
+  if (sqe->flags & P_IORING_SQE_FIXED_FILE)
+    return p_err_invalid;
+  const char* path = (const char*)(usize)sqe->addr;
+  p_statx_t* st = (p_statx_t*)(usize)sqe->addr2;
+  if (!path || !st)
+    return p_err_mfault;
+  return _psys_statat(0, sqe->fd, path, st, sqe->statx_flags);
+}
+
+
+// UNLINKAT removes the file at path addr, or the directory with P_AT_REMOVEDIR
+static isize io_unlinkat(ioringctx_t* ctx, ioreq_t* req) {
+  const p_ioring_sqe_t* sqe = &req->sqe;
+  if (sqe->ioprio || sqe->off || sqe->len || sqe->buf_index || sqe->splice_fd_in)
+    return p_err_invalid;
+  if (sqe->flags & P_IORING_SQE_FIXED_FILE)
+    return p_err_invalid;
+  const char* path = (const char*)(usize)sqe->addr;
+  if (!path)
+    return p_err_mfault;
+  return _psys_removeat(0, sqe->fd, path, sqe->unlink_flags);
+}
+
+
+// RENAMEAT renames path addr relative to sqe->fd to path addr2 relative to the
+// directory len. rename_flags must be 0.
+static isize io_renameat(ioringctx_t* ctx, ioreq_t* req) {
+  const p_ioring_sqe_t* sqe = &req->sqe;
+  if (sqe->ioprio || sqe->buf_index || sqe->splice_fd_in || sqe->rename_flags)
+    return p_err_invalid;
+  if (sqe->flags & P_IORING_SQE_FIXED_FILE)
+    return p_err_invalid;
+  const char* oldpath = (const char*)(usize)sqe->addr;
+  const char* newpath = (const char*)(usize)sqe->addr2;
+  if (!oldpath || !newpath)
+    return p_err_mfault;
+  return _psys_renameat(0, sqe->fd, oldpath, (fd_t)sqe->len, newpath);
+}
+
+
+// SPLICE and TEE move data from the file splice_fd_in (a registered file index with
+// P_SPLICE_F_FD_IN_FIXED, resolved by io_prep_splice) to sqe->fd, without passing it
+// through application memory. SPLICE reads at splice_off_in and writes at off, where
+// -1 means the file position. P_SPLICE_F_MOVE and P_SPLICE_F_MORE are hints.
+// Like a short read, a short splice or tee severs a link chain.
+#define IO_SPLICE_FLAGS (P_SPLICE_F_MOVE | P_SPLICE_F_MORE | P_SPLICE_F_FD_IN_FIXED)
+
+static err_t io_prep_splice(ioringctx_t* ctx, ioreq_t* req) {
+  p_ioring_sqe_t* sqe = &req->sqe;
+  if (sqe->ioprio || sqe->buf_index)
+    return p_err_invalid;
+  if (sqe->splice_flags & ~IO_SPLICE_FLAGS)
+    return p_err_invalid;
+  if (sqe->opcode == P_IORING_OP_TEE && (sqe->off || sqe->splice_off_in))
+    return p_err_invalid;
+  if (!(sqe->splice_flags & P_SPLICE_F_FD_IN_FIXED))
+    return 0;
+  if (!ctx) // the native driver's file table lives in the kernel
+    return p_err_not_supported;
+  const io_fixed_file_t* ff = io_fixed_file_get(ctx, (u32)sqe->splice_fd_in);
+  if (!ff)
+    return p_err_badfd;
+  sqe->splice_fd_in = ff->fd;
+  sqe->splice_flags &= ~P_SPLICE_F_FD_IN_FIXED;
+  return 0;
+}
+
+
+static isize io_splice(ioringctx_t* ctx, ioreq_t* req) {
+  const p_ioring_sqe_t* sqe = &req->sqe;
+  usize len = MIN((usize)sqe->len, MAX_RW_COUNT);
+  fd_t fd_out = io_req_hostfd(req);
+  isize res = _psys_psplice(0, sqe->splice_fd_in, sqe->splice_off_in, fd_out, sqe->off, len);
+  if (res >= 0 && (usize)res < len)
+    req->flags |= IOREQ_F_FAIL;
+  return res;
+}
+
+
+static isize io_tee(ioringctx_t* ctx, ioreq_t* req) {
+  const p_ioring_sqe_t* sqe = &req->sqe;
+  usize len = MIN((usize)sqe->len, MAX_RW_COUNT);
+  u32 flags = sqe->splice_flags & (P_SPLICE_F_MOVE | P_SPLICE_F_MORE);
+  isize res = _psys_tee(0, sqe->splice_fd_in, io_req_hostfd(req), len, flags);
+  if (res >= 0 && (usize)res < len)
+    req->flags |= IOREQ_F_FAIL;
+  return res;
+}
+
+
+// io_opdef_t describes how the driver handles an operation
+typedef struct io_opdef {
+  // prep validates the request on the submitting thread (optional)
+  err_t (*prep)(ioringctx_t*, ioreq_t*);
+  // issue performs the operation, possibly on an io-wq worker
+  isize (*issue)(ioringctx_t*, ioreq_t*);
+  u8 needs_file    : 1; // operates on sqe->fd (resolved by io_file_get)
+  u8 force_async   : 1; // always blocks; executed by an io-wq worker
+  u8 buffer_select : 1; // supports P_IORING_SQE_BUFFER_SELECT
+  u8 no_wq         : 1; // never blocks the submitting thread; waits in ioring_poll.c
+} io_opdef_t;
+
+static const io_opdef_t io_opdefs[P_IORING_OP_LAST] = {
+  [P_IORING_OP_NOP]             = { .issue = io_nop },
+  [P_IORING_OP_READ]            = { .issue = io_read, .needs_file = 1, .buffer_select = 1 },
+  [P_IORING_OP_WRITE]           = { .issue = io_write, .needs_file = 1 },
+  [P_IORING_OP_READ_FIXED]      = { .prep = io_prep_rw_fixed, .issue = io_read_fixed,
+                                    .needs_file = 1 },
+  [P_IORING_OP_WRITE_FIXED]     = { .prep = io_prep_rw_fixed, .issue = io_write_fixed,
+                                    .needs_file = 1 },
+  [P_IORING_OP_OPENAT]          = { .issue = io_openat, .force_async = 1 },
+  [P_IORING_OP_CLOSE]           = { .issue = io_close },
+  [P_IORING_OP_MSG_RING]        = { .issue = io_msg_ring },
+  [P_IORING_OP_STATX]           = { .issue = io_statx, .force_async = 1 },
+  [P_IORING_OP_UNLINKAT]        = { .issue = io_unlinkat, .force_async = 1 },
+  [P_IORING_OP_RENAMEAT]        = { .issue = io_renameat, .force_async = 1 },
+  [P_IORING_OP_PROVIDE_BUFFERS] = { .issue = io_provide_buffers },
+  [P_IORING_OP_REMOVE_BUFFERS]  = { .issue = io_remove_buffers },
+  [P_IORING_OP_SPLICE]          = { .prep = io_prep_splice, .issue = io_splice,
+                                    .needs_file = 1, .force_async = 1 },
+  [P_IORING_OP_TEE]             = { .prep = io_prep_splice, .issue = io_tee,
+                                    .needs_file = 1, .force_async = 1 },
+  #if defined(HAS_LIBC)
+  [P_IORING_OP_TIMEOUT]         = { .issue = io_timeout },
+  [P_IORING_OP_TIMEOUT_REMOVE]  = { .issue = io_timeout_remove },
+  [P_IORING_OP_LINK_TIMEOUT]    = { .issue = io_link_timeout },
+  [P_IORING_OP_POLL_ADD]        = { .issue = io_poll_add, .needs_file = 1, .no_wq = 1 },
+  [P_IORING_OP_POLL_REMOVE]     = { .issue = io_poll_remove },
+  [P_IORING_OP_READ_MULTISHOT]  = { .issue = io_read_multishot, .needs_file = 1,
+                                    .buffer_select = 1, .no_wq = 1 },
+  [P_IORING_OP_ASYNC_CANCEL]    = { .issue = io_async_cancel },
+  [P_IORING_OP_FSYNC]           = { .prep = io_prep_fsync, .issue = io_fsync,
+                                    .needs_file = 1, .force_async = 1 },
+  [P_IORING_OP_SYNC_FILE_RANGE] = { .prep = io_prep_fsync, .issue = io_sync_file_range,
+                                    .needs_file = 1, .force_async = 1 },
+  #endif
+};
+
+
+// ---------------------------------------------------------------------------------------
+// submission & completion
+
+
+// io_get_cqe returns the next free entry of the CQ ring, or NULL if the ring is full.
+// The entry is claimed by advancing ctx->cached_cq_tail.
+// Called with ctx->completion_lock held.
+static p_ioring_cqe_t* io_get_cqe(ioringctx_t* ctx) {
+  iorings_t* rings = ctx->rings;
+  u32 tail = ctx->cached_cq_tail;
+  // Note: the cqe is not written to until the load of the head has completed
+  // (control dependency) which pairs with the mbarrier() the application uses
+  // before updating the CQ head.
+  if (tail - READ_ONCE(rings->cq.head) >= ctx->cq_entries)
+    return NULL;
+  return &rings->cqes[tail & (ctx->cq_entries - 1)];
+}
+
+
+// io_cqring_has_room returns true if an event can be written to the CQ ring right
+// away, i.e. it's not full and no events are held back.
+// Called with ctx->completion_lock held.
+static bool io_cqring_has_room(ioringctx_t* ctx) {
+  return !ctx->cq_overflow_head && io_get_cqe(ctx);
+}
+
+
+// __io_cqring_overflow_flush moves held back events into the CQ ring, as far as there
+// is room. Called with ctx->completion_lock held.
+static void __io_cqring_overflow_flush(ioringctx_t* ctx) {
+  io_overflow_cqe_t* ocqe;
+  p_ioring_cqe_t* cqe;
+  while ((ocqe = ctx->cq_overflow_head) && (cqe = io_get_cqe(ctx))) {
+    *cqe = ocqe->cqe;
+    ctx->cached_cq_tail++;
+    ctx->cq_overflow_head = ocqe->next;
+    #if defined(HAS_LIBC)
+    free(ocqe);
+    #else
+    mem_free(ocqe, sizeof(*ocqe));
+    #endif
+  }
+  if (!ctx->cq_overflow_head) {
+    ctx->cq_overflow_tailp = &ctx->cq_overflow_head;
+    __atomic_fetch_and(&ctx->rings->sq_flags, ~P_IORING_SQ_CQ_OVERFLOW, __ATOMIC_RELAXED);
+  }
+}
+
+
+// io_cqring_event_overflow holds back an event which doesn't fit in the CQ ring
+// until the application has made room for it. The event is lost (counted in
+// cq_overflow) only if memory can't be allocated for it.
+// Called with ctx->completion_lock held.
+static bool io_cqring_event_overflow(ioringctx_t* ctx, u64 user_data, i32 res, u32 cflags) {
+  #if defined(HAS_LIBC)
+  io_overflow_cqe_t* ocqe = malloc(sizeof(io_overflow_cqe_t));
+  #else
+  io_overflow_cqe_t* ocqe = mem_alloc(sizeof(io_overflow_cqe_t));
+  #endif
+  iorings_t* rings = ctx->rings;
+  if (UNLIKELY(!ocqe)) {
+    dlog("dropped CQE (out of memory)");
+    WRITE_ONCE(rings->cq_overflow, READ_ONCE(rings->cq_overflow) + 1);
+    return false;
+  }
+  if (!ctx->cq_overflow_head)
+    __atomic_fetch_or(&rings->sq_flags, P_IORING_SQ_CQ_OVERFLOW, __ATOMIC_RELAXED);
+  ctx->stats.nr_overflowed++;
+  ocqe->next = NULL;
+  ocqe->cqe = (p_ioring_cqe_t){ .user_data = user_data, .res = res, .flags = cflags };
+  *ctx->cq_overflow_tailp = ocqe;
+  ctx->cq_overflow_tailp = &ocqe->next;
+  return true;
+}
+
+
+// io_cqring_fill writes a completion event to the CQ ring, or holds it back if the
+// ring is full. Returns false if the event was lost.
+// The event is not visible to the application until io_commit_cqring is called.
+// Called with ctx->completion_lock held.
+static bool io_cqring_fill(ioringctx_t* ctx, u64 user_data, i32 res, u32 cflags) {
+  // events held back go first, keeping completions in order
+  if (UNLIKELY(ctx->cq_overflow_head))
+    __io_cqring_overflow_flush(ctx);
+  p_ioring_cqe_t* cqe = ctx->cq_overflow_head ? NULL : io_get_cqe(ctx);
+  if (UNLIKELY(!cqe))
+    return io_cqring_event_overflow(ctx, user_data, res, cflags);
+  cqe->user_data = user_data;
+  cqe->res = res;
+  cqe->flags = cflags;
+  ctx->cached_cq_tail++;
+  return true;
+}
+
+
+#if defined(HAS_LIBC)
+
+// io_current_is_worker is set on threads of the driver which complete operations on
+// behalf of the application (io-wq workers, the timer thread and the poll thread)
+static _Thread_local bool io_current_is_worker;
+
+
+// io_eventfd_signal notifies the registered eventfd of newly published completions.
+// Called with ctx->completion_lock held.
+static void io_eventfd_signal(ioringctx_t* ctx) {
+  if (ctx->cq_ev_tail == ctx->cached_cq_tail)
+    return;
+  ctx->cq_ev_tail = ctx->cached_cq_tail;
+  if (READ_ONCE(ctx->rings->cq_flags) & P_IORING_CQ_EVENTFD_DISABLED)
+    return;
+  if (ctx->cq_ev_fd_async && !io_current_is_worker)
+    return;
+  // The fd is an eventfd, or a pipe on hosts without eventfd. If it's a full
+  // non-blocking pipe, the reader has notifications pending already.
+  u64 v = 1;
+  while (write(ctx->cq_ev_fd, &v, sizeof(v)) < 0 && errno == EINTR) {}
+}
+
+#endif // HAS_LIBC
+
+
+// io_commit_cqring publishes completion events filled by io_cqring_fill
+static void io_commit_cqring(ioringctx_t* ctx) {
+  // order cqe stores with the tail store; pairs with the application's mbarrier_r()
+  smp_store_release(&ctx->rings->cq.tail, ctx->cached_cq_tail);
+
+  #if defined(HAS_LIBC)
+  if (UNLIKELY(ctx->cq_ev_fd_set))
+    io_eventfd_signal(ctx);
+
+  // wake up threads waiting in io_cqring_wait.
+  // Order the tail store with the cq_waiters load; pairs with io_cqring_wait.
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (READ_ONCE(ctx->cq_waiters))
+    io_cqring_wake(ctx);
+  #endif
+}
+
+
+// io_cqring_overflow_flush publishes events held back while the CQ ring was full, as
+// far as the application has made room for them. Called by ioring_enter.
+static void io_cqring_overflow_flush(ioringctx_t* ctx) {
+  if (LIKELY(!READ_ONCE(ctx->cq_overflow_head)))
+    return;
+  io_cq_lock(ctx);
+  __io_cqring_overflow_flush(ctx);
+  io_commit_cqring(ctx);
+  io_cq_unlock(ctx);
+}
+
+
+// MSG_RING posts a completion event with user_data sqe->off, res sqe->len and flags
+// P_IORING_CQE_F_MSG to the ring sqe->fd, which may be the ring itself, and
+// completes with 0. A thread can use it to wake another thread waiting for
+// completions of its ring. Completion events of other rings don't count as
+// completions of requests (e.g. for TIMEOUTs.)
+// The reference to the target taken by ioringctx_lookup keeps it from being torn down
+// until the event is posted; if it is being closed, the MSG_RING fails instead.
+static isize io_msg_ring(ioringctx_t* ctx, ioreq_t* req) {
+  const p_ioring_sqe_t* sqe = &req->sqe;
+  if (sqe->addr || sqe->ioprio || sqe->rw_flags || sqe->buf_index || sqe->splice_fd_in)
+    return p_err_invalid;
+  // rings can't be registered files
+  if (sqe->flags & P_IORING_SQE_FIXED_FILE)
+    return p_err_badfd;
+  ioringctx_t* target = ioringctx_lookup(sqe->fd);
+  if (!target)
+    return p_err_badfd;
+  isize res = p_err_badfd;
+  io_cq_lock(target);
+  if (!READ_ONCE(target->closed)) {
+    res = io_cqring_fill(target, sqe->off, (i32)sqe->len, P_IORING_CQE_F_MSG) ? 0 :
+          p_err_overflow;
+    io_commit_cqring(target);
+  }
+  io_cq_unlock(target);
+  ioringctx_put(target);
+  return res;
+}
+
+
+// io_cqring_events returns the number of completion events available to the application
+static u32 io_cqring_events(ioringctx_t* ctx) {
+  iorings_t* rings = ctx->rings;
+  return smp_load_acquire(&rings->cq.tail) - READ_ONCE(rings->cq.head);
+}
+
+
+// io_sqring_entries returns the number of SQEs submitted by the application that
+// are yet to be consumed
+static u32 io_sqring_entries(ioringctx_t* ctx) {
+  // pairs with the mbarrier_w() the application uses before writing the SQ tail
+  return smp_load_acquire(&ctx->rings->sq.tail) - ctx->cached_sq_head;
+}
+
+
+// io_get_sqe consumes the next entry of the SQ ring.
+// Returns NULL if the application stored an invalid index in sq_array.
+static const p_ioring_sqe_t* io_get_sqe(ioringctx_t* ctx) {
+  u32 head = ctx->cached_sq_head++;
+  u32 idx = READ_ONCE(ctx->sq_array[head & (ctx->sq_entries - 1)]);
+  if (LIKELY(idx < ctx->sq_entries))
+    return &ctx->sq_sqes[idx];
+
+  // drop invalid entries
+  iorings_t* rings = ctx->rings;
+  WRITE_ONCE(rings->sq_dropped, READ_ONCE(rings->sq_dropped) + 1);
+  return NULL;
+}
+
+
+// io_commit_sqring publishes the new SQ head, handing consumed SQ slots back to the
+// application
+static void io_commit_sqring(ioringctx_t* ctx) {
+  // ensure loads from the SQEs are done before the application can see the new
+  // head and start writing new data to them
+  smp_store_release(&ctx->rings->sq.head, ctx->cached_sq_head);
+}
+
+
+// io_fail_links completes the requests of a severed link chain with p_err_canceled
+static void io_fail_links(ioringctx_t* ctx, ioreq_t* req) {
+  io_cq_lock(ctx);
+  while (req) {
+    ioreq_t* link = req->link;
+    io_cqring_fill(ctx, req->sqe.user_data, p_err_canceled, 0);
+    ctx->nr_completed++;
+    io_stats_complete(ctx, req);
+    io_req_free(req);
+    req = link;
+  }
+  #if defined(HAS_LIBC)
+  io_flush_timeouts(ctx);
+  #endif
+  io_cq_unlock(ctx);
+}
+
+
+// io_req_complete posts the completion of req and frees it.
+// The event is not visible to the application until io_commit_cqring is called;
+// requests executed by the submitting thread are published by io_submit_sqes.
+// Returns the request linked to req, which is now ready to be issued, or NULL.
+static ioreq_t* io_req_complete(ioringctx_t* ctx, ioreq_t* req, isize res) {
+  io_cq_lock(ctx);
+  io_cqring_fill(ctx, req->sqe.user_data, (i32)res, req->cflags);
+  ctx->nr_completed++;
+  io_stats_complete(ctx, req);
+  #if defined(HAS_LIBC)
+  struct io_timeout* lt = io_disarm_link_timeout(ctx, req);
+  io_flush_timeouts(ctx);
+  #endif
+  io_cq_unlock(ctx);
+  #if defined(HAS_LIBC)
+  io_timeout_free(lt);
+  #endif
+
+  ioreq_t* link = req->link;
+  if (link && (res < 0 || (req->flags & IOREQ_F_FAIL)) &&
+      !(req->sqe.flags & P_IORING_SQE_IO_HARDLINK))
+  {
+    io_fail_links(ctx, link);
+    link = NULL;
+  }
+  io_req_free(req);
+  return link;
+}
+
+
+static void io_queue_sqe(ioringctx_t* ctx, ioreq_t* req);
+static void io_flush_defer(ioringctx_t* ctx);
+
+
+#if defined(HAS_LIBC)
+
+// io_req_complete_async posts and publishes the completion of a request which
+// finished on a thread other than the submitting one (an io-wq worker or the timer
+// thread.) That thread issues the request linked to it, if any, and requests which
+// were waiting for it to complete (drain.)
+static void io_req_complete_async(ioringctx_t* ctx, ioreq_t* req, isize res) {
+  ioreq_t* link = io_req_complete(ctx, req, res);
+
+  // order the nr_completed store with the defer_head load; pairs with io_defer
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (link || READ_ONCE(ctx->defer_head)) {
+    io_ring_lock(ctx);
+    if (link)
+      io_queue_sqe(ctx, link);
+    io_flush_defer(ctx);
+    io_ring_unlock(ctx);
+  }
+
+  io_cq_lock(ctx);
+  io_commit_cqring(ctx);
+  io_cq_unlock(ctx);
+}
+
+#include "ioring_iowq.c"
+#include "ioring_timeout.c"
+#include "ioring_poll.c"
+#include "ioring_fsync.c"
+
+#endif // HAS_LIBC
+
+
+// io_file_get resolves the file of a needs_file operation; either sqe->fd or,
+// with P_IORING_SQE_FIXED_FILE, the registered file at index sqe->fd.
+// Called with ctx->uring_lock held.
+static err_t io_file_get(ioringctx_t* ctx, ioreq_t* req) {
+  if (!(req->sqe.flags & P_IORING_SQE_FIXED_FILE)) {
+    req->fd = req->sqe.fd;
+    req->file = vfile_lookup_gen(req->fd, &req->file_gen);
+    return 0;
+  }
+  const io_fixed_file_t* ff = io_fixed_file_get(ctx, (u32)req->sqe.fd);
+  if (UNLIKELY(!ff))
+    return p_err_badfd;
+  req->fd = ff->fd;
+  req->file = ff->file;
+  req->file_gen = ff->gen;
+  req->flags |= IOREQ_F_FIXED_FILE | ff->flags;
+  return 0;
+}
+
+
+// io_issue_sqe executes req, or hands it to an io-wq worker.
+// Returns the request linked to req if it is ready to be issued, or NULL.
+// Called with ctx->uring_lock held.
+static ioreq_t* io_issue_sqe(ioringctx_t* ctx, ioreq_t* req) {
+  u8 opcode = req->sqe.opcode;
+  if (UNLIKELY(opcode >= P_IORING_OP_LAST || !io_opdefs[opcode].issue))
+    return io_req_complete(ctx, req, p_err_invalid);
+  const io_opdef_t* def = &io_opdefs[opcode];
+  if ((req->sqe.flags & P_IORING_SQE_BUFFER_SELECT) && !def->buffer_select)
+    return io_req_complete(ctx, req, p_err_invalid);
+  if (def->needs_file) {
+    err_t err = io_file_get(ctx, req);
+    if (err)
+      return io_req_complete(ctx, req, err);
+  }
+  if (def->prep) {
+    err_t err = def->prep(ctx, req);
+    if (err)
+      return io_req_complete(ctx, req, err);
+  }
+  #if defined(HAS_LIBC)
+  if (req->link && req->link->sqe.opcode == P_IORING_OP_LINK_TIMEOUT)
+    io_arm_link_timeout(ctx, req);
+  if (io_wq_punt(ctx, def, req)) {
+    ctx->stats.nr_async++;
+    return NULL; // the worker continues the link chain
+  }
+  #endif
+  ctx->stats.nr_inline++;
+  isize res = def->issue(ctx, req);
+  if (res == IO_ISSUE_QUEUED)
+    return NULL; // the link chain continues when req completes
+  return io_req_complete(ctx, req, res);
+}
+
+
+// io_queue_sqe issues req and the requests linked to it, for as long as they
+// complete without blocking. Called with ctx->uring_lock held.
+static void io_queue_sqe(ioringctx_t* ctx, ioreq_t* req) {
+  do {
+    req = io_issue_sqe(ctx, req);
+  } while (req);
+}
+
+
+// io_flush_defer issues deferred requests which are no longer waiting for earlier
+// requests to complete. Called with ctx->uring_lock held.
+static void io_flush_defer(ioringctx_t* ctx) {
+  ioreq_t* req;
+  while ((req = ctx->defer_head)) {
+    if (req->flags & IOREQ_F_IO_DRAIN) {
+      io_cq_lock(ctx);
+      u32 nr_completed = ctx->nr_completed;
+      io_cq_unlock(ctx);
+      if ((i32)(nr_completed - req->seq) < 0)
+        break;
+    }
+    if (!(ctx->defer_head = req->next))
+      ctx->defer_tailp = &ctx->defer_head;
+    io_queue_sqe(ctx, req);
+  }
+}
+
+
+// io_defer queues req (the head of a link chain) until earlier requests have
+// completed. Called with ctx->uring_lock held.
+static void io_defer(ioringctx_t* ctx, ioreq_t* req) {
+  req->next = NULL;
+  *ctx->defer_tailp = req;
+  ctx->defer_tailp = &req->next;
+  // order the defer_head store with the nr_completed load; pairs with io_req_complete_async
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  io_flush_defer(ctx);
+}
+
+
+// io_queue_chain issues a link chain, or defers it if it must wait for earlier
+// requests to complete. Requests submitted while there are deferred requests are
+// deferred too, to keep their order, but only drain requests wait for completions.
+static void io_queue_chain(ioringctx_t* ctx, ioreq_t* head) {
+  if (!(head->flags & IOREQ_F_IO_DRAIN) && !ctx->defer_head) {
+    io_queue_sqe(ctx, head);
+    return;
+  }
+  io_defer(ctx, head);
+}
+
+
+// io_submit_link_t: link chain being assembled by io_submit_sqes
+typedef struct io_submit_link {
+  ioreq_t* head;
+  ioreq_t* last;
+  bool     failed; // a member could not be allocated; cancel the rest of the chain
+} io_submit_link_t;
+
+
+// io_submit_sqe prepares a request for sqe. Requests are issued as soon as their link
+// chain is complete; the chain ends with the first SQE without P_IORING_SQE_IO_LINK
+// or P_IORING_SQE_IO_HARDLINK.
+static void io_submit_sqe(ioringctx_t* ctx, const p_ioring_sqe_t* sqe, io_submit_link_t* link) {
+  u32 seq = ctx->sq_seq++;
+  bool linked = sqe->flags & (P_IORING_SQE_IO_LINK | P_IORING_SQE_IO_HARDLINK);
+
+  // fast path: a lone request which does not need to wait
+  if (LIKELY(!linked && !link->head && !link->failed && !ctx->defer_head &&
+             !ctx->drain_next && !(sqe->flags & P_IORING_SQE_IO_DRAIN)))
+  {
+    ioreq_t req = { .fd = -1, .seq = seq, .submit_ns = ctx->stats.submit_ns };
+    memcpy(&req.sqe, sqe, sizeof(req.sqe));
+    io_queue_sqe(ctx, &req);
+    return;
+  }
+
+  ioreq_t* req = link->failed ? NULL : io_req_alloc();
+  if (UNLIKELY(!req)) {
+    ioreq_t tmp = { .fd = -1, .seq = seq, .submit_ns = ctx->stats.submit_ns };
+    memcpy(&tmp.sqe, sqe, sizeof(tmp.sqe));
+    io_req_complete(ctx, &tmp, link->failed ? p_err_canceled : p_err_nomem);
+    if (link->head) {
+      io_fail_links(ctx, link->head);
+      link->head = NULL;
+    }
+    link->failed = linked;
+    return;
+  }
+  memcpy(&req->sqe, sqe, sizeof(req->sqe));
+  req->fd = -1;
+  req->file = NULL;
+  req->cflags = 0;
+  req->seq = seq;
+  req->submit_ns = ctx->stats.submit_ns;
+  req->link = NULL;
+  req->timeout = NULL;
+  req->link_timeout = NULL;
+
+  if (link->head) {
+    // a drain flag on any member applies to the whole chain, and makes the next
+    // chain wait for this one to complete
+    if (sqe->flags & P_IORING_SQE_IO_DRAIN) {
+      link->head->flags |= IOREQ_F_IO_DRAIN;
+      ctx->drain_next = true;
+    }
+    link->last->link = req;
+    link->last = req;
+    if (linked)
+      return;
+    req = link->head;
+    link->head = NULL;
+  } else {
+    if ((sqe->flags & P_IORING_SQE_IO_DRAIN) || ctx->drain_next) {
+      req->flags |= IOREQ_F_IO_DRAIN;
+      ctx->drain_next = false;
+    }
+    if (linked) {
+      link->head = link->last = req;
+      return;
+    }
+  }
+  io_queue_chain(ctx, req);
+}
+
+
+// io_submit_sqes consumes and executes up to nr SQEs.
+// Returns the number of SQEs consumed.
+static u32 io_submit_sqes(ioringctx_t* ctx, u32 nr) {
+  nr = MIN(nr, io_sqring_entries(ctx));
+  if (nr == 0)
+    return 0;
+
+  io_ring_lock(ctx);
+  io_submit_link_t link = {0};
+  u32 submitted = 0;
+  ctx->stats.submit_ns = io_stats_now();
+  while (submitted < nr) {
+    const p_ioring_sqe_t* sqe = io_get_sqe(ctx);
+    if (UNLIKELY(!sqe))
+      break;
+    submitted++;
+    io_submit_sqe(ctx, sqe, &link);
+  }
+
+  // a link chain is cut off at the end of a submission
+  if (link.head)
+    io_queue_chain(ctx, link.head);
+  ctx->stats.nr_submitted += submitted;
+
+  io_commit_sqring(ctx);
+  io_cq_lock(ctx);
+  io_commit_cqring(ctx);
+  io_cq_unlock(ctx);
+  io_ring_unlock(ctx);
+  return submitted;
+}
+
+
+#if defined(HAS_LIBC)
+
+#include "ioring_sqpoll.c"
+
+#include "ioring_wait.c"
+
+#include "ioring_cancel.c"
+
+#endif // HAS_LIBC
+
+
+static isize io_enter(
+  ioringctx_t* ctx, u32 to_submit, u32 min_complete, u32 flags, const void* arg)
+{
+  if (ctx->flags & P_IORING_SETUP_R_DISABLED)
+    return p_err_badfd;
+
+  #if defined(HAS_LIBC)
+  u64 deadline = U64_MAX;
+  if (flags & P_IORING_ENTER_EXT_ARG) {
+    err_t err = io_get_ext_arg(arg, &deadline);
+    if (err)
+      return err;
+  }
+  #else
+  if ((flags & P_IORING_ENTER_EXT_ARG) && !arg)
+    return p_err_mfault;
+  #endif
+
+  // the application may have made room for events held back
+  io_cqring_overflow_flush(ctx);
+
+  #if defined(HAS_LIBC)
+  io_poll_rearm(ctx);
+  if (ctx->flags & P_IORING_SETUP_SQPOLL) {
+    // SQEs are consumed by the SQ poll thread; to_submit is only a hint
+    if (flags & P_IORING_ENTER_SQ_WAKEUP)
+      io_sq_thread_wakeup(ctx);
+    if (flags & P_IORING_ENTER_SQ_WAIT)
+      io_sqpoll_wait_sq(ctx);
+    if (flags & P_IORING_ENTER_GETEVENTS) {
+      err_t err = io_cqring_wait(ctx, min_complete, deadline);
+      if (err && !to_submit)
+        return err;
+    }
+    return (isize)to_submit;
+  }
+  #endif
+
+  u32 submitted = 0;
+  if (to_submit)
+    submitted = io_submit_sqes(ctx, to_submit);
+
+  #if defined(HAS_LIBC)
+  // Like Linux, a timed out wait is only reported when no SQEs were consumed
+  if (flags & P_IORING_ENTER_GETEVENTS) {
+    err_t err = io_cqring_wait(ctx, min_complete, deadline);
+    if (err && !submitted)
+      return err;
+  }
+  #else
+  // Note: without threads operations are executed inline, so all of their
+  // completions have already been posted; P_IORING_ENTER_GETEVENTS has nothing
+  // to wait for.
+  #endif
+
+  return (isize)submitted;
+}
+
+
+static isize ioring_base_enter(
+  fd_t ring, u32 to_submit, u32 min_complete, u32 flags, const void* arg)
+{
+  if (flags & ~(P_IORING_ENTER_GETEVENTS | P_IORING_ENTER_SQ_WAKEUP |
+                P_IORING_ENTER_SQ_WAIT | P_IORING_ENTER_EXT_ARG))
+  {
+    return p_err_invalid;
+  }
+  if (!(flags & P_IORING_ENTER_EXT_ARG) && arg)
+    return p_err_invalid; // a signal mask in Linux; not supported
+
+  ioringctx_t* ctx = ioringctx_lookup(ring);
+  if (!ctx)
+    return p_err_badfd;
+  isize ret = io_enter(ctx, to_submit, min_complete, flags, arg);
+  ioringctx_put(ctx);
+  return ret;
+}
+
+
+#if defined(HAS_LIBC)
+
+// P_IORING_REGISTER_EVENTFD and P_IORING_REGISTER_EVENTFD_ASYNC; arg is a fd_t.
+// Like registered files, the ring holds on to a duplicate of the fd.
+static isize io_eventfd_register(ioringctx_t* ctx, const void* arg, u32 nr_args, bool async) {
+  fd_t fd;
+  if (!arg || nr_args != 1)
+    return p_err_invalid;
+  if (!copy_from_user(&fd, arg, sizeof(fd)))
+    return p_err_mfault;
+  if (fd < 0 || vfile_lookup(fd))
+    return p_err_badfd;
+  if (ctx->cq_ev_fd_set)
+    return p_err_exists;
+  int dupfd = fcntl((int)fd, F_DUPFD_CLOEXEC, 0);
+  if (dupfd < 0)
+    return p_err_badfd;
+  io_cq_lock(ctx);
+  ctx->cq_ev_fd = dupfd;
+  ctx->cq_ev_fd_async = async;
+  ctx->cq_ev_tail = ctx->cached_cq_tail; // only notify of completions from now on
+  ctx->cq_ev_fd_set = true;
+  io_cq_unlock(ctx);
+  return 0;
+}
+
+
+// P_IORING_UNREGISTER_EVENTFD
+static isize io_eventfd_unregister(ioringctx_t* ctx) {
+  io_cq_lock(ctx);
+  bool set = ctx->cq_ev_fd_set;
+  int fd = ctx->cq_ev_fd;
+  ctx->cq_ev_fd_set = false;
+  io_cq_unlock(ctx);
+  if (!set)
+    return p_err_not_found;
+  close(fd);
+  return 0;
+}
+
+#endif // HAS_LIBC
+
+
+// P_IORING_REGISTER_PROBE reports the operations supported by the driver.
+// arg is a zeroed p_ioring_probe_t followed by nr_args p_ioring_probe_op_t.
+static isize io_probe(void* arg, u32 nr_args) {
+  p_ioring_probe_t probe;
+  p_ioring_probe_op_t ops[P_IORING_OP_LAST];
+  if (!arg)
+    return p_err_invalid;
+  nr_args = MIN(nr_args, (u32)P_IORING_OP_LAST);
+
+  if (!copy_from_user(&probe, arg, sizeof(probe)) ||
+      !copy_from_user(ops, (char*)arg + sizeof(probe), sizeof(ops[0]) * nr_args))
+  {
+    return p_err_mfault;
+  }
+  // like Linux, require zeroed memory so that fields can be added later
+  const u8* bytes = (const u8*)&probe;
+  for (usize i = 0; i < sizeof(probe); i++) {
+    if (bytes[i])
+      return p_err_invalid;
+  }
+  bytes = (const u8*)ops;
+  for (usize i = 0; i < sizeof(ops[0]) * nr_args; i++) {
+    if (bytes[i])
+      return p_err_invalid;
+  }
+
+  probe.last_op = P_IORING_OP_LAST - 1;
+  probe.ops_len = (u8)nr_args;
+  for (u32 op = 0; op < nr_args; op++) {
+    ops[op].op = (u8)op;
+    if (io_opdefs[op].issue)
+      ops[op].flags = P_IO_URING_OP_SUPPORTED;
+  }
+
+  if (!copy_to_user(arg, &probe, sizeof(probe)) ||
+      !copy_to_user((char*)arg + sizeof(probe), ops, sizeof(ops[0]) * nr_args))
+  {
+    return p_err_mfault;
+  }
+  return 0;
 }
 
 
-isize _psys_ioring_register(psysop_t _, fd_t ring, u32 opcode, const void* arg, u32 nr_args) {
+// io_register is called with ctx->uring_lock held
+static isize io_register(ioringctx_t* ctx, u32 opcode, const void* arg, u32 nr_args) {
+  switch (opcode) {
+    case P_IORING_REGISTER_ENABLE_RINGS:
+      if (arg || nr_args)
+        return p_err_invalid;
+      if (!(ctx->flags & P_IORING_SETUP_R_DISABLED))
+        return p_err_badfd;
+      ctx->flags &= ~P_IORING_SETUP_R_DISABLED;
+      #if defined(HAS_LIBC)
+      if (ctx->flags & P_IORING_SETUP_SQPOLL)
+        return io_sq_thread_start(ctx);
+      #endif
+      return 0;
+
+    #if defined(HAS_LIBC)
+    case P_IORING_REGISTER_IOWQ_AFF:
+      if (!arg)
+        return p_err_invalid;
+      return io_wq_register_aff(&ctx->wq, arg, nr_args);
+    case P_IORING_UNREGISTER_IOWQ_AFF:
+      if (arg || nr_args)
+        return p_err_invalid;
+      return io_wq_register_aff(&ctx->wq, NULL, 0);
+    case P_IORING_REGISTER_IOWQ_MAX_WORKERS:
+      return io_wq_register_max_workers(&ctx->wq, (void*)arg, nr_args);
+
+    case P_IORING_REGISTER_EVENTFD:
+    case P_IORING_REGISTER_EVENTFD_ASYNC:
+      return io_eventfd_register(
+        ctx, arg, nr_args, opcode == P_IORING_REGISTER_EVENTFD_ASYNC);
+    case P_IORING_UNREGISTER_EVENTFD:
+      if (arg || nr_args)
+        return p_err_invalid;
+      return io_eventfd_unregister(ctx);
+    #endif
+
+    case P_IORING_REGISTER_PROBE:
+      return io_probe((void*)arg, nr_args);
+
+    case P_IORING_REGISTER_BUFFERS:
+      return io_sqe_buffers_register(ctx, arg, nr_args, false);
+    case P_IORING_REGISTER_BUFFERS2:
+      return io_register_rsrc(ctx, arg, nr_args, IORING_RSRC_BUFFER);
+    case P_IORING_REGISTER_BUFFERS_UPDATE:
+      return io_register_rsrc_update(ctx, arg, nr_args, IORING_RSRC_BUFFER);
+    case P_IORING_UNREGISTER_BUFFERS:
+      if (arg || nr_args)
+        return p_err_invalid;
+      return io_sqe_buffers_unregister(ctx);
+
+    case P_IORING_REGISTER_FILES:
+      return io_sqe_files_register(ctx, arg, nr_args);
+    case P_IORING_REGISTER_FILES2:
+      return io_register_rsrc(ctx, arg, nr_args, IORING_RSRC_FILE);
+    case P_IORING_REGISTER_FILES_UPDATE:
+      return io_register_files_update(ctx, arg, nr_args);
+    case P_IORING_REGISTER_FILES_UPDATE2:
+      return io_register_rsrc_update(ctx, arg, nr_args, IORING_RSRC_FILE);
+    case P_IORING_UNREGISTER_FILES:
+      if (arg || nr_args)
+        return p_err_invalid;
+      return io_sqe_files_unregister(ctx);
+  }
+
   return p_err_not_supported;
 }
+
+
+static isize ioring_base_register(fd_t ring, u32 opcode, const void* arg, u32 nr_args) {
+  ioringctx_t* ctx = ioringctx_lookup(ring);
+  if (!ctx)
+    return p_err_badfd;
+  isize ret;
+  #if defined(HAS_LIBC)
+  // waits for requests to complete, which may need ctx->uring_lock
+  if (opcode == P_IORING_REGISTER_SYNC_CANCEL) {
+    ret = io_sync_cancel(ctx, arg, nr_args);
+    ioringctx_put(ctx);
+    return ret;
+  }
+  #endif
+  io_ring_lock(ctx);
+  ret = io_register(ctx, opcode, arg, nr_args);
+  io_ring_unlock(ctx);
+  ioringctx_put(ctx);
+  return ret;
+}
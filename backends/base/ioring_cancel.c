@@ -0,0 +1,281 @@
+// SPDX-License-Identifier: Apache-2.0
+// This file is included by ioring_base.c
+
+// cancellation: P_IORING_OP_ASYNC_CANCEL and P_IORING_REGISTER_SYNC_CANCEL
+//
+// A request which has been submitted but has not completed is in one of these places:
+//   - the defer list, waiting for earlier requests to complete (drain)
+//   - an io-wq queue, waiting for a worker
+//   - being executed by an io-wq worker
+//   - armed as a poll or multishot operation (ioring_poll.c)
+//   - a TIMEOUT in the timer wheel (ioring_timeout.c)
+// Requests linked to any of those are canceled along with it. Requests executed
+// inline by the submitting thread have completed by the time ioring_enter returns.
+//
+// Requests taken off a list complete with p_err_canceled right away. A worker which
+// is executing a matching request is interrupted (see io_wq_cancel); a host syscall
+// it is blocked in then fails and the request completes with p_err_canceled, but an
+// operation which doesn't block in the host runs to completion. Either way the cancel
+// request can't tell which and completes with p_err_already.
+//
+// Deferred requests have not resolved their file yet; they match by user_data only.
+// Closing a ring cancels all of its requests (io_cancel_ring_exit.)
+#if !defined(HAS_LIBC)
+  #error cancellation requires libc
+#endif
+
+// IO_CANCEL_RETRY_INTERVAL is how often io_cancel_wait interrupts workers again
+// while waiting for their requests to complete (nanoseconds.)
+// The signal may arrive before the worker blocks, in which case it's lost.
+#define IO_CANCEL_RETRY_INTERVAL 1000000
+
+#define IO_CANCEL_FLAGS ( P_IORING_ASYNC_CANCEL_ALL | P_IORING_ASYNC_CANCEL_FD | \
+                          P_IORING_ASYNC_CANCEL_ANY | P_IORING_ASYNC_CANCEL_FD_FIXED )
+
+
+static bool io_cancel_match(const ioreq_t* req, const io_cancel_data_t* cd) {
+  if (req == cd->self)
+    return false;
+  if (cd->req)
+    return req == cd->req;
+  if (cd->flags & P_IORING_ASYNC_CANCEL_ANY)
+    return true;
+  if (cd->flags & P_IORING_ASYNC_CANCEL_FD)
+    return req->fd == cd->fd;
+  return req->sqe.user_data == cd->data;
+}
+
+
+// io_cancel_all returns true if all matching requests are to be canceled,
+// rather than only the first one found
+static bool io_cancel_all(const io_cancel_data_t* cd) {
+  return (cd->flags & (P_IORING_ASYNC_CANCEL_ALL | P_IORING_ASYNC_CANCEL_ANY)) != 0;
+}
+
+
+// io_cancel_prep validates flags and sets up cd. With P_IORING_ASYNC_CANCEL_FD_FIXED,
+// fd is an index into the registered file table. locked is true if the caller holds
+// ctx->uring_lock.
+static err_t io_cancel_prep(
+  ioringctx_t* ctx, io_cancel_data_t* cd, u64 data, fd_t fd, u32 flags, bool locked)
+{
+  if (flags & ~IO_CANCEL_FLAGS)
+    return p_err_invalid;
+  if ((flags & P_IORING_ASYNC_CANCEL_ANY) && (flags & P_IORING_ASYNC_CANCEL_FD))
+    return p_err_invalid;
+  if ((flags & P_IORING_ASYNC_CANCEL_FD_FIXED) && !(flags & P_IORING_ASYNC_CANCEL_FD))
+    return p_err_invalid;
+  cd->data = data;
+  cd->fd = -1;
+  cd->flags = flags;
+  if (!(flags & P_IORING_ASYNC_CANCEL_FD))
+    return 0;
+  if (!(flags & P_IORING_ASYNC_CANCEL_FD_FIXED)) {
+    cd->fd = fd;
+    return 0;
+  }
+  err_t err = 0;
+  if (!locked)
+    io_ring_lock(ctx);
+  if ((u32)fd >= ctx->nr_user_files || ctx->file_table[fd].fd < 0) {
+    err = p_err_badfd;
+  } else {
+    cd->fd = ctx->file_table[fd].fd;
+  }
+  if (!locked)
+    io_ring_unlock(ctx);
+  return err;
+}
+
+
+// io_cancel_defer takes deferred requests matching cd off the defer list and returns
+// them (linked by next.) Called with ctx->uring_lock held.
+static ioreq_t* io_cancel_defer(ioringctx_t* ctx, const io_cancel_data_t* cd) {
+  bool all = io_cancel_all(cd);
+  ioreq_t* canceled = NULL;
+  ioreq_t** pp = &ctx->defer_head;
+  while (*pp && (all || !canceled)) {
+    ioreq_t* req = *pp;
+    // not yet issued; req->fd has not been resolved
+    if (io_cancel_match(req, cd) && !(cd->flags & P_IORING_ASYNC_CANCEL_FD)) {
+      *pp = req->next;
+      req->next = canceled;
+      canceled = req;
+    } else {
+      pp = &req->next;
+    }
+  }
+  if (!*pp)
+    ctx->defer_tailp = pp;
+  return canceled;
+}
+
+
+// io_try_cancel cancels requests matching cd. nr_running is set to the number of
+// matching requests which are being executed by workers, which were interrupted.
+// Returns the number of requests canceled with io_cancel_all(cd), otherwise 0, or
+// p_err_already if the request is running. Returns p_err_not_found if nothing
+// matched. locked is true if the caller holds ctx->uring_lock.
+static isize io_try_cancel(
+  ioringctx_t* ctx, const io_cancel_data_t* cd, bool locked, u32* nr_running)
+{
+  bool all = io_cancel_all(cd);
+  u32 nr = 0;
+  *nr_running = 0;
+
+  if (!locked)
+    io_ring_lock(ctx);
+
+  ioreq_t* reqs = io_cancel_defer(ctx, cd);
+  if (all || !reqs) {
+    ioreq_t* queued = io_wq_cancel(&ctx->wq, cd, nr_running);
+    while (queued) {
+      ioreq_t* next = queued->next;
+      queued->next = reqs;
+      reqs = queued;
+      queued = next;
+    }
+  }
+  io_timeout_t* timeouts = NULL;
+  if (all || (!reqs && !*nr_running)) {
+    nr += io_poll_cancel(ctx, cd);
+    if (all || !nr)
+      timeouts = io_timeout_cancel(ctx, cd);
+  }
+
+  while (reqs) {
+    ioreq_t* next = reqs->next;
+    ioreq_t* link = io_req_complete(ctx, reqs, p_err_canceled);
+    if (link) // P_IORING_SQE_IO_HARDLINK
+      io_queue_sqe(ctx, link);
+    reqs = next;
+    nr++;
+  }
+  while (timeouts) {
+    io_timeout_t* next = timeouts->next;
+    ioreq_t* link = io_req_complete(ctx, timeouts->req, p_err_canceled);
+    timeouts->req = NULL;
+    io_timeout_free(timeouts);
+    if (link)
+      io_queue_sqe(ctx, link);
+    timeouts = next;
+    nr++;
+  }
+  io_flush_defer(ctx); // requests which were waiting for the canceled ones
+
+  if (!locked)
+    io_ring_unlock(ctx);
+
+  nr += *nr_running;
+  if (nr == 0)
+    return p_err_not_found;
+  if (all)
+    return nr;
+  return *nr_running ? p_err_already : 0;
+}
+
+
+// P_IORING_OP_ASYNC_CANCEL
+//   addr          user_data of the request to cancel
+//   fd            file of the requests to cancel, with P_IORING_ASYNC_CANCEL_FD
+//   cancel_flags  P_IORING_ASYNC_CANCEL_ flags
+// Completes with 0 if the request was canceled, p_err_already if it is being executed
+// and p_err_not_found if there is no such request. With P_IORING_ASYNC_CANCEL_ALL or
+// P_IORING_ASYNC_CANCEL_ANY, completes with the number of requests canceled.
+static isize io_async_cancel(ioringctx_t* ctx, ioreq_t* req) {
+  const p_ioring_sqe_t* sqe = &req->sqe;
+  if (!ctx) // the native driver passes cancellation to Linux
+    return p_err_not_supported;
+  if (sqe->ioprio || sqe->off || sqe->len || sqe->buf_index || sqe->splice_fd_in)
+    return p_err_invalid;
+  bool locked = !(req->flags & IOREQ_F_ASYNC);
+  io_cancel_data_t cd = { .self = req };
+  err_t err = io_cancel_prep(ctx, &cd, sqe->addr, sqe->fd, sqe->cancel_flags, locked);
+  if (err)
+    return err;
+  u32 nr_running;
+  return io_try_cancel(ctx, &cd, locked, &nr_running);
+}
+
+
+// io_cancel_wait waits for nr_running requests matching cd, which io_try_cancel
+// interrupted, to complete. Their workers are interrupted again every
+// IO_CANCEL_RETRY_INTERVAL. Returns p_err_timedout if deadline passes first.
+// Called without ctx->uring_lock held.
+static err_t io_cancel_wait(
+  ioringctx_t* ctx, const io_cancel_data_t* cd, u32 nr_running, u64 deadline)
+{
+  // wait for interrupted requests to complete; they no longer match once they have
+  iorings_t* rings = ctx->rings;
+  err_t err = 0;
+  __atomic_fetch_add(&ctx->cq_waiters, 1, __ATOMIC_RELAXED);
+  // order the cq_waiters store with the tail load; pairs with io_commit_cqring
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  while (nr_running) {
+    u32 tail = smp_load_acquire(&rings->cq.tail);
+    u64 now = io_nanotime();
+    if (now >= deadline) {
+      err = p_err_timedout;
+      break;
+    }
+    io_cqring_park(ctx, tail, MIN(deadline, now + IO_CANCEL_RETRY_INTERVAL));
+    io_try_cancel(ctx, cd, false, &nr_running);
+    io_cq_lock(ctx);
+    io_commit_cqring(ctx);
+    io_cq_unlock(ctx);
+  }
+  __atomic_fetch_sub(&ctx->cq_waiters, 1, __ATOMIC_RELAXED);
+  return err;
+}
+
+
+// P_IORING_REGISTER_SYNC_CANCEL
+// arg is a p_ioring_sync_cancel_reg_t; nr_args 1. Cancels like ASYNC_CANCEL and then
+// waits for requests being executed by workers to complete, or until the timeout
+// (-1/-1 for none) expires. Returns 0, p_err_not_found or p_err_timedout.
+// Called without ctx->uring_lock held.
+static isize io_sync_cancel(ioringctx_t* ctx, const void* arg, u32 nr_args) {
+  p_ioring_sync_cancel_reg_t r;
+  if (!arg || nr_args != 1)
+    return p_err_invalid;
+  if (!copy_from_user(&r, arg, sizeof(r)))
+    return p_err_mfault;
+  if (r.opcode || r.pad[0] || r.pad[1] || r.pad[2] || r.pad[3] || r.pad[4] || r.pad[5] ||
+      r.pad[6] || r.pad2[0] || r.pad2[1] || r.pad2[2])
+  {
+    return p_err_invalid;
+  }
+  u64 deadline = U64_MAX;
+  if (r.timeout.tv_sec != -1 || r.timeout.tv_nsec != -1) {
+    err_t err = io_timeout_parse((u64)(usize)&r.timeout, 0, &deadline);
+    if (err)
+      return err;
+  }
+  io_cancel_data_t cd = {0};
+  err_t err = io_cancel_prep(ctx, &cd, r.addr, r.fd, r.flags, false);
+  if (err)
+    return err;
+
+  u32 nr_running;
+  isize ret = io_try_cancel(ctx, &cd, false, &nr_running);
+  io_cq_lock(ctx);
+  io_commit_cqring(ctx);
+  io_cq_unlock(ctx);
+  if (ret == p_err_not_found)
+    return ret;
+  return io_cancel_wait(ctx, &cd, nr_running, deadline);
+}
+
+
+// io_cancel_ring_exit cancels all requests of a ring which is being closed, and waits
+// for workers to finish the ones they are executing so that io_wq_exit doesn't wait
+// for host syscalls which may never return. Called without ctx->uring_lock held.
+static void io_cancel_ring_exit(ioringctx_t* ctx) {
+  io_cancel_data_t cd = { .flags = P_IORING_ASYNC_CANCEL_ANY };
+  u32 nr_running;
+  io_try_cancel(ctx, &cd, false, &nr_running);
+  io_cq_lock(ctx);
+  io_commit_cqring(ctx);
+  io_cq_unlock(ctx);
+  io_cancel_wait(ctx, &cd, nr_running, U64_MAX);
+}
@@ -0,0 +1,195 @@
+// SPDX-License-Identifier: Apache-2.0
+// This file is included by ioring_base.c
+
+// file sync operations: P_IORING_OP_FSYNC and P_IORING_OP_SYNC_FILE_RANGE
+//
+// Both always execute on an io-wq worker. Concurrent FSYNCs of the same file are
+// coalesced by group commit: the first one to arrive flushes the file while later
+// ones wait for it, then one of them flushes once more on behalf of all that arrived
+// in the meantime. A request must be covered by a flush which started after it was
+// issued, as data written before then may have missed an earlier flush; flushes of a
+// group are numbered to tell. So with any number of FSYNCs of a file in flight, at
+// most two host flushes of it are pending, one running and one queued.
+//
+// A flush is an fdatasync if all the requests it covers have P_IORING_FSYNC_DATASYNC
+// set, otherwise an fsync. Its result is the result of every request it covers.
+// FSYNC ignores off and len: the whole file is flushed.
+//
+// Groups are keyed by the application's file descriptor, live in ctx->fsync_groups
+// while requests on the file are in flight and are guarded by ctx->fsync_lock. Each
+// request flushes through its own reference to the file (io_req_hostfd). A request
+// waiting for another request's flush can't be interrupted by cancellation
+// (ioring_cancel.c), but the wait is bounded by that flush.
+//
+// SYNC_FILE_RANGE uses sync_file_range(2) on Linux and is not coalesced. Other hosts
+// lack it; there a request with any flags set is an FSYNC with DATASYNC, which flushes
+// at least the range.
+#if !defined(HAS_LIBC)
+  #error fsync requires libc
+#endif
+
+#include <errno.h>
+#include <fcntl.h> // sync_file_range
+
+#define IO_SYNC_RANGE_FLAGS ( P_SYNC_FILE_RANGE_WAIT_BEFORE | P_SYNC_FILE_RANGE_WRITE | \
+                              P_SYNC_FILE_RANGE_WAIT_AFTER )
+
+#if defined(__linux__)
+static_assert(P_SYNC_FILE_RANGE_WAIT_BEFORE == SYNC_FILE_RANGE_WAIT_BEFORE &&
+              P_SYNC_FILE_RANGE_WRITE == SYNC_FILE_RANGE_WRITE &&
+              P_SYNC_FILE_RANGE_WAIT_AFTER == SYNC_FILE_RANGE_WAIT_AFTER,
+              "sync_file_range flags must match the host's");
+#endif
+
+// io_fsync_group_t: FSYNC requests in flight on one file
+typedef struct io_fsync_group {
+  struct io_fsync_group* next;
+  fd_t           fd;
+  u32            refs;        // requests using the group
+  u64            gen_started; // number of flushes started
+  u64            gen_done;    // number of flushes completed
+  err_t          err;         // result of the last flush completed
+  bool           running;     // a flush is in progress
+  bool           pending_full; // the next flush must be an fsync rather than fdatasync
+  pthread_cond_t cond;        // signalled when a flush completes
+} io_fsync_group_t;
+
+
+// io_fsync_host flushes fd to storage. A flush interrupted by io_wq_cancel fails with
+// p_err_canceled (EINTR) and one which lost data with p_err_io.
+static err_t io_fsync_host(fd_t fd, bool datasync) {
+  #if defined(__APPLE__)
+  // no fdatasync declared by Darwin's libc
+  int r = fsync((int)fd);
+  #else
+  int r = datasync ? fdatasync((int)fd) : fsync((int)fd);
+  #endif
+  return r == 0 ? 0 : err_from_errno(errno);
+}
+
+
+// io_fsync_group_get returns the group of fd with a reference for the caller, creating
+// it if needed. Returns NULL if out of memory. Called with ctx->fsync_lock held.
+static io_fsync_group_t* io_fsync_group_get(ioringctx_t* ctx, fd_t fd) {
+  io_fsync_group_t* g = ctx->fsync_groups;
+  while (g && g->fd != fd)
+    g = g->next;
+  if (!g) {
+    if (!(g = calloc(1, sizeof(io_fsync_group_t))))
+      return NULL;
+    g->fd = fd;
+    pthread_cond_init(&g->cond, NULL);
+    g->next = ctx->fsync_groups;
+    ctx->fsync_groups = g;
+  }
+  g->refs++;
+  return g;
+}
+
+
+// io_fsync_group_put drops a reference to g. Called with ctx->fsync_lock held.
+static void io_fsync_group_put(ioringctx_t* ctx, io_fsync_group_t* g) {
+  if (--g->refs)
+    return;
+  io_fsync_group_t** pp = &ctx->fsync_groups;
+  while (*pp != g)
+    pp = &(*pp)->next;
+  *pp = g->next;
+  pthread_cond_destroy(&g->cond);
+  free(g);
+}
+
+
+// io_fsync_group_commit flushes the file of req, or waits for a flush by another
+// request which covers req
+static err_t io_fsync_group_commit(ioringctx_t* ctx, const ioreq_t* req, bool datasync) {
+  fd_t hostfd = io_req_hostfd(req);
+  pthread_mutex_lock(&ctx->fsync_lock);
+  ctx->stats.nr_fsync++;
+  io_fsync_group_t* g = io_fsync_group_get(ctx, req->fd);
+  if (!g) {
+    pthread_mutex_unlock(&ctx->fsync_lock);
+    return io_fsync_host(hostfd, datasync);
+  }
+
+  err_t err;
+  for (;;) {
+    // the first flush to start from now on covers this request
+    u64 need = g->gen_started + 1;
+    if (!datasync)
+      g->pending_full = true;
+
+    while (g->gen_done < need) {
+      if (g->running) {
+        pthread_cond_wait(&g->cond, &ctx->fsync_lock);
+        continue;
+      }
+      u64 gen = ++g->gen_started;
+      bool full = g->pending_full;
+      g->pending_full = false;
+      g->running = true;
+      ctx->stats.nr_fsync_flushes++;
+      pthread_mutex_unlock(&ctx->fsync_lock);
+
+      err_t e = io_fsync_host(hostfd, !full);
+
+      pthread_mutex_lock(&ctx->fsync_lock);
+      g->running = false;
+      g->gen_done = gen;
+      g->err = e;
+      pthread_cond_broadcast(&g->cond);
+      if (e == p_err_canceled) {
+        // this request was canceled; the others flush again
+        err = e;
+        goto out;
+      }
+    }
+    err = g->err;
+    // a flush interrupted on behalf of another request covers nothing
+    if (err != p_err_canceled)
+      break;
+  }
+out:
+  io_fsync_group_put(ctx, g);
+  pthread_mutex_unlock(&ctx->fsync_lock);
+  return err;
+}
+
+
+// io_prep_fsync validates FSYNC and SYNC_FILE_RANGE requests
+static err_t io_prep_fsync(ioringctx_t* ctx, ioreq_t* req) {
+  const p_ioring_sqe_t* sqe = &req->sqe;
+  if (sqe->addr || sqe->ioprio || sqe->buf_index || sqe->splice_fd_in)
+    return p_err_invalid;
+  u32 flags = sqe->opcode == P_IORING_OP_FSYNC ? sqe->fsync_flags : sqe->sync_range_flags;
+  u32 valid = sqe->opcode == P_IORING_OP_FSYNC ? P_IORING_FSYNC_DATASYNC : IO_SYNC_RANGE_FLAGS;
+  if (flags & ~valid)
+    return p_err_invalid;
+  // virtual files are not backed by storage
+  if (req->file)
+    return p_err_invalid;
+  return 0;
+}
+
+
+static isize io_fsync(ioringctx_t* ctx, ioreq_t* req) {
+  bool datasync = (req->sqe.fsync_flags & P_IORING_FSYNC_DATASYNC) != 0;
+  return io_fsync_group_commit(ctx, req, datasync);
+}
+
+
+static isize io_sync_file_range(ioringctx_t* ctx, ioreq_t* req) {
+  const p_ioring_sqe_t* sqe = &req->sqe;
+  #if defined(__linux__)
+  if (sync_file_range((int)io_req_hostfd(req), (off_t)sqe->off, (off_t)sqe->len,
+                      sqe->sync_range_flags) != 0)
+  {
+    return err_from_errno(errno);
+  }
+  return 0;
+  #else
+  if (!sqe->sync_range_flags)
+    return 0;
+  return io_fsync_group_commit(ctx, req, true);
+  #endif
+}
@@ -0,0 +1,430 @@
+// SPDX-License-Identifier: Apache-2.0
+// This file is included by ioring_base.c
+
+// io-wq: async worker pool
+//
+// Operations which may block (on host files, or SQEs with P_IORING_SQE_ASYNC) are
+// handed to worker threads so that they don't stall the thread that submitted
+// them. Workers post completions as they finish, so CQEs may be out of order.
+//
+// Like Linux, workers are accounted in two groups:
+//   bound:   operations on regular files; they finish in bounded time
+//   unbound: operations which may wait indefinitely (pipes, sockets, terminals)
+// The group of a host fd is determined with fstat and cached until the fd is closed
+// (wq->fd_acct.) Each group grows on demand up to its max number of workers
+// (P_IORING_REGISTER_IOWQ_MAX_WORKERS.) Workers exit after being idle for a while.
+// Worker CPU affinity can be set with P_IORING_REGISTER_IOWQ_AFF (Linux only,
+// accepted but ignored on Darwin which does not support pinning threads.)
+//
+// A request on a host fd holds a duplicate of the fd while it is with io-wq, like a
+// Linux request holds a reference to its file: the application may close the fd
+// (e.g. with a CLOSE linked to a READ) before a worker gets to the request.
+//
+// Requests being executed are on wq->running so that they can be canceled
+// (ioring_cancel.c): the worker is sent IO_WQ_CANCEL_SIG, which makes a host syscall
+// it is blocked in fail with EINTR. The handler is only installed if the process
+// hasn't got one of its own for that signal.
+#if !defined(HAS_LIBC)
+  #error io-wq requires libc
+#endif
+
+#include <errno.h>    // ETIMEDOUT
+#include <signal.h>
+#include <sys/stat.h> // fstat
+#if defined(__linux__)
+  #include <sched.h> // cpu_set_t
+#endif
+
+#define IO_WQ_IDLE_TIMEOUT      5    // seconds until an idle worker exits (5*HZ in Linux)
+#define IO_WQ_MAX_UNBOUND       128  // default max number of unbound workers
+#define IO_WQ_MAX_BOUND_PER_CPU 4    // default max number of bound workers per CPU
+#define IO_WQ_CANCEL_SIG        SIGURG // interrupts a worker; ignored by default
+
+// io_wq_running_t: a request being executed by a worker; on the worker's stack
+typedef struct io_wq_running {
+  ioreq_t*               req;
+  pthread_t              thread;
+  struct io_wq_running*  next;
+  struct io_wq_running** pprev;
+  bool                   canceled; // set by io_wq_cancel, which interrupted the thread
+} io_wq_running_t;
+
+static pthread_once_t g_io_wq_sig_once = PTHREAD_ONCE_INIT;
+static bool           g_io_wq_cancel_sig; // IO_WQ_CANCEL_SIG handler is installed
+
+
+static void io_wq_cancel_sig_handler(int sig) {
+  // nothing to do; the signal interrupts the syscall the worker is blocked in
+}
+
+
+static void io_wq_cancel_sig_init() {
+  struct sigaction sa;
+  if (sigaction(IO_WQ_CANCEL_SIG, NULL, &sa) != 0 || sa.sa_handler != SIG_DFL)
+    return; // the process handles the signal itself; running requests can't be interrupted
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = io_wq_cancel_sig_handler; // without SA_RESTART
+  sigemptyset(&sa.sa_mask);
+  g_io_wq_cancel_sig = sigaction(IO_WQ_CANCEL_SIG, &sa, NULL) == 0;
+}
+
+
+static void io_wq_init(io_wq_t* wq, ioringctx_t* ctx) {
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  if (ncpu < 1)
+    ncpu = 1;
+  pthread_once(&g_io_wq_sig_once, io_wq_cancel_sig_init);
+  wq->ctx = ctx;
+  pthread_mutex_init(&wq->lock, NULL);
+  pthread_cond_init(&wq->exit_cond, NULL);
+  for (u32 i = 0; i < IO_WQ_ACCT_NR; i++) {
+    pthread_cond_init(&wq->acct[i].cond, NULL);
+    wq->acct[i].wq = wq;
+    wq->acct[i].tailp = &wq->acct[i].head;
+  }
+  wq->acct[IO_WQ_ACCT_BOUND].max_workers =
+    MIN(ctx->sq_entries, (u32)ncpu*IO_WQ_MAX_BOUND_PER_CPU);
+  wq->acct[IO_WQ_ACCT_UNBOUND].max_workers = IO_WQ_MAX_UNBOUND;
+  for (u32 i = 0; i < IO_WQ_FD_CACHE; i++)
+    wq->fd_acct[i].fd = -1;
+}
+
+
+// io_wq_exit stops all workers. Operations which have not yet started are dropped.
+// Waits for operations in progress to finish; a ring being closed cancels them first
+// (io_cancel_ring_exit.)
+static void io_wq_exit(io_wq_t* wq) {
+  if (!wq->ctx) // not initialized
+    return;
+  pthread_mutex_lock(&wq->lock);
+  wq->exit = true;
+  for (u32 i = 0; i < IO_WQ_ACCT_NR; i++) {
+    io_wq_acct_t* acct = &wq->acct[i];
+    pthread_cond_broadcast(&acct->cond);
+    while (acct->head) {
+      ioreq_t* req = acct->head;
+      acct->head = req->next;
+      io_req_free_chain(req);
+    }
+    acct->tailp = &acct->head;
+  }
+  while (wq->acct[IO_WQ_ACCT_BOUND].nr_workers || wq->acct[IO_WQ_ACCT_UNBOUND].nr_workers)
+    pthread_cond_wait(&wq->exit_cond, &wq->lock);
+  pthread_mutex_unlock(&wq->lock);
+
+  for (u32 i = 0; i < IO_WQ_ACCT_NR; i++)
+    pthread_cond_destroy(&wq->acct[i].cond);
+  pthread_cond_destroy(&wq->exit_cond);
+  pthread_mutex_destroy(&wq->lock);
+}
+
+
+// io_wq_apply_affinity sets the CPU affinity of the calling worker.
+// Called with wq->lock held.
+static void io_wq_apply_affinity(io_wq_t* wq) {
+  #if defined(__linux__)
+    cpu_set_t set;
+    if (wq->cpumask_len == 0) {
+      // no mask registered; may run on any CPU
+      memset(&set, 0xff, sizeof(set));
+    } else {
+      memset(&set, 0, sizeof(set));
+      memcpy(&set, wq->cpumask, MIN((usize)wq->cpumask_len, sizeof(set)));
+    }
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+      dlog("failed to set io-wq worker affinity");
+  #endif
+}
+
+
+// io_wq_run executes a request on an io-wq worker. Called with wq->lock held, which is
+// released while the request executes.
+static void io_wq_run(io_wq_t* wq, ioreq_t* req) {
+  ioringctx_t* ctx = wq->ctx;
+  io_wq_running_t run = { .req = req, .thread = pthread_self() };
+  if ((run.next = wq->running))
+    run.next->pprev = &run.next;
+  run.pprev = &wq->running;
+  wq->running = &run;
+  pthread_mutex_unlock(&wq->lock);
+
+  isize res = io_opdefs[req->sqe.opcode].issue(ctx, req);
+
+  pthread_mutex_lock(&wq->lock);
+  if ((*run.pprev = run.next))
+    run.next->pprev = run.pprev;
+  pthread_mutex_unlock(&wq->lock);
+  if (res != IO_ISSUE_QUEUED) {
+    // a host syscall interrupted by io_wq_cancel failed with EINTR
+    if (run.canceled && res < 0)
+      res = p_err_canceled;
+    io_req_complete_async(ctx, req, res);
+  }
+  pthread_mutex_lock(&wq->lock);
+}
+
+
+static void* io_wq_worker(void* arg) {
+  io_wq_acct_t* acct = arg;
+  io_wq_t* wq = acct->wq;
+  u32 aff_gen = 0;
+  io_current_is_worker = true;
+
+  if (g_io_wq_cancel_sig) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, IO_WQ_CANCEL_SIG);
+    pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+  }
+
+  pthread_mutex_lock(&wq->lock);
+  for (;;) {
+    if (wq->exit || acct->nr_workers > acct->max_workers)
+      break;
+
+    if (aff_gen != wq->cpumask_gen) {
+      aff_gen = wq->cpumask_gen;
+      io_wq_apply_affinity(wq);
+    }
+
+    ioreq_t* req = acct->head;
+    if (req) {
+      if (!(acct->head = req->next))
+        acct->tailp = &acct->head;
+      io_wq_run(wq, req); // frees req
+      continue;
+    }
+
+    // wait for work
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += IO_WQ_IDLE_TIMEOUT;
+    acct->nr_idle++;
+    int e = pthread_cond_timedwait(&acct->cond, &wq->lock, &deadline);
+    acct->nr_idle--;
+    // keep one worker around to avoid thread creation on the next burst of work
+    if (e == ETIMEDOUT && !acct->head && acct->nr_workers > 1)
+      break;
+  }
+  acct->nr_workers--;
+  if (wq->exit)
+    pthread_cond_signal(&wq->exit_cond);
+  pthread_mutex_unlock(&wq->lock);
+  return NULL;
+}
+
+
+// io_wq_create_worker starts a new worker. Called with wq->lock held.
+static bool io_wq_create_worker(io_wq_acct_t* acct) {
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  pthread_t t;
+  int e = pthread_create(&t, &attr, io_wq_worker, acct);
+  pthread_attr_destroy(&attr);
+  if (e)
+    return false;
+  acct->nr_workers++;
+  return true;
+}
+
+
+// io_wq_enqueue queues req for a worker.
+// Returns false if no worker could be started, in which case req is not queued.
+// Requests queued while the pool is shutting down are dropped, like queued work.
+static bool io_wq_enqueue(io_wq_t* wq, u32 acctidx, ioreq_t* req) {
+  io_wq_acct_t* acct = &wq->acct[acctidx];
+  req->next = NULL;
+  pthread_mutex_lock(&wq->lock);
+  if (wq->exit) {
+    pthread_mutex_unlock(&wq->lock);
+    io_req_free_chain(req);
+    return true;
+  }
+  *acct->tailp = req;
+  acct->tailp = &req->next;
+  if (acct->nr_idle > 0) {
+    pthread_cond_signal(&acct->cond);
+  } else if (acct->nr_workers < acct->max_workers || acct->nr_workers == 0) {
+    if (!io_wq_create_worker(acct) && acct->nr_workers == 0) {
+      // unable to start any worker; let the caller run the operation
+      acct->head = NULL;
+      acct->tailp = &acct->head;
+      pthread_mutex_unlock(&wq->lock);
+      return false;
+    }
+  }
+  pthread_mutex_unlock(&wq->lock);
+  return true;
+}
+
+
+// io_wq_fd_acct returns the worker group of operations on host fd, or -1 if fd is not
+// open. Called with ctx->uring_lock held.
+static int io_wq_fd_acct(io_wq_t* wq, fd_t fd) {
+  u32 closes = host_fd_close_count(fd); // before fstat; see host_fd_close_count
+  io_wq_fd_acct_t* e = &wq->fd_acct[(u32)fd & (IO_WQ_FD_CACHE - 1)];
+  if (e->fd == fd && e->closes == closes)
+    return (int)e->acct;
+  struct stat st;
+  if (fstat(fd, &st) != 0)
+    return -1;
+  e->fd = fd;
+  e->closes = closes;
+  e->acct = (S_ISREG(st.st_mode) || S_ISBLK(st.st_mode)) ? IO_WQ_ACCT_BOUND :
+                                                            IO_WQ_ACCT_UNBOUND;
+  return (int)e->acct;
+}
+
+
+// io_wq_acct_for returns the worker group that should execute req, or -1 if req
+// should be executed inline by the submitting thread
+static int io_wq_acct_for(io_wq_t* wq, const io_opdef_t* def, const ioreq_t* req) {
+  if (def->no_wq) // armed rather than blocking; see ioring_poll.c
+    return -1;
+  bool force = def->force_async || (req->sqe.flags & P_IORING_SQE_ASYNC);
+  if (!def->needs_file)
+    return force ? IO_WQ_ACCT_BOUND : -1;
+
+  // virtual files (gui surfaces, etc.) don't block unless asked to go async
+  if (req->file)
+    return force ? IO_WQ_ACCT_UNBOUND : -1;
+
+  // the type of registered files is known; no need to stat them
+  int acct;
+  if (req->flags & IOREQ_F_FIXED_FILE) {
+    acct = (req->flags & IOREQ_F_BOUND) ? IO_WQ_ACCT_BOUND : IO_WQ_ACCT_UNBOUND;
+  } else {
+    acct = io_wq_fd_acct(wq, req->fd); // -1 lets the operation report a bad fd
+  }
+
+  // a READ with P_IORING_SQE_BUFFER_SELECT of a file which may have to wait for data
+  // is armed on the poll thread instead (io_read_select)
+  if (acct == IO_WQ_ACCT_UNBOUND && (req->sqe.flags & P_IORING_SQE_BUFFER_SELECT))
+    return -1;
+  return acct;
+}
+
+
+// io_wq_punt hands req over to a worker if it may block.
+// Requests on the submitter's stack are copied.
+// Returns false if req should be executed inline.
+static bool io_wq_punt(ioringctx_t* ctx, const io_opdef_t* def, ioreq_t* req) {
+  int acctidx = io_wq_acct_for(&ctx->wq, def, req);
+  if (acctidx < 0)
+    return false;
+  // the application may close fd, and the file table a registered file, while the
+  // request is queued or running
+  fd_t fd_ref = -1;
+  if (def->needs_file && !req->file) {
+    fd_ref = fcntl((int)req->fd, F_DUPFD_CLOEXEC, 0);
+    if (fd_ref < 0)
+      return false; // let the operation report the error
+  }
+  ioreq_t* r = io_req_persist(req);
+  if (!r)
+    goto no_punt;
+  r->flags |= IOREQ_F_ASYNC;
+  if (fd_ref >= 0) {
+    r->fd_ref = fd_ref;
+    r->flags |= IOREQ_F_FD_REF;
+  }
+  if (io_wq_enqueue(&ctx->wq, (u32)acctidx, r))
+    return true;
+  r->flags &= ~(IOREQ_F_ASYNC | IOREQ_F_FD_REF);
+  if (r != req)
+    io_req_free(r);
+no_punt:
+  if (fd_ref >= 0)
+    close(fd_ref);
+  return false;
+}
+
+
+// io_wq_cancel takes requests matching cd back from the io-wq queues and returns them
+// (linked by next), to be completed by the caller with p_err_canceled. Workers
+// executing a matching request are interrupted; nr_running is set to their number.
+// Only the first match unless io_cancel_all(cd).
+static ioreq_t* io_wq_cancel(io_wq_t* wq, const io_cancel_data_t* cd, u32* nr_running) {
+  bool all = io_cancel_all(cd);
+  ioreq_t* canceled = NULL;
+  *nr_running = 0;
+  pthread_mutex_lock(&wq->lock);
+  for (u32 i = 0; i < IO_WQ_ACCT_NR && (all || !canceled); i++) {
+    io_wq_acct_t* acct = &wq->acct[i];
+    ioreq_t** pp = &acct->head;
+    while (*pp && (all || !canceled)) {
+      ioreq_t* req = *pp;
+      if (!io_cancel_match(req, cd)) {
+        pp = &req->next;
+        continue;
+      }
+      *pp = req->next;
+      req->next = canceled;
+      canceled = req;
+    }
+    if (!*pp)
+      acct->tailp = pp;
+  }
+  for (io_wq_running_t* run = wq->running; run && (all || !canceled); run = run->next) {
+    if (!io_cancel_match(run->req, cd))
+      continue;
+    run->canceled = true;
+    if (g_io_wq_cancel_sig)
+      pthread_kill(run->thread, IO_WQ_CANCEL_SIG);
+    (*nr_running)++;
+    if (!all)
+      break;
+  }
+  pthread_mutex_unlock(&wq->lock);
+  return canceled;
+}
+
+
+// P_IORING_REGISTER_IOWQ_MAX_WORKERS
+// arg is u32[2] with new limits for bound and unbound workers (0 = leave unchanged);
+// the previous limits are written back to arg.
+static isize io_wq_register_max_workers(io_wq_t* wq, void* arg, u32 nr_args) {
+  u32 v[IO_WQ_ACCT_NR];
+  if (!arg || nr_args != IO_WQ_ACCT_NR)
+    return p_err_invalid;
+  if (!copy_from_user(v, arg, sizeof(v)))
+    return p_err_mfault;
+  pthread_mutex_lock(&wq->lock);
+  for (u32 i = 0; i < IO_WQ_ACCT_NR; i++) {
+    u32 prev = wq->acct[i].max_workers;
+    if (v[i]) {
+      wq->acct[i].max_workers = v[i];
+      pthread_cond_broadcast(&wq->acct[i].cond); // let excess idle workers exit
+    }
+    v[i] = prev;
+  }
+  pthread_mutex_unlock(&wq->lock);
+  if (!copy_to_user(arg, v, sizeof(v)))
+    return p_err_mfault;
+  return 0;
+}
+
+
+// P_IORING_REGISTER_IOWQ_AFF (arg = CPU mask of nr_args bytes) and
+// P_IORING_UNREGISTER_IOWQ_AFF (arg = NULL)
+static isize io_wq_register_aff(io_wq_t* wq, const void* arg, u32 nr_args) {
+  if (arg) {
+    if (nr_args == 0)
+      return p_err_invalid;
+    nr_args = MIN(nr_args, (u32)sizeof(wq->cpumask));
+  } else if (nr_args) {
+    return p_err_invalid;
+  }
+  pthread_mutex_lock(&wq->lock);
+  if (arg && !copy_from_user(wq->cpumask, arg, nr_args)) {
+    pthread_mutex_unlock(&wq->lock);
+    return p_err_mfault;
+  }
+  wq->cpumask_len = nr_args;
+  wq->cpumask_gen++;
+  for (u32 i = 0; i < IO_WQ_ACCT_NR; i++)
+    pthread_cond_broadcast(&wq->acct[i].cond); // let idle workers apply the mask
+  pthread_mutex_unlock(&wq->lock);
+  return 0;
+}
@@ -0,0 +1,237 @@
+// SPDX-License-Identifier: Apache-2.0
+// This file is included by ioring_base.c
+
+// provided buffers
+//
+// The application hands buffers to the ring up front with P_IORING_OP_PROVIDE_BUFFERS,
+// grouped by sqe->buf_group. A READ with P_IORING_SQE_BUFFER_SELECT doesn't name a
+// buffer; one is taken from its group only once the file has data to read, and its ID
+// is reported in the upper 16 bits of cqe.flags along with P_IORING_CQE_F_BUFFER.
+// The buffer then belongs to the application until it provides it again.
+// Buffers of reads which fail or hit end of file are put back into their group.
+//
+// Each group is a stack, so a recently used (cache-warm) buffer is picked first.
+// Groups are guarded by ctx->kbuf_lock since io-wq workers select buffers.
+
+#define IORING_MAX_BID (1U << 16) // buffer IDs are u16
+
+#if defined(HAS_LIBC)
+  #define io_kbuf_lock(ctx)   pthread_mutex_lock(&(ctx)->kbuf_lock)
+  #define io_kbuf_unlock(ctx) pthread_mutex_unlock(&(ctx)->kbuf_lock)
+#else
+  #define io_kbuf_lock(ctx)   ((void)0)
+  #define io_kbuf_unlock(ctx) ((void)0)
+#endif
+
+
+// io_buffer_t: a provided buffer
+typedef struct io_buffer {
+  u64 addr;
+  u32 len;
+  u16 bid;
+} io_buffer_t;
+
+// io_buffer_list_t: a group of provided buffers
+typedef struct io_buffer_list {
+  io_buffer_t* bufs; // stack; the next buffer to select is bufs[nbufs-1]
+  u32          nbufs;
+  u32          cap;
+  u16          bgid;
+} io_buffer_list_t;
+
+
+// io_buffer_get_list returns the group bgid, or NULL if it does not exist.
+// Called with ctx->kbuf_lock held.
+static io_buffer_list_t* io_buffer_get_list(ioringctx_t* ctx, u16 bgid) {
+  for (u32 i = 0; i < ctx->nr_io_bl; i++) {
+    if (ctx->io_bl[i].bgid == bgid)
+      return &ctx->io_bl[i];
+  }
+  return NULL;
+}
+
+
+// io_buffer_add_list returns the group bgid, creating it if needed.
+// Called with ctx->kbuf_lock held.
+static io_buffer_list_t* io_buffer_add_list(ioringctx_t* ctx, u16 bgid) {
+  io_buffer_list_t* bl = io_buffer_get_list(ctx, bgid);
+  if (bl)
+    return bl;
+  if (ctx->nr_io_bl == ctx->io_bl_cap) {
+    u32 cap = ctx->io_bl_cap ? ctx->io_bl_cap * 2 : 4;
+    io_buffer_list_t* v = mem_alloc(sizeof(io_buffer_list_t) * cap);
+    if (!v)
+      return NULL;
+    if (ctx->io_bl)
+      memcpy(v, ctx->io_bl, sizeof(io_buffer_list_t) * ctx->nr_io_bl);
+    mem_free(ctx->io_bl, sizeof(io_buffer_list_t) * ctx->io_bl_cap);
+    ctx->io_bl = v;
+    ctx->io_bl_cap = cap;
+  }
+  bl = &ctx->io_bl[ctx->nr_io_bl++];
+  memset(bl, 0, sizeof(*bl));
+  bl->bgid = bgid;
+  return bl;
+}
+
+
+// io_buffer_list_reserve makes room for n more buffers in bl
+static bool io_buffer_list_reserve(io_buffer_list_t* bl, u32 n) {
+  if (bl->cap - bl->nbufs >= n)
+    return true;
+  u32 cap = MAX(bl->cap * 2, bl->nbufs + n);
+  io_buffer_t* bufs = mem_alloc(sizeof(io_buffer_t) * cap);
+  if (!bufs)
+    return false;
+  if (bl->bufs)
+    memcpy(bufs, bl->bufs, sizeof(io_buffer_t) * bl->nbufs);
+  mem_free(bl->bufs, sizeof(io_buffer_t) * bl->cap);
+  bl->bufs = bufs;
+  bl->cap = cap;
+  return true;
+}
+
+
+static void io_destroy_buffers(ioringctx_t* ctx) {
+  for (u32 i = 0; i < ctx->nr_io_bl; i++)
+    mem_free(ctx->io_bl[i].bufs, sizeof(io_buffer_t) * ctx->io_bl[i].cap);
+  mem_free(ctx->io_bl, sizeof(io_buffer_list_t) * ctx->io_bl_cap);
+  ctx->io_bl = NULL;
+  ctx->nr_io_bl = 0;
+  ctx->io_bl_cap = 0;
+}
+
+
+// io_buffer_select takes a buffer from group bgid
+static err_t io_buffer_select(ioringctx_t* ctx, u16 bgid, io_buffer_t* buf) {
+  err_t err = 0;
+  io_kbuf_lock(ctx);
+  io_buffer_list_t* bl = io_buffer_get_list(ctx, bgid);
+  if (!bl || bl->nbufs == 0) {
+    err = p_err_nomem; // ENOBUFS in Linux
+  } else {
+    *buf = bl->bufs[--bl->nbufs];
+  }
+  io_kbuf_unlock(ctx);
+  return err;
+}
+
+
+// io_buffer_recycle puts back a buffer that was selected but not used.
+// The buffer is dropped if its group has been removed in the meantime.
+static void io_buffer_recycle(ioringctx_t* ctx, u16 bgid, const io_buffer_t* buf) {
+  io_kbuf_lock(ctx);
+  io_buffer_list_t* bl = io_buffer_get_list(ctx, bgid);
+  if (bl && io_buffer_list_reserve(bl, 1))
+    bl->bufs[bl->nbufs++] = *buf;
+  io_kbuf_unlock(ctx);
+}
+
+
+// io_read_select performs a READ with P_IORING_SQE_BUFFER_SELECT.
+// On success the completion carries the ID of the buffer that was read into.
+static isize io_read_select(ioringctx_t* ctx, ioreq_t* req) {
+  if (!ctx) // not available to the native driver's emulation of vfile operations
+    return p_err_not_supported;
+
+  #if defined(HAS_LIBC)
+  // Host files which may have to wait for data (pipes, sockets, etc.) are armed on
+  // the poll thread, which takes a buffer out of the group once the file is ready
+  // (io_poll_read) rather than a worker blocking until then. Regular files are always
+  // ready and are read by an io-wq worker. (Virtual files have no way of signalling
+  // readiness.)
+  if (!req->file && !(req->flags & IOREQ_F_ASYNC))
+    return io_poll_add_req(ctx, req, P_POLLIN, false);
+  #endif
+
+  u16 bgid = req->sqe.buf_group;
+  io_buffer_t buf;
+  err_t err = io_buffer_select(ctx, bgid, &buf);
+  if (err)
+    return err;
+
+  req->sqe.addr = buf.addr;
+  if (req->sqe.len == 0 || req->sqe.len > buf.len)
+    req->sqe.len = buf.len;
+  isize res = io_do_read(req);
+  if (res <= 0) {
+    io_buffer_recycle(ctx, bgid, &buf);
+    return res;
+  }
+  req->cflags |= P_IORING_CQE_F_BUFFER | ((u32)buf.bid << P_IORING_CQE_BUFFER_SHIFT);
+  return res;
+}
+
+
+// P_IORING_OP_PROVIDE_BUFFERS
+//   fd        number of buffers
+//   addr      address of the first buffer
+//   len       size of each buffer; buffers are consecutive in memory
+//   buf_group group to add the buffers to
+//   off       ID of the first buffer; IDs of the following buffers are incremented
+// Returns the number of buffers added.
+static isize io_provide_buffers(ioringctx_t* ctx, ioreq_t* req) {
+  const p_ioring_sqe_t* sqe = &req->sqe;
+  if (sqe->ioprio || sqe->rw_flags)
+    return p_err_invalid;
+  u32 nbufs = (u32)sqe->fd;
+  if (sqe->fd <= 0 || nbufs > IORING_MAX_BID || sqe->off >= IORING_MAX_BID)
+    return p_err_overflow;
+  if ((u32)sqe->off + nbufs > IORING_MAX_BID)
+    return p_err_overflow;
+  u64 size, end;
+  if (check_mul_overflow((u64)sqe->len, (u64)nbufs, &size) ||
+      check_add_overflow((u64)sqe->addr, size, &end))
+  {
+    return p_err_overflow;
+  }
+  if (!sqe->addr || !sqe->len)
+    return p_err_mfault;
+
+  isize res = (isize)nbufs;
+  io_kbuf_lock(ctx);
+  io_buffer_list_t* bl = io_buffer_add_list(ctx, sqe->buf_group);
+  if (!bl || !io_buffer_list_reserve(bl, nbufs)) {
+    res = p_err_nomem;
+  } else {
+    // push in reverse order so that the buffer with the lowest ID is selected first
+    for (u32 i = nbufs; i > 0; i--) {
+      io_buffer_t* buf = &bl->bufs[bl->nbufs++];
+      buf->addr = sqe->addr + (u64)sqe->len * (i - 1);
+      buf->len = sqe->len;
+      buf->bid = (u16)(sqe->off + i - 1);
+    }
+  }
+  io_kbuf_unlock(ctx);
+  return res;
+}
+
+
+// P_IORING_OP_REMOVE_BUFFERS
+//   fd        max number of buffers to remove
+//   buf_group group to remove buffers from
+// Returns the number of buffers removed. An empty group is removed too.
+static isize io_remove_buffers(ioringctx_t* ctx, ioreq_t* req) {
+  const p_ioring_sqe_t* sqe = &req->sqe;
+  if (sqe->ioprio || sqe->rw_flags || sqe->addr || sqe->len || sqe->off)
+    return p_err_invalid;
+  if (sqe->fd <= 0 || (u32)sqe->fd > IORING_MAX_BID)
+    return p_err_invalid;
+
+  isize res;
+  io_kbuf_lock(ctx);
+  io_buffer_list_t* bl = io_buffer_get_list(ctx, sqe->buf_group);
+  if (!bl) {
+    res = p_err_not_found;
+  } else {
+    u32 n = MIN((u32)sqe->fd, bl->nbufs);
+    bl->nbufs -= n;
+    res = (isize)n;
+    if (bl->nbufs == 0) {
+      mem_free(bl->bufs, sizeof(io_buffer_t) * bl->cap);
+      *bl = ctx->io_bl[--ctx->nr_io_bl];
+    }
+  }
+  io_kbuf_unlock(ctx);
+  return res;
+}
@@ -1,18 +1,501 @@
 // SPDX-License-Identifier: Apache-2.0
 // ioring impl on Linux io_uring
-// This file is conditionally included by ioring.c
+// This file is conditionally included by ioring.c and has ioring_base.c included before it
+//
+// Rings are created by the kernel, so the ring memory the application maps is the
+// kernel's own ring and operations are executed asynchronously by the kernel.
+// p_ioring_* structs and IORING_OP_ values match Linux and are passed through as-is.
+//
+// The kernel knows nothing about virtual files (gui surfaces, gpu devices, rings of
+// the portable driver, etc.) nor about playsys open flags. Before entering the kernel,
+// SQEs about to be submitted are inspected:
+//   - OPENAT flags are translated to O_ flags.
+//   - Operations on virtual files are performed using the portable driver's
+//     implementation. The SQE is then rewritten into a MSG_RING operation which
+//     targets the ring itself, making the kernel post a CQE with the SQE's user_data
+//     and the result of the operation.
+//
+// Limitations of the native driver:
+//   - Operations on virtual files are performed at submission time, before any
+//     kernel operations submitted in the same call, even in a link chain.
+//   - With IORING_SETUP_SQPOLL the kernel consumes SQEs on its own; operations on
+//     virtual files fail.
+//   - res of CQEs of failed operations are negated Linux errno values, including those
+//     of emulated operations, and the ring has P_IORING_FEAT_HOST_ERRNO. sysring
+//     translates them to err_t values as the application consumes CQEs, except for
+//     those with P_IORING_CQE_F_MSG: MSG_RING operations are rewritten to have the
+//     kernel set it, which Linux <6.3 can't, and with SQPOLL they aren't inspected.
+//   - Provided buffers live in the kernel; reads from virtual files can't use
+//     P_IORING_SQE_BUFFER_SELECT.
+//   - Virtual files can't be polled nor read with multishot operations.
+//
+// The portable driver is used instead when io_uring is unavailable (not built into
+// the kernel or disabled, e.g. by seccomp), when the kernel lacks MSG_RING (<5.18)
+// or for rings larger than Linux allows (see ioring_set_max_entries.)
+#define IORING_NATIVE 1
+
+#include <errno.h>
+#include <fcntl.h>       // O_* flags
+#include <stdlib.h>      // calloc, free
+#include <unistd.h>      // syscall
+#include <sys/mman.h>
+#include <sys/syscall.h> // __NR_io_uring_*
+
+#ifndef __NR_io_uring_setup
+  #define __NR_io_uring_setup    425
+  #define __NR_io_uring_enter    426
+  #define __NR_io_uring_register 427
+#endif
+
+// definitions from Linux >5.15
+#define IOSQE_CQE_SKIP_SUCCESS     (1U << 6)
+#define IORING_FEAT_REG_REG_RING   (1U << 13) // Linux 6.3
+#define IORING_MSG_RING_FLAGS_PASS (1U << 1)  // sqe->msg_ring_flags; Linux 6.2
+
+static_assert(sizeof(p_ioring_params_t) == 120, "does not match struct io_uring_params");
+static_assert(sizeof(p_ioring_sqe_t) == 64, "does not match struct io_uring_sqe");
+static_assert(sizeof(p_ioring_cqe_t) == 16, "does not match struct io_uring_cqe");
+static_assert(P_AT_FDCWD == AT_FDCWD, "");
+static_assert(P_IORING_OFF_SQ_RING == 0 && P_IORING_OFF_SQES == 0x10000000ULL, "");
+
+
+// ioring_native_t: a ring created by the kernel
+typedef struct ioring_native {
+  fd_t            fd;         // kernel io_uring file descriptor (also the vfile key)
+  u32             refs;       // the vfile's, and those taken by io_native_lookup
+  u32             flags;      // P_IORING_SETUP_ flags
+  u32             sq_entries;
+  u32             sq_prepped; // SQ position up to which SQEs have been inspected
+  bool            msg_flags;  // MSG_RING can set the flags of its CQE (FLAGS_PASS)
+  u32*            sq_head;    // written by the kernel
+  u32*            sq_tail;    // written by the application
+  u32*            sq_array;
+  p_ioring_sqe_t* sqes;
+  void*           sq_ring;    // our mapping of the kernel's SQ and CQ rings
+  usize           sq_ring_size;
+  usize           sqes_size;
+} ioring_native_t;
+
+
+// g_native_avail: 0 = not yet known, 1 = available, -1 = use the portable driver
+static int g_native_avail = 0;
+
+
+// io_native_err returns the error for an errno value of an io_uring syscall
+static err_t io_native_err(int e) {
+  if (e == EBUSY)
+    return p_err_overflow; // CQ overflow backlog is full
+  return err_from_errno(e);
+}
+
+
+// io_native_errno returns the negated Linux errno value for the result of an emulated
+// operation, like the kernel's CQEs carry; the first one of P_ERRNO_ERRS with the error
+static isize io_native_errno(isize res) {
+  if (res >= 0)
+    return res;
+  #define X(name, linux_errno, err) if (res == err) return -linux_errno;
+  P_ERRNO_ERRS(X)
+  #undef X
+  return -EINVAL;
+}
+
+
+static bool io_native_probe_op(fd_t fd, u8 op) {
+  struct {
+    u8  last_op;
+    u8  ops_len;
+    u16 resv;
+    u32 resv2[3];
+    struct { u8 op; u8 resv; u16 flags; u32 resv2; } ops[256];
+  } probe = {0};
+  if (syscall(__NR_io_uring_register, fd, P_IORING_REGISTER_PROBE, &probe, 256) < 0)
+    return false;
+  return op <= probe.last_op && (probe.ops[op].flags & P_IO_URING_OP_SUPPORTED);
+}
+
+
+// io_native_put drops a reference to n. The last one unmaps and closes the ring;
+// returns the result of closing it, or 0 if the ring is still in use.
+static err_t io_native_put(ioring_native_t* n) {
+  if (__atomic_sub_fetch(&n->refs, 1, __ATOMIC_ACQ_REL))
+    return 0;
+  munmap(n->sqes, n->sqes_size);
+  munmap(n->sq_ring, n->sq_ring_size);
+  fd_t fd = n->fd;
+  free(n);
+  return _psys_close_host(0, fd);
+}
+
+
+// io_native_release is called once the ring's vfile is out of the map. Threads in
+// ioring_enter or ioring_register keep the ring open until they return.
+static err_t io_native_release(vfile_t* f) {
+  return io_native_put(f->data);
+}
+
+
+// io_native_mmap hands out the driver's own mappings of the ring, like the portable
+// driver does; there's no munmap, and io_native_release unmaps them
+static err_t io_native_mmap(vfile_t* f, void** addr, usize sz, mmapflag_t flag, usize offs) {
+  ioring_native_t* n = f->data;
+  switch (offs) {
+    case P_IORING_OFF_SQ_RING:
+    case P_IORING_OFF_CQ_RING: // P_IORING_FEAT_SINGLE_MMAP
+      if (sz > n->sq_ring_size)
+        return p_err_invalid;
+      *addr = n->sq_ring;
+      return 0;
+    case P_IORING_OFF_SQES:
+      if (sz > n->sqes_size)
+        return p_err_invalid;
+      *addr = n->sqes;
+      return 0;
+    default:
+      return p_err_invalid;
+  }
+}
+
+
+static const vfile_ops_t io_native_fops = {
+  .release = io_native_release,
+  .mmap = io_native_mmap,
+};
+
+
+// io_native_lookup returns the native ring ring with a reference, to be dropped with
+// io_native_put, or NULL if ring is not a native ring. Like ioringctx_lookup, the
+// reference is taken while the vfile map is locked, which keeps the ring from being
+// closed in between.
+static ioring_native_t* io_native_lookup(fd_t ring) {
+  ioring_native_t* n = NULL;
+  vfile_t* f = vfile_lookup_hold(ring);
+  if (f && f->fops == &io_native_fops) {
+    n = __atomic_load_n(&f->data, __ATOMIC_ACQUIRE);
+    if (n)
+      __atomic_fetch_add(&n->refs, 1, __ATOMIC_RELAXED);
+  }
+  vfile_lookup_done();
+  return n;
+}
+
+
+static fd_t io_native_setup(u32 entries, p_ioring_params_t* params) {
+  p_ioring_params_t p;
+  if (!copy_from_user(&p, params, sizeof(p)))
+    return p_err_mfault;
+
+  // Apply the same limits as the portable driver (ioring_max_entries), which is also
+  // used for rings larger than Linux supports
+  err_t e = io_ring_entries(entries, &p);
+  if (e)
+    return e;
+  if (p.sq_entries > IORING_MAX_ENTRIES || p.cq_entries > 2 * IORING_MAX_ENTRIES)
+    return p_err_not_supported;
+  entries = p.sq_entries;
+
+  int fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+  if (fd < 0) {
+    if (errno == ENOSYS || errno == EPERM)
+      g_native_avail = -1;
+    return io_native_err(errno);
+  }
+
+  // we need MSG_RING to post completions of operations on virtual files
+  if (g_native_avail == 0)
+    g_native_avail = io_native_probe_op(fd, P_IORING_OP_MSG_RING) ? 1 : -1;
+  if (g_native_avail < 0) {
+    close(fd);
+    return p_err_not_supported;
+  }
+
+  err_t err = p_err_nomem;
+  ioring_native_t* n = calloc(1, sizeof(ioring_native_t));
+  if (!n)
+    goto err_close;
+  n->fd = fd;
+  n->refs = 1;
+  n->flags = p.flags;
+  n->sq_entries = p.sq_entries;
+
+  // map the rings and SQEs so that we can inspect SQEs before the kernel does.
+  // The application gets the same mappings (io_native_mmap), so the CQ ring is mapped
+  // too; it shares the mapping of the SQ ring (P_IORING_FEAT_SINGLE_MMAP, Linux 5.4)
+  n->sq_ring_size = MAX(p.sq_off.array + p.sq_entries * sizeof(u32),
+                        p.cq_off.cqes + p.cq_entries * sizeof(p_ioring_cqe_t));
+  n->sq_ring = mmap(NULL, n->sq_ring_size, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, fd, P_IORING_OFF_SQ_RING);
+  if (n->sq_ring == MAP_FAILED)
+    goto err_free;
+  n->sqes_size = p.sq_entries * sizeof(p_ioring_sqe_t);
+  n->sqes = mmap(NULL, n->sqes_size, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, fd, P_IORING_OFF_SQES);
+  if (n->sqes == MAP_FAILED)
+    goto err_unmap_ring;
+  n->sq_head = (u32*)(n->sq_ring + p.sq_off.head);
+  n->sq_tail = (u32*)(n->sq_ring + p.sq_off.tail);
+  n->sq_array = (u32*)(n->sq_ring + p.sq_off.array);
+
+  // no feature of its own tells IORING_MSG_RING_FLAGS_PASS, which came one release earlier
+  n->msg_flags = (p.features & IORING_FEAT_REG_REG_RING) != 0;
+  p.features |= P_IORING_FEAT_HOST_ERRNO;
+  if (!copy_to_user(params, &p, sizeof(p))) {
+    err = p_err_mfault;
+    goto err_unmap_sqes;
+  }
+
+  vfile_t* f;
+  err = vfile_adopt(&f, fd, "[ioring]", &io_native_fops);
+  if (err < 0)
+    goto err_unmap_sqes;
+  // pairs with io_native_lookup; f->data is NULL until the ring is ready
+  __atomic_store_n(&f->data, n, __ATOMIC_RELEASE);
+  return fd;
+
+err_unmap_sqes:
+  munmap(n->sqes, n->sqes_size);
+err_unmap_ring:
+  munmap(n->sq_ring, n->sq_ring_size);
+err_free:
+  free(n);
+err_close:
+  close(fd);
+  return err;
+}
+
+
+static u32 io_native_openflags(u32 flags) {
+  u32 oflag = flags & 3; // first two bits is ro/wo/rw, same values as Linux
+  if (flags & p_open_append) oflag |= O_APPEND;
+  if (flags & p_open_create) oflag |= O_CREAT;
+  if (flags & p_open_trunc)  oflag |= O_TRUNC;
+  if (flags & p_open_excl)   oflag |= O_EXCL;
+  return oflag;
+}
+
+
+// io_native_emulate performs an operation the kernel can't and rewrites sqe into a
+// message to the ring itself, carrying the result of the operation.
+// f is the vfile operated on, if any, and gen its generation (vfile_lookup_gen.)
+static void io_native_emulate(
+  ioring_native_t* n, p_ioring_sqe_t* sqe, vfile_t* f, u32 gen)
+{
+  ioreq_t req = { .fd = sqe->fd, .file = f, .file_gen = gen };
+  memcpy(&req.sqe, sqe, sizeof(req.sqe));
+
+  isize res;
+  switch (sqe->opcode) {
+    case P_IORING_OP_NOP:    res = io_nop(NULL, &req); break;
+    case P_IORING_OP_READ:   res = io_read(NULL, &req); break;
+    case P_IORING_OP_WRITE:  res = io_write(NULL, &req); break;
+    // registered buffers live in the kernel; vfiles use the memory directly
+    case P_IORING_OP_READ_FIXED:  res = io_read_fixed(NULL, &req); break;
+    case P_IORING_OP_WRITE_FIXED: res = io_write_fixed(NULL, &req); break;
+    case P_IORING_OP_OPENAT: res = io_openat(NULL, &req); break;
+    case P_IORING_OP_CLOSE:
+      // the ring can't be closed by one of its own operations as it is in use
+      res = (sqe->fd == n->fd) ? p_err_badfd : io_close(NULL, &req);
+      break;
+    case P_IORING_OP_ASYNC_CANCEL:
+      // operations on vfiles complete before the kernel sees them
+      res = p_err_not_found;
+      break;
+    case P_IORING_OP_SPLICE:
+    case P_IORING_OP_TEE:
+      // registered files live in the kernel
+      res = (sqe->flags & P_IORING_SQE_FIXED_FILE) ? p_err_not_supported :
+            io_prep_splice(NULL, &req);
+      if (res == 0)
+        res = sqe->opcode == P_IORING_OP_SPLICE ? io_splice(NULL, &req) : io_tee(NULL, &req);
+      break;
+    case P_IORING_OP_FSYNC:
+    case P_IORING_OP_SYNC_FILE_RANGE:
+      res = io_prep_fsync(NULL, &req); // fails for vfiles, which have no storage
+      break;
+    case P_IORING_OP_STATX:    res = io_statx(NULL, &req); break;
+    case P_IORING_OP_UNLINKAT: res = io_unlinkat(NULL, &req); break;
+    case P_IORING_OP_RENAMEAT: res = io_renameat(NULL, &req); break;
+    default:
+      res = p_err_not_supported;
+  }
+
+  // The kernel posts a CQE with the SQE's user_data and res=len to the target ring.
+  // The CQE of the MSG_RING operation itself is skipped.
+  u8 flags = sqe->flags & (P_IORING_SQE_IO_DRAIN | P_IORING_SQE_IO_LINK |
+                           P_IORING_SQE_IO_HARDLINK);
+  u64 user_data = sqe->user_data;
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = P_IORING_OP_MSG_RING;
+  sqe->flags = flags | IOSQE_CQE_SKIP_SUCCESS;
+  sqe->fd = n->fd;
+  sqe->len = (u32)(i32)io_native_errno(res);
+  sqe->off = user_data;
+  sqe->user_data = user_data;
+}
+
+
+// io_native_path_special returns true if the path at addr is in the special
+// filesystem, which only exists in this process
+static bool io_native_path_special(u64 addr) {
+  const char* path = (const char*)(usize)addr;
+  return path && strlen(path) > strlen(SPECIAL_FS_PREFIX) &&
+         memcmp(path, SPECIAL_FS_PREFIX "/", strlen(SPECIAL_FS_PREFIX "/")) == 0;
+}
+
+
+static void io_native_prep_sqe(ioring_native_t* n, p_ioring_sqe_t* sqe) {
+  switch (sqe->opcode) {
+    case P_IORING_OP_ASYNC_CANCEL:
+      // the kernel can't look up a vfile to cancel requests on
+      if ((sqe->cancel_flags & P_IORING_ASYNC_CANCEL_FD) &&
+          !(sqe->cancel_flags & P_IORING_ASYNC_CANCEL_FD_FIXED) && vfile_lookup(sqe->fd))
+      {
+        io_native_emulate(n, sqe, NULL, 0);
+      }
+      return;
+    case P_IORING_OP_MSG_RING:
+      // have the kernel set P_IORING_CQE_F_MSG, which keeps sysring from taking res
+      // for an errno value; the kernel passes file_index as the CQE's flags
+      if (n->msg_flags && !sqe->rw_flags && !sqe->file_index) {
+        sqe->rw_flags = IORING_MSG_RING_FLAGS_PASS;
+        sqe->file_index = P_IORING_CQE_F_MSG;
+      }
+      return;
+    case P_IORING_OP_NOP:
+    case P_IORING_OP_TIMEOUT:
+    case P_IORING_OP_TIMEOUT_REMOVE:
+    case P_IORING_OP_LINK_TIMEOUT:
+    case P_IORING_OP_FILES_UPDATE:
+    case P_IORING_OP_MADVISE:
+    case P_IORING_OP_PROVIDE_BUFFERS:
+    case P_IORING_OP_REMOVE_BUFFERS:
+    case P_IORING_OP_POLL_REMOVE:
+      return; // sqe->fd is not a file descriptor, or is a ring known by the kernel
+  }
+
+  // Fixed files are resolved by the kernel from its registered file table,
+  // which only holds host files.
+  vfile_t* f = NULL;
+  u32 gen = 0;
+  if (!(sqe->flags & P_IORING_SQE_FIXED_FILE))
+    f = vfile_lookup_gen(sqe->fd, &gen);
+
+  // native rings are kernel files, but must be closed through the vfile
+  if (f && f->fops == &io_native_fops && sqe->opcode != P_IORING_OP_CLOSE)
+    f = NULL;
+
+  if (sqe->opcode == P_IORING_OP_OPENAT && !f) {
+    if (io_native_path_special(sqe->addr))
+      return io_native_emulate(n, sqe, NULL, 0);
+    sqe->open_flags = io_native_openflags(sqe->open_flags);
+    return;
+  }
+
+  // STATX, UNLINKAT and RENAMEAT take paths, which may be special, and RENAMEAT a
+  // second directory in len. Flags and p_statx_t are the same as the kernel's.
+  if (!f && (sqe->opcode == P_IORING_OP_STATX || sqe->opcode == P_IORING_OP_UNLINKAT ||
+             sqe->opcode == P_IORING_OP_RENAMEAT))
+  {
+    bool special = io_native_path_special(sqe->addr);
+    if (sqe->opcode == P_IORING_OP_RENAMEAT) {
+      special = special || io_native_path_special(sqe->addr2) ||
+                vfile_lookup((fd_t)sqe->len) != NULL;
+    }
+    if (special)
+      io_native_emulate(n, sqe, NULL, 0);
+    return;
+  }
+
+  // SPLICE and TEE also read from splice_fd_in
+  if (!f && (sqe->opcode == P_IORING_OP_SPLICE || sqe->opcode == P_IORING_OP_TEE) &&
+      !(sqe->splice_flags & P_SPLICE_F_FD_IN_FIXED) && vfile_lookup(sqe->splice_fd_in))
+  {
+    return io_native_emulate(n, sqe, NULL, 0);
+  }
+
+  if (f)
+    io_native_emulate(n, sqe, f, gen);
+}
+
+
+// io_native_prep_sqes inspects the SQEs that the kernel is about to consume.
+// Note that the kernel may consume fewer than nr; sq_prepped makes sure that no SQE
+// is inspected twice.
+static void io_native_prep_sqes(ioring_native_t* n, u32 nr) {
+  u32 head = smp_load_acquire(n->sq_head);
+  u32 tail = smp_load_acquire(n->sq_tail); // pairs with the application's mbarrier_w()
+  u32 end = head + MIN(nr, tail - head);
+  u32 pos = ((i32)(n->sq_prepped - head) > 0) ? n->sq_prepped : head;
+  u32 mask = n->sq_entries - 1;
+
+  for (; (i32)(end - pos) > 0; pos++) {
+    u32 idx = READ_ONCE(n->sq_array[pos & mask]);
+    if (idx < n->sq_entries) // else the kernel drops the entry
+      io_native_prep_sqe(n, &n->sqes[idx]);
+  }
+
+  if ((i32)(end - n->sq_prepped) > 0)
+    n->sq_prepped = end;
+}
+
+
+static isize io_native_enter(
+  ioring_native_t* n, u32 to_submit, u32 min_complete, u32 flags, const void* arg)
+{
+  usize argsz = 0;
+  if (flags & P_IORING_ENTER_EXT_ARG) {
+    argsz = sizeof(p_ioring_getevents_arg_t);
+  } else if (arg) {
+    return p_err_invalid; // would be taken for a signal mask
+  }
+
+  if (to_submit && !(n->flags & P_IORING_SETUP_SQPOLL))
+    io_native_prep_sqes(n, to_submit);
+
+  isize r = syscall(__NR_io_uring_enter, n->fd, to_submit, min_complete, flags, arg, argsz);
+  if (r < 0)
+    return io_native_err(errno);
+  return r;
+}
+
+
+static isize io_native_register(ioring_native_t* n, u32 opcode, const void* arg, u32 nr_args) {
+  isize r = syscall(__NR_io_uring_register, n->fd, opcode, arg, nr_args);
+  if (r < 0)
+    return io_native_err(errno);
+  return r;
+}
+
 
 fd_t _psys_ioring_setup(psysop_t _, u32 entries, p_ioring_params_t* params) {
-  // TODO
-  return p_err_not_supported;
+  if (g_native_avail >= 0) {
+    fd_t fd = io_native_setup(entries, params);
+    if (g_native_avail >= 0 && fd != p_err_not_supported)
+      return fd;
+  }
+  return ioring_base_setup(entries, params);
 }
 
-isize _psys_ioring_enter(psysop_t _, fd_t ring, u32 to_submit, u32 min_complete, u32 flags) {
-  // TODO
-  return p_err_not_supported;
+
+isize _psys_ioring_enter(
+  psysop_t _, fd_t ring, u32 to_submit, u32 min_complete, u32 flags, const void* arg)
+{
+  ioring_native_t* n = io_native_lookup(ring);
+  if (n) {
+    isize res = io_native_enter(n, to_submit, min_complete, flags, arg);
+    io_native_put(n);
+    return res;
+  }
+  return ioring_base_enter(ring, to_submit, min_complete, flags, arg);
 }
 
+
 isize _psys_ioring_register(psysop_t _, fd_t ring, u32 opcode, const void* arg, u32 nr_args) {
-  // TODO
-  return p_err_not_supported;
+  ioring_native_t* n = io_native_lookup(ring);
+  if (n) {
+    isize res = io_native_register(n, opcode, arg, nr_args);
+    io_native_put(n);
+    return res;
+  }
+  return ioring_base_register(ring, opcode, arg, nr_args);
 }
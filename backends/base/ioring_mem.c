@@ -0,0 +1,196 @@
+// SPDX-License-Identifier: Apache-2.0
+// This file is included by ioring_base.c
+
+// ring memory
+//
+// Small driver allocations (buffer lists, registered file and buffer tables and,
+// without libc, requests) are served from slabs: MEM_SLAB_CHUNK sized mappings
+// carved into objects of one size class, a power of two from 16 to 2048 bytes.
+// Freed objects go on a free list of their class and slab chunks are never
+// unmapped, so after the first few rings, setting up a ring and tearing it down
+// again does not enter the host. Larger allocations are mapped on their own.
+// Memory returned by mem_alloc is zeroed; mem_free takes the size that was passed
+// to mem_alloc.
+//
+// The rings (header, CQEs and SQ index array) and the SQEs of a ring share one
+// mapping, allocated with mem_ring_alloc. It is prefaulted so that the first
+// submissions don't take page faults, and mappings of MEM_HUGEPAGE_SIZE or more
+// are backed by huge pages when the host has them available. Mappings of closed
+// rings are kept in a small cache (MEM_RING_CACHE_MAX) and reused by new rings of
+// the same size.
+
+#define MEM_SLAB_CHUNK     (64*1024)
+#define MEM_SLAB_MINSHIFT  4  // 16 B
+#define MEM_SLAB_MAXSHIFT  11 // 2 kB
+#define MEM_SLAB_MAX       (1u << MEM_SLAB_MAXSHIFT)
+#define MEM_SLAB_NCLASSES  (MEM_SLAB_MAXSHIFT - MEM_SLAB_MINSHIFT + 1)
+#define MEM_HUGEPAGE_SIZE  (2*1024*1024)
+#define MEM_PREFAULT_PAGE  4096 // stride for touching pages when MAP_POPULATE is missing
+#define MEM_RING_CACHE_MAX 4
+
+
+// mem_slab_t: objects of one size class
+typedef struct mem_slab {
+  void* free_list; // freed objects, linked through their first word
+  char* next;      // unused part of the current chunk
+  char* end;
+} mem_slab_t;
+
+typedef struct mem_ring_cached {
+  void* p;
+  usize size;
+} mem_ring_cached_t;
+
+static mem_slab_t        g_mem_slabs[MEM_SLAB_NCLASSES];
+static mem_ring_cached_t g_mem_ring_cache[MEM_RING_CACHE_MAX];
+
+#if defined(HAS_LIBC)
+  static pthread_mutex_t g_mem_lock = PTHREAD_MUTEX_INITIALIZER;
+  #define mem_lock()   pthread_mutex_lock(&g_mem_lock)
+  #define mem_unlock() pthread_mutex_unlock(&g_mem_lock)
+#else
+  #define mem_lock()   ((void)0)
+  #define mem_unlock() ((void)0)
+#endif
+
+
+static void* mem_map(usize size, int extra_flags) {
+  void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON | extra_flags, -1, 0);
+  return p == MAP_FAILED ? NULL : p;
+}
+
+
+// mem_slab_class returns the index into g_mem_slabs for objects of size bytes
+static u32 mem_slab_class(usize size) {
+  if (size <= (1u << MEM_SLAB_MINSHIFT))
+    return 0;
+  return (u32)fls((u32)size - 1) - MEM_SLAB_MINSHIFT;
+}
+
+
+static void* mem_alloc(usize size) {
+  if (size > MEM_SLAB_MAX)
+    return mem_map(size, 0);
+
+  u32 class = mem_slab_class(size);
+  usize objsize = (usize)1 << (class + MEM_SLAB_MINSHIFT);
+  mem_slab_t* slab = &g_mem_slabs[class];
+
+  mem_lock();
+  void* p = slab->free_list;
+  if (p) {
+    slab->free_list = *(void**)p;
+    mem_unlock();
+    memset(p, 0, objsize);
+    return p;
+  }
+  if (slab->next == slab->end) {
+    char* chunk = mem_map(MEM_SLAB_CHUNK, 0);
+    if (!chunk) {
+      mem_unlock();
+      return NULL;
+    }
+    slab->next = chunk;
+    slab->end = chunk + MEM_SLAB_CHUNK;
+  }
+  p = slab->next; // fresh memory from mmap is already zeroed
+  slab->next += objsize;
+  mem_unlock();
+  return p;
+}
+
+
+static void mem_free(void* p, usize size) {
+  if (!p)
+    return;
+  if (size > MEM_SLAB_MAX) {
+    munmap(p, size);
+    return;
+  }
+  mem_slab_t* slab = &g_mem_slabs[mem_slab_class(size)];
+  mem_lock();
+  *(void**)p = slab->free_list;
+  slab->free_list = p;
+  mem_unlock();
+}
+
+
+// mem_ring_size returns the size of the mapping made for a ring region of size bytes
+static usize mem_ring_size(usize size) {
+  if (size >= MEM_HUGEPAGE_SIZE)
+    return ALIGN(size, (usize)MEM_HUGEPAGE_SIZE);
+  return size;
+}
+
+
+// mem_ring_alloc returns memory for the rings and SQEs of a ring.
+// Unlike mem_alloc, the memory may have been used by a closed ring and is not zeroed.
+static void* mem_ring_alloc(usize size) {
+  size = mem_ring_size(size);
+
+  mem_lock();
+  for (u32 i = 0; i < MEM_RING_CACHE_MAX; i++) {
+    mem_ring_cached_t* c = &g_mem_ring_cache[i];
+    if (c->p && c->size == size) {
+      void* p = c->p;
+      c->p = NULL;
+      mem_unlock();
+      return p;
+    }
+  }
+  mem_unlock();
+
+  int populate = 0;
+  #if defined(MAP_POPULATE)
+  populate = MAP_POPULATE;
+  #endif
+
+  void* p = NULL;
+  bool populated = false;
+  if (size >= MEM_HUGEPAGE_SIZE) {
+    #if defined(MAP_HUGETLB)
+    // explicit huge pages; fails unless the host has reserved some
+    p = mem_map(size, MAP_HUGETLB | populate);
+    populated = p && populate;
+    #endif
+    if (!p) {
+      p = mem_map(size, 0);
+      #if defined(MADV_HUGEPAGE)
+      if (p)
+        madvise(p, size, MADV_HUGEPAGE); // transparent huge pages; only a hint
+      #endif
+    }
+  } else {
+    p = mem_map(size, populate);
+    populated = populate != 0;
+  }
+  if (!p)
+    return NULL;
+
+  if (!populated) {
+    for (usize offs = 0; offs < size; offs += MEM_PREFAULT_PAGE)
+      ((volatile char*)p)[offs] = 0;
+  }
+  return p;
+}
+
+
+// mem_ring_free releases memory returned by mem_ring_alloc(size)
+static void mem_ring_free(void* p, usize size) {
+  if (!p)
+    return;
+  size = mem_ring_size(size);
+
+  mem_lock();
+  for (u32 i = 0; i < MEM_RING_CACHE_MAX; i++) {
+    mem_ring_cached_t* c = &g_mem_ring_cache[i];
+    if (!c->p) {
+      c->p = p;
+      c->size = size;
+      mem_unlock();
+      return;
+    }
+  }
+  mem_unlock();
+  munmap(p, size);
+}
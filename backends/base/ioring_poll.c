@@ -0,0 +1,534 @@
+// SPDX-License-Identifier: Apache-2.0
+// This file is included by ioring_base.c
+
+// poll and multishot operations: P_IORING_OP_POLL_ADD, P_IORING_OP_POLL_REMOVE and
+// P_IORING_OP_READ_MULTISHOT, as well as P_IORING_OP_READ with
+// P_IORING_SQE_BUFFER_SELECT of host files which may have to wait for data
+//
+// Rather than occupying an io-wq worker each, these operations are armed: host files
+// are watched by the ring's poll thread (started with the first poll) using poll(2),
+// and the operation is performed once the file is ready. A multishot operation stays
+// armed after posting a CQE, which then has P_IORING_CQE_F_MORE set in its flags. Its
+// last CQE, without P_IORING_CQE_F_MORE, is posted when it is removed or fails.
+//
+// Host poll is level-triggered, so a multishot POLL_ADD which has posted a CQE isn't
+// armed again until the next call to ioring_enter; otherwise it would post CQEs for
+// as long as the condition holds. A multishot READ consumes what it's waiting for and
+// stays armed.
+//
+// Virtual files have no way of signalling readiness. Multishot reads of virtual files
+// are instead performed by the ring's vfile thread (started with the first one), one
+// after the other, so that threads waiting for completions are not held up by them.
+// Their read function may block until there is data (e.g. a gui surface waits for OS
+// events); a read of 0 bytes means there's nothing to read yet, and the read is retried
+// after IO_POLL_VFILE_INTERVAL.
+//
+// Poll state is guarded by ctx->completion_lock. Entries of poll_list are freed only
+// by the poll thread and entries of poll_vfile_list only by the vfile thread, so that
+// each can use an entry without holding the lock.
+#if !defined(HAS_LIBC)
+  #error poll requires libc
+#endif
+
+#include <errno.h>
+#include <poll.h>
+
+// IO_POLL_VFILE_INTERVAL is how often the vfile thread retries multishot reads of
+// virtual files which had nothing to read (nanoseconds)
+#define IO_POLL_VFILE_INTERVAL 1000000
+
+static_assert(P_POLLIN == POLLIN && P_POLLPRI == POLLPRI && P_POLLOUT == POLLOUT &&
+              P_POLLERR == POLLERR && P_POLLHUP == POLLHUP && P_POLLNVAL == POLLNVAL,
+              "poll events must match the host's");
+
+// io_poll_t: an armed POLL_ADD, READ_MULTISHOT or READ request
+typedef struct io_poll {
+  ioreq_t*         req;
+  struct io_poll*  next;
+  struct io_poll** pprev;
+  u32              events;    // poll events to wait for
+  u32              len;       // READ*: max bytes per read (0 = buffer size)
+  bool             multishot;
+  bool             armed;     // included in the next poll(2) of the poll thread
+  bool             canceled;  // removed; completed by the thread which owns it
+} io_poll_t;
+
+
+static void io_poll_list_add(io_poll_t** head, io_poll_t* p) {
+  if ((p->next = *head))
+    p->next->pprev = &p->next;
+  p->pprev = head;
+  *head = p;
+}
+
+
+static void io_poll_list_del(io_poll_t* p) {
+  if ((*p->pprev = p->next))
+    p->next->pprev = p->pprev;
+  p->pprev = NULL;
+}
+
+
+// io_poll_wake interrupts the poll thread's poll(2)
+static void io_poll_wake(ioringctx_t* ctx) {
+  char b = 0;
+  while (write(ctx->poll_wake_fd[1], &b, 1) < 0 && errno == EINTR) {}
+}
+
+
+// io_cqring_post posts and publishes a CQE which doesn't complete its request,
+// i.e. one with P_IORING_CQE_F_MORE. Returns false if the CQ ring is full; rather than
+// filling the overflow backlog, the operation then ends.
+// Called with ctx->completion_lock held.
+static bool io_cqring_post(ioringctx_t* ctx, u64 user_data, i32 res, u32 cflags) {
+  if (!io_cqring_has_room(ctx))
+    return false;
+  io_cqring_fill(ctx, user_data, res, cflags);
+  io_commit_cqring(ctx);
+  return true;
+}
+
+
+// io_poll_finish completes the polls of a list (linked by next), freeing them
+static void io_poll_finish(ioringctx_t* ctx, io_poll_t* p) {
+  while (p) {
+    io_poll_t* next = p->next;
+    io_req_complete_async(ctx, p->req, p->canceled ? p_err_canceled : (isize)(i32)p->events);
+    free(p);
+    p = next;
+  }
+}
+
+
+// io_poll_read performs one read of a READ_MULTISHOT or READ request, into a buffer of
+// its group. Returns the number of bytes read, or an error.
+static isize io_poll_read(ioringctx_t* ctx, io_poll_t* p, u32* cflags) {
+  ioreq_t* req = p->req;
+  u16 bgid = req->sqe.buf_group;
+  io_buffer_t buf;
+  err_t err = io_buffer_select(ctx, bgid, &buf);
+  if (err)
+    return err;
+  req->sqe.addr = buf.addr;
+  req->sqe.len = (p->len == 0 || p->len > buf.len) ? buf.len : p->len;
+  isize res = io_do_read(req);
+  if (p->multishot)
+    req->flags &= ~IOREQ_F_FAIL; // short reads are expected
+  if (res <= 0) {
+    io_buffer_recycle(ctx, bgid, &buf);
+    return res;
+  }
+  *cflags = P_IORING_CQE_F_BUFFER | ((u32)buf.bid << P_IORING_CQE_BUFFER_SHIFT);
+  return res;
+}
+
+
+// io_poll_post posts a CQE of a multishot request. If it's the last one (res is an
+// error or end of file, or the CQ ring is full) p is unlinked and true is returned,
+// after which the caller completes p with io_poll_finish.
+// Called with ctx->completion_lock held.
+static bool io_poll_post(ioringctx_t* ctx, io_poll_t* p, isize res, u32 cflags) {
+  if (res > 0 &&
+      io_cqring_post(ctx, p->req->sqe.user_data, (i32)res, cflags | P_IORING_CQE_F_MORE))
+  {
+    return false;
+  }
+  io_poll_list_del(p);
+  p->events = (u32)(i32)(res > 0 ? p_err_overflow : res); // final result
+  return true;
+}
+
+
+// io_poll_collect prepares the poll thread's next poll(2): armed polls are added to
+// pfds and polls (from index 1; index 0 is the wakeup pipe) and removed polls are
+// unlinked and returned. Returns the number of pfds entries.
+// Called with ctx->completion_lock held.
+static u32 io_poll_collect(
+  ioringctx_t* ctx, struct pollfd** pfds, io_poll_t*** polls, u32* cap, io_poll_t** done)
+{
+  u32 n = 1;
+  for (io_poll_t* p = ctx->poll_list, *next; p; p = next) {
+    next = p->next;
+    if (p->canceled) {
+      io_poll_list_del(p);
+      p->next = *done;
+      *done = p;
+      continue;
+    }
+    if (!p->armed)
+      continue;
+    if (n == *cap) {
+      u32 c = *cap * 2;
+      struct pollfd* v1 = realloc(*pfds, sizeof(struct pollfd) * c);
+      if (v1)
+        *pfds = v1;
+      io_poll_t** v2 = v1 ? realloc(*polls, sizeof(io_poll_t*) * c) : NULL;
+      if (!v2)
+        break; // out of memory; poll what fits for now
+      *polls = v2;
+      *cap = c;
+    }
+    (*pfds)[n] = (struct pollfd){ .fd = (int)io_req_hostfd(p->req), .events = (short)p->events };
+    (*polls)[n++] = p;
+  }
+  return n;
+}
+
+
+static void* io_poll_thread(void* arg) {
+  ioringctx_t* ctx = arg;
+  io_current_is_worker = true;
+  u32 cap = 16;
+  struct pollfd* pfds = malloc(sizeof(struct pollfd) * cap);
+  io_poll_t** polls = malloc(sizeof(io_poll_t*) * cap);
+  if (!pfds || !polls) {
+    dlog("out of memory");
+    goto end;
+  }
+
+  io_cq_lock(ctx);
+  while (!ctx->poll_stop) {
+    io_poll_t* done = NULL;
+    u32 n = io_poll_collect(ctx, &pfds, &polls, &cap, &done);
+    io_cq_unlock(ctx);
+    io_poll_finish(ctx, done);
+    done = NULL;
+
+    pfds[0] = (struct pollfd){ .fd = ctx->poll_wake_fd[0], .events = POLLIN };
+    int nready = poll(pfds, n, -1);
+    if (pfds[0].revents) {
+      char b[64];
+      while (read(ctx->poll_wake_fd[0], b, sizeof(b)) > 0) {}
+    }
+
+    // perform operations whose file is ready
+    for (u32 i = 1; i < n && nready > 0; i++) {
+      if (!pfds[i].revents)
+        continue;
+      io_poll_t* p = polls[i];
+      isize res = (isize)(pfds[i].revents & (p->events | POLLERR | POLLHUP | POLLNVAL));
+      u32 cflags = 0;
+      if (p->req->sqe.opcode != P_IORING_OP_POLL_ADD)
+        res = io_poll_read(ctx, p, &cflags);
+      io_cq_lock(ctx);
+      if (p->canceled) {
+        // removed in the meantime; completed by io_poll_collect
+      } else if (!p->multishot) {
+        io_poll_list_del(p);
+        p->req->cflags |= cflags;
+        p->events = (u32)res;
+        p->next = done;
+        done = p;
+      } else if (p->req->sqe.opcode == P_IORING_OP_READ_MULTISHOT) {
+        if (io_poll_post(ctx, p, res, cflags)) {
+          p->next = done;
+          done = p;
+        }
+      } else {
+        // disarmed until the next ioring_enter, which may be called as soon as the
+        // application sees the CQE
+        p->armed = false;
+        ctx->poll_rearm = true;
+        if (io_poll_post(ctx, p, res, 0)) {
+          p->next = done;
+          done = p;
+        }
+      }
+      io_cq_unlock(ctx);
+    }
+    io_poll_finish(ctx, done);
+    io_cq_lock(ctx);
+  }
+  io_cq_unlock(ctx);
+end:
+  free(pfds);
+  free(polls);
+  return NULL;
+}
+
+
+// io_poll_arm adds p to the poll thread's list, starting the thread if needed.
+// Called with ctx->completion_lock held.
+static err_t io_poll_arm(ioringctx_t* ctx, io_poll_t* p) {
+  if (!ctx->poll_started) {
+    int* fds = ctx->poll_wake_fd;
+    if (pipe(fds) != 0)
+      return p_err_nomem;
+    for (u32 i = 0; i < 2; i++) {
+      fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+      fcntl(fds[i], F_SETFL, O_NONBLOCK);
+    }
+    if (pthread_create(&ctx->poll_thread, NULL, io_poll_thread, ctx)) {
+      close(fds[0]);
+      close(fds[1]);
+      return p_err_nomem;
+    }
+    ctx->poll_started = true;
+  }
+  p->armed = true;
+  io_poll_list_add(&ctx->poll_list, p);
+  io_poll_wake(ctx);
+  return 0;
+}
+
+
+// io_poll_rearm arms multishot polls which posted a CQE since the last call.
+// Called by ioring_enter.
+static void io_poll_rearm(ioringctx_t* ctx) {
+  if (LIKELY(!READ_ONCE(ctx->poll_rearm)))
+    return;
+  io_cq_lock(ctx);
+  ctx->poll_rearm = false;
+  for (io_poll_t* p = ctx->poll_list; p; p = p->next)
+    p->armed = true;
+  io_poll_wake(ctx);
+  io_cq_unlock(ctx);
+}
+
+
+// io_poll_vfiles performs multishot reads of virtual files, and completes the ones
+// which were removed. Called by the vfile thread with ctx->completion_lock held, which
+// is released while reading. Returns true if any CQE was posted.
+static bool io_poll_vfiles(ioringctx_t* ctx) {
+  bool posted = false;
+  io_poll_t* done = NULL;
+  // Other threads only add entries at the head of the list, so p->next stays valid
+  // while the lock is released.
+  for (io_poll_t* p = ctx->poll_vfile_list, *next; p; p = next) {
+    next = p->next;
+    if (!p->canceled) {
+      io_cq_unlock(ctx);
+      u32 cflags = 0;
+      isize res = io_poll_read(ctx, p, &cflags);
+      io_cq_lock(ctx);
+      if (p->canceled) {
+        io_poll_list_del(p);
+      } else if (res == 0) {
+        continue; // nothing to read yet
+      } else {
+        posted = true;
+        if (!io_poll_post(ctx, p, res == p_err_end ? 0 : res, cflags))
+          continue;
+      }
+    } else {
+      io_poll_list_del(p);
+    }
+    p->next = done;
+    done = p;
+  }
+  if (done) {
+    io_cq_unlock(ctx);
+    io_poll_finish(ctx, done);
+    io_cq_lock(ctx);
+  }
+  return posted || done;
+}
+
+
+static void* io_poll_vfile_thread(void* arg) {
+  ioringctx_t* ctx = arg;
+  io_current_is_worker = true;
+  io_cq_lock(ctx);
+  while (!ctx->poll_stop) {
+    if (!ctx->poll_vfile_list) {
+      pthread_cond_wait(&ctx->poll_vfile_cond, &ctx->completion_lock);
+    } else if (!io_poll_vfiles(ctx) && !ctx->poll_stop) {
+      u64 deadline = io_nanotime() + IO_POLL_VFILE_INTERVAL;
+      io_cond_wait(&ctx->poll_vfile_cond, &ctx->completion_lock, deadline);
+    }
+  }
+  io_cq_unlock(ctx);
+  return NULL;
+}
+
+
+// io_poll_vfile_arm adds p to the vfile thread's list, starting the thread if needed.
+// Called with ctx->completion_lock held.
+static err_t io_poll_vfile_arm(ioringctx_t* ctx, io_poll_t* p) {
+  if (!ctx->poll_vfile_started) {
+    if (pthread_create(&ctx->poll_vfile_thread, NULL, io_poll_vfile_thread, ctx))
+      return p_err_nomem;
+    ctx->poll_vfile_started = true;
+  }
+  io_poll_list_add(&ctx->poll_vfile_list, p);
+  pthread_cond_signal(&ctx->poll_vfile_cond);
+  return 0;
+}
+
+
+static void io_poll_init(ioringctx_t* ctx) {
+  io_cond_init(&ctx->poll_vfile_cond);
+}
+
+
+// io_poll_exit stops the poll and vfile threads and frees armed polls without
+// completing them. A read the vfile thread is blocked in is waited for.
+static void io_poll_exit(ioringctx_t* ctx) {
+  io_cq_lock(ctx);
+  bool started = ctx->poll_started;
+  bool vfile_started = ctx->poll_vfile_started;
+  ctx->poll_stop = true;
+  if (started)
+    io_poll_wake(ctx);
+  pthread_cond_signal(&ctx->poll_vfile_cond);
+  io_cq_unlock(ctx);
+  if (vfile_started)
+    pthread_join(ctx->poll_vfile_thread, NULL);
+  pthread_cond_destroy(&ctx->poll_vfile_cond);
+  if (started) {
+    pthread_join(ctx->poll_thread, NULL);
+    close(ctx->poll_wake_fd[0]);
+    close(ctx->poll_wake_fd[1]);
+  }
+  while (ctx->poll_list) {
+    io_poll_t* p = ctx->poll_list;
+    io_poll_list_del(p);
+    io_req_free_chain(p->req);
+    free(p);
+  }
+  while (ctx->poll_vfile_list) {
+    io_poll_t* p = ctx->poll_vfile_list;
+    io_poll_list_del(p);
+    io_req_free_chain(p->req);
+    free(p);
+  }
+}
+
+
+// io_poll_add_req arms req. Requests on the submitter's stack are copied.
+static isize io_poll_add_req(ioringctx_t* ctx, ioreq_t* req, u32 events, bool multishot) {
+  io_poll_t* p = calloc(1, sizeof(io_poll_t));
+  if (!p)
+    return p_err_nomem;
+  p->events = events;
+  p->len = req->sqe.len;
+  p->multishot = multishot;
+
+  // the file table may close a registered file while it's being polled
+  fd_t fd_ref = -1;
+  if ((req->flags & (IOREQ_F_FIXED_FILE | IOREQ_F_FD_REF)) == IOREQ_F_FIXED_FILE &&
+      !req->file)
+  {
+    if ((fd_ref = fcntl((int)req->fd, F_DUPFD_CLOEXEC, 0)) < 0) {
+      free(p);
+      return p_err_badfd;
+    }
+  }
+
+  err_t err = 0;
+  io_cq_lock(ctx);
+  ioreq_t* r = io_req_persist(req);
+  if (!r) {
+    err = p_err_nomem;
+  } else if (req->file) {
+    err = io_poll_vfile_arm(ctx, p);
+  } else {
+    err = io_poll_arm(ctx, p);
+  }
+  if (!err) {
+    if (fd_ref >= 0) {
+      r->fd_ref = fd_ref;
+      r->flags |= IOREQ_F_FD_REF;
+    }
+    p->req = r;
+  }
+  io_cq_unlock(ctx);
+  if (err) {
+    if (r && r != req)
+      io_req_free(r);
+    if (fd_ref >= 0)
+      close(fd_ref);
+    free(p);
+    return err;
+  }
+  return IO_ISSUE_QUEUED;
+}
+
+
+// P_IORING_OP_POLL_ADD
+//   fd            file to poll
+//   poll32_events P_POLL events to wait for
+//   len           P_IORING_POLL_ADD_MULTI to post a CQE for every event
+// res is the P_POLL events which occurred. Polling virtual files is not supported.
+static isize io_poll_add(ioringctx_t* ctx, ioreq_t* req) {
+  const p_ioring_sqe_t* sqe = &req->sqe;
+  if (!ctx || req->file) // the native driver passes host file polls to Linux
+    return p_err_not_supported;
+  if (sqe->addr || sqe->ioprio || sqe->buf_index || sqe->off || sqe->file_index)
+    return p_err_invalid;
+  if (sqe->len & ~P_IORING_POLL_ADD_MULTI)
+    return p_err_invalid;
+  return io_poll_add_req(ctx, req, sqe->poll32_events & 0xffff,
+                         sqe->len & P_IORING_POLL_ADD_MULTI);
+}
+
+
+// P_IORING_OP_READ_MULTISHOT
+//   fd            file to read from, at its current position (off must be 0 or -1)
+//   buf_group     group of provided buffers to read into (P_IORING_SQE_BUFFER_SELECT)
+//   len           max number of bytes per read (0 = size of the buffer)
+// Posts a CQE for every read, each with a buffer of the group.
+// The last CQE has res 0 at end of file, or an error (p_err_nomem when the group ran
+// out of buffers.)
+static isize io_read_multishot(ioringctx_t* ctx, ioreq_t* req) {
+  const p_ioring_sqe_t* sqe = &req->sqe;
+  if (!ctx)
+    return p_err_not_supported;
+  if (!(sqe->flags & P_IORING_SQE_BUFFER_SELECT))
+    return p_err_invalid;
+  if (sqe->addr || sqe->ioprio || sqe->rw_flags || sqe->file_index)
+    return p_err_invalid;
+  if (sqe->off != 0 && sqe->off != U64_MAX)
+    return p_err_invalid;
+  req->sqe.off = U64_MAX; // current position
+  return io_poll_add_req(ctx, req, POLLIN, true);
+}
+
+
+// io_poll_cancel marks armed requests matching cd as canceled; they complete with
+// p_err_canceled on the thread which owns them. Only the first match unless
+// io_cancel_all(cd). Returns the number of requests canceled.
+static u32 io_poll_cancel(ioringctx_t* ctx, const io_cancel_data_t* cd) {
+  io_cq_lock(ctx);
+  u32 nr = __io_poll_cancel(ctx, cd);
+  io_cq_unlock(ctx);
+  return nr;
+}
+
+
+// __io_poll_cancel is io_poll_cancel for callers which hold ctx->completion_lock
+static u32 __io_poll_cancel(ioringctx_t* ctx, const io_cancel_data_t* cd) {
+  bool all = io_cancel_all(cd);
+  u32 nr = 0;
+  io_poll_t* lists[] = { ctx->poll_list, ctx->poll_vfile_list };
+  for (u32 i = 0; i < ARRAY_LEN(lists) && (all || !nr); i++) {
+    for (io_poll_t* p = lists[i]; p && (all || !nr); p = p->next) {
+      if (!p->canceled && io_cancel_match(p->req, cd)) {
+        p->canceled = true;
+        nr++;
+      }
+    }
+  }
+  if (nr && ctx->poll_started)
+    io_poll_wake(ctx);
+  if (nr)
+    pthread_cond_signal(&ctx->poll_vfile_cond);
+  return nr;
+}
+
+
+// P_IORING_OP_POLL_REMOVE
+//   addr          user_data of the POLL_ADD or READ_MULTISHOT to remove
+// The removed request completes with p_err_canceled.
+static isize io_poll_remove(ioringctx_t* ctx, ioreq_t* req) {
+  const p_ioring_sqe_t* sqe = &req->sqe;
+  if (!ctx)
+    return p_err_not_supported;
+  if (sqe->ioprio || sqe->buf_index || sqe->off || sqe->len || sqe->poll32_events ||
+      sqe->file_index)
+  {
+    return p_err_invalid;
+  }
+  io_cancel_data_t cd = { .data = sqe->addr, .fd = -1 };
+  return io_poll_cancel(ctx, &cd) ? 0 : p_err_not_found;
+}
@@ -0,0 +1,363 @@
+// SPDX-License-Identifier: Apache-2.0
+// This file is included by ioring_base.c
+
+// registered resources
+//
+// Buffers registered with P_IORING_REGISTER_BUFFERS are validated once, when
+// registered. READ_FIXED and WRITE_FIXED operations select one with sqe->buf_index
+// and only need to check that [sqe->addr, sqe->addr + sqe->len) lies within it.
+//
+// Files registered with P_IORING_REGISTER_FILES are resolved once, when registered.
+// SQEs with P_IORING_SQE_FIXED_FILE use sqe->fd as an index into the file table
+// instead of looking up the fd. Like Linux, the table holds on to host files:
+// it owns a duplicate of each registered host fd, so the application may close its
+// fd. Virtual files can't be duplicated; closing one makes its slot invalid.
+//
+// Registered tables are only modified with ctx->uring_lock held, which is also held
+// while SQEs are submitted, so operations see a consistent table. Operations which
+// outlive their submission (io-wq, poll) take a duplicate of a registered host fd
+// along, so replacing or closing a slot doesn't affect those already in flight.
+
+#define IORING_MAX_REG_BUFFERS (1U << 14) // value from Linux 5.15
+#define IORING_MAX_BUF_SIZE    (1UL << 30) // 1 GiB; value from Linux 5.15 (SZ_1G)
+#define IORING_MAX_FIXED_FILES (1U << 15) // value from Linux 5.15
+
+
+// io_buffer_validate checks a buffer to be registered.
+// base=NULL,len=0 is an empty slot, which is allowed when allow_empty is true.
+static err_t io_buffer_validate(const p_iovec_t* iov, bool allow_empty) {
+  if (!iov->base)
+    return (iov->len == 0 && allow_empty) ? 0 : p_err_mfault;
+  if (iov->len == 0 || iov->len > IORING_MAX_BUF_SIZE)
+    return p_err_mfault;
+  usize end;
+  if (check_add_overflow((usize)iov->base, iov->len, &end))
+    return p_err_overflow;
+  return 0;
+}
+
+
+static void io_sqe_buffers_free(ioringctx_t* ctx) {
+  mem_free(ctx->user_bufs, sizeof(p_iovec_t) * ctx->nr_user_bufs);
+  ctx->user_bufs = NULL;
+  ctx->nr_user_bufs = 0;
+}
+
+
+// io_sqe_buffers_register handles P_IORING_REGISTER_BUFFERS (iovecs = array of
+// p_iovec_t) and P_IORING_REGISTER_BUFFERS2 (allow_empty)
+static isize io_sqe_buffers_register(
+  ioringctx_t* ctx, const p_iovec_t* iovecs, u32 nr, bool allow_empty)
+{
+  if (ctx->user_bufs)
+    return p_err_exists;
+  if (!iovecs || nr == 0 || nr > IORING_MAX_REG_BUFFERS)
+    return p_err_invalid;
+
+  p_iovec_t* bufs = mem_alloc(sizeof(p_iovec_t) * nr);
+  if (!bufs)
+    return p_err_nomem;
+  if (!copy_from_user(bufs, iovecs, sizeof(p_iovec_t) * nr)) {
+    mem_free(bufs, sizeof(p_iovec_t) * nr);
+    return p_err_mfault;
+  }
+  for (u32 i = 0; i < nr; i++) {
+    err_t err = io_buffer_validate(&bufs[i], allow_empty);
+    if (err) {
+      mem_free(bufs, sizeof(p_iovec_t) * nr);
+      return err;
+    }
+  }
+
+  ctx->user_bufs = bufs;
+  ctx->nr_user_bufs = nr;
+  return 0;
+}
+
+
+static isize io_sqe_buffers_unregister(ioringctx_t* ctx) {
+  if (!ctx->user_bufs)
+    return p_err_not_found;
+  io_sqe_buffers_free(ctx);
+  return 0;
+}
+
+
+// io_sqe_buffers_update handles P_IORING_REGISTER_BUFFERS_UPDATE.
+// Returns the number of buffers updated.
+static isize io_sqe_buffers_update(ioringctx_t* ctx, const p_ioring_rsrc_update2_t* up) {
+  if (!ctx->user_bufs)
+    return p_err_not_found;
+  u32 end;
+  if (check_add_overflow(up->offset, up->nr, &end) || end > ctx->nr_user_bufs)
+    return p_err_invalid;
+
+  const p_iovec_t* iovecs = (const p_iovec_t*)(usize)up->data;
+  for (u32 i = 0; i < up->nr; i++) {
+    p_iovec_t iov;
+    if (!copy_from_user(&iov, &iovecs[i], sizeof(iov)))
+      return i ? (isize)i : p_err_mfault;
+    err_t err = io_buffer_validate(&iov, true);
+    if (err)
+      return i ? (isize)i : err;
+    ctx->user_bufs[up->offset + i] = iov;
+  }
+  return (isize)up->nr;
+}
+
+
+// io_import_fixed checks that the region of a READ_FIXED or WRITE_FIXED operation
+// is within the registered buffer selected by sqe->buf_index
+static err_t io_import_fixed(ioringctx_t* ctx, const p_ioring_sqe_t* sqe) {
+  if (UNLIKELY(sqe->buf_index >= ctx->nr_user_bufs))
+    return p_err_mfault;
+  const p_iovec_t* iov = &ctx->user_bufs[sqe->buf_index];
+  u64 buf_addr = (u64)(usize)iov->base;
+  u64 end;
+  if (check_add_overflow((u64)sqe->addr, (u64)sqe->len, &end))
+    return p_err_mfault;
+  if (UNLIKELY(sqe->addr < buf_addr || end > buf_addr + iov->len))
+    return p_err_mfault;
+  return 0;
+}
+
+
+// ---------------------------------------------------------------------------------------
+// registered files
+
+
+static void io_fixed_file_clear(io_fixed_file_t* ff) {
+  #if defined(HAS_LIBC)
+  if (!ff->file && ff->fd >= 0)
+    close(ff->fd);
+  #endif
+  ff->file = NULL;
+  ff->gen = 0;
+  ff->fd = -1;
+  ff->flags = 0;
+}
+
+
+// io_fixed_file_set resolves fd and stores it in ff (which must be clear)
+static err_t io_fixed_file_set(io_fixed_file_t* ff, fd_t fd) {
+  if (fd == -1) // empty slot
+    return 0;
+  if (fd < 0)
+    return p_err_badfd;
+
+  // like Linux, don't allow registering rings (which may reference each other)
+  ioringctx_t* ring = ioringctx_lookup(fd);
+  if (ring) {
+    ioringctx_put(ring);
+    return p_err_badfd;
+  }
+  vfile_t* f = vfile_lookup_hold(fd);
+  if (f) {
+    ff->file = f;
+    ff->gen = f->gen;
+    ff->fd = fd;
+  }
+  vfile_lookup_done();
+  if (f)
+    return 0;
+
+  #if defined(HAS_LIBC)
+  int dupfd = fcntl((int)fd, F_DUPFD_CLOEXEC, 0);
+  if (dupfd < 0)
+    return p_err_badfd;
+  struct stat st;
+  if (fstat(dupfd, &st) == 0 && (S_ISREG(st.st_mode) || S_ISBLK(st.st_mode)))
+    ff->flags = IOREQ_F_BOUND;
+  fd = dupfd;
+  #endif
+  ff->fd = fd;
+  return 0;
+}
+
+
+// io_fixed_file_get returns the registered file at index, or NULL if there is none.
+// Called with ctx->uring_lock held.
+static const io_fixed_file_t* io_fixed_file_get(ioringctx_t* ctx, u32 index) {
+  if (UNLIKELY(index >= ctx->nr_user_files))
+    return NULL;
+  const io_fixed_file_t* ff = &ctx->file_table[index];
+  if (UNLIKELY(ff->fd < 0))
+    return NULL;
+  // a registered vfile is invalid once the application has closed it, even if a file
+  // opened later got the same fd and vfile_t
+  if (ff->file && UNLIKELY(READ_ONCE(ff->file->gen) != ff->gen ||
+                           READ_ONCE(ff->file->fd) != ff->fd))
+  {
+    return NULL;
+  }
+  return ff;
+}
+
+
+static void io_sqe_files_free(ioringctx_t* ctx) {
+  for (u32 i = 0; i < ctx->nr_user_files; i++)
+    io_fixed_file_clear(&ctx->file_table[i]);
+  mem_free(ctx->file_table, sizeof(io_fixed_file_t) * ctx->nr_user_files);
+  ctx->file_table = NULL;
+  ctx->nr_user_files = 0;
+}
+
+
+// io_sqe_files_register handles P_IORING_REGISTER_FILES and P_IORING_REGISTER_FILES2.
+// fds is an array of nr fd_t; -1 denotes an empty slot.
+static isize io_sqe_files_register(ioringctx_t* ctx, const fd_t* fds, u32 nr) {
+  if (ctx->file_table)
+    return p_err_exists;
+  if (!fds || nr == 0 || nr > IORING_MAX_FIXED_FILES)
+    return p_err_invalid;
+
+  io_fixed_file_t* table = mem_alloc(sizeof(io_fixed_file_t) * nr);
+  if (!table)
+    return p_err_nomem;
+  ctx->file_table = table;
+  ctx->nr_user_files = nr;
+  for (u32 i = 0; i < nr; i++)
+    table[i].fd = -1;
+
+  for (u32 i = 0; i < nr; i++) {
+    fd_t fd;
+    err_t err = copy_from_user(&fd, &fds[i], sizeof(fd)) ? 0 : p_err_mfault;
+    if (!err)
+      err = io_fixed_file_set(&table[i], fd);
+    if (err) {
+      io_sqe_files_free(ctx);
+      return err;
+    }
+  }
+  return 0;
+}
+
+
+static isize io_sqe_files_unregister(ioringctx_t* ctx) {
+  if (!ctx->file_table)
+    return p_err_not_found;
+  io_sqe_files_free(ctx);
+  return 0;
+}
+
+
+// io_sqe_files_update replaces nr slots starting at offset with fds.
+// P_IORING_REGISTER_FILES_SKIP leaves a slot unchanged and -1 clears it.
+// Returns the number of slots processed.
+static isize io_sqe_files_update(ioringctx_t* ctx, u32 offset, const fd_t* fds, u32 nr) {
+  if (!ctx->file_table)
+    return p_err_not_found;
+  u32 end;
+  if (check_add_overflow(offset, nr, &end) || end > ctx->nr_user_files)
+    return p_err_invalid;
+
+  for (u32 i = 0; i < nr; i++) {
+    fd_t fd;
+    err_t err = copy_from_user(&fd, &fds[i], sizeof(fd)) ? 0 : p_err_mfault;
+    if (!err && fd != P_IORING_REGISTER_FILES_SKIP) {
+      io_fixed_file_t* ff = &ctx->file_table[offset + i];
+      io_fixed_file_clear(ff);
+      err = io_fixed_file_set(ff, fd);
+    }
+    if (err)
+      return i ? (isize)i : err;
+  }
+  return (isize)nr;
+}
+
+
+static isize io_register_files_update(ioringctx_t* ctx, const void* arg, u32 nr_args) {
+  p_ioring_files_update_t up;
+  if (!arg || nr_args == 0)
+    return p_err_invalid;
+  if (!copy_from_user(&up, arg, sizeof(up)))
+    return p_err_mfault;
+  if (up.resv)
+    return p_err_invalid;
+  return io_sqe_files_update(ctx, up.offset, (const fd_t*)(usize)up.fds, nr_args);
+}
+
+
+// io_install_fixed_file stores fd, just opened by an OPENAT operation, in slot of the
+// file table, closing the file previously stored there. The table takes ownership of fd.
+static err_t io_install_fixed_file(ioringctx_t* ctx, u32 slot, fd_t fd) {
+  err_t err = 0;
+  if (!ctx->file_table) {
+    err = p_err_badfd;
+  } else if (slot >= ctx->nr_user_files) {
+    err = p_err_invalid;
+  } else if (vfile_lookup(fd)) {
+    err = p_err_not_supported; // the table can't own virtual files
+  }
+  if (err) {
+    _psys_close(0, fd);
+    return err;
+  }
+  io_fixed_file_t* ff = &ctx->file_table[slot];
+  io_fixed_file_clear(ff);
+  ff->fd = fd;
+  #if defined(HAS_LIBC)
+  struct stat st;
+  if (fstat(fd, &st) == 0 && (S_ISREG(st.st_mode) || S_ISBLK(st.st_mode)))
+    ff->flags = IOREQ_F_BOUND;
+  #endif
+  return 0;
+}
+
+
+// io_close_fixed closes the file in slot of the file table (CLOSE with file_index)
+static err_t io_close_fixed(ioringctx_t* ctx, u32 slot) {
+  if (slot >= ctx->nr_user_files)
+    return p_err_invalid;
+  io_fixed_file_t* ff = &ctx->file_table[slot];
+  if (ff->fd < 0)
+    return p_err_badfd;
+  io_fixed_file_clear(ff);
+  return 0;
+}
+
+
+// ---------------------------------------------------------------------------------------
+
+
+typedef enum io_rsrc_type {
+  IORING_RSRC_FILE,
+  IORING_RSRC_BUFFER,
+} io_rsrc_type_t;
+
+
+// io_register_rsrc handles P_IORING_REGISTER_FILES2 and P_IORING_REGISTER_BUFFERS2
+static isize io_register_rsrc(ioringctx_t* ctx, const void* arg, u32 size, io_rsrc_type_t t) {
+  p_ioring_rsrc_register_t rr;
+  if (size != sizeof(rr))
+    return p_err_invalid;
+  if (!copy_from_user(&rr, arg, sizeof(rr)))
+    return p_err_mfault;
+  if (rr.resv || rr.resv2)
+    return p_err_invalid;
+  if (rr.tags)
+    return p_err_not_supported;
+  if (t == IORING_RSRC_FILE)
+    return io_sqe_files_register(ctx, (const fd_t*)(usize)rr.data, rr.nr);
+  return io_sqe_buffers_register(ctx, (const p_iovec_t*)(usize)rr.data, rr.nr, true);
+}
+
+
+// io_register_rsrc_update handles P_IORING_REGISTER_FILES_UPDATE2 and
+// P_IORING_REGISTER_BUFFERS_UPDATE
+static isize io_register_rsrc_update(
+  ioringctx_t* ctx, const void* arg, u32 size, io_rsrc_type_t t)
+{
+  p_ioring_rsrc_update2_t up;
+  if (size != sizeof(up))
+    return p_err_invalid;
+  if (!copy_from_user(&up, arg, sizeof(up)))
+    return p_err_mfault;
+  if (up.resv || up.resv2)
+    return p_err_invalid;
+  if (up.tags)
+    return p_err_not_supported;
+  if (t == IORING_RSRC_FILE)
+    return io_sqe_files_update(ctx, up.offset, (const fd_t*)(usize)up.data, up.nr);
+  return io_sqe_buffers_update(ctx, &up);
+}
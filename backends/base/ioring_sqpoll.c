@@ -0,0 +1,137 @@
+// SPDX-License-Identifier: Apache-2.0
+// This file is included by ioring_base.c
+
+// SQ poll thread (P_IORING_SETUP_SQPOLL)
+//
+// A host thread which consumes SQEs as soon as the application publishes them,
+// so that the application can submit without calling ioring_enter.
+// When no SQEs have been submitted for sq_thread_idle milliseconds, the thread
+// sets P_IORING_SQ_NEED_WAKEUP in sq_flags and parks. The application must then
+// call ioring_enter with P_IORING_ENTER_SQ_WAKEUP to wake it up.
+#if !defined(HAS_LIBC)
+  #error SQ poll thread requires libc
+#endif
+
+#if defined(__linux__)
+  #include <sched.h> // cpu_set_t
+#endif
+
+// io_sq_thread_check validates SQPOLL parameters of p, called by ioring_create
+static err_t io_sq_thread_check(p_ioring_params_t* p) {
+  if (!(p->flags & P_IORING_SETUP_SQPOLL)) {
+    if (p->flags & P_IORING_SETUP_SQ_AFF)
+      return p_err_invalid;
+    return 0;
+  }
+  if (p->flags & P_IORING_SETUP_SQ_AFF) {
+    long ncpu = sysconf(_SC_NPROCESSORS_CONF);
+    if (ncpu > 0 && p->sq_thread_cpu >= (u32)ncpu)
+      return p_err_invalid;
+  }
+  return 0;
+}
+
+
+static void io_sq_thread_affinity(ioringctx_t* ctx) {
+  if (!(ctx->flags & P_IORING_SETUP_SQ_AFF))
+    return;
+  #if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(ctx->sq_thread_cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+      dlog("failed to pin SQ thread to cpu %u", ctx->sq_thread_cpu);
+  #else
+    // Darwin does not support pinning threads to CPUs
+  #endif
+}
+
+
+static bool io_sq_thread_should_park(ioringctx_t* ctx) {
+  return !ctx->sq_thread_wakeup && !ctx->sq_thread_stop && !io_sqring_entries(ctx);
+}
+
+
+static void* io_sq_thread(void* arg) {
+  ioringctx_t* ctx = arg;
+  iorings_t* rings = ctx->rings;
+  u64 idle = (u64)ctx->sq_thread_idle * 1000000ull; // ms -> ns
+  u64 timeout = io_nanotime() + idle;
+
+  io_sq_thread_affinity(ctx);
+
+  while (!READ_ONCE(ctx->sq_thread_stop)) {
+    if (io_sqring_entries(ctx)) {
+      io_submit_sqes(ctx, ctx->sq_entries);
+      timeout = io_nanotime() + idle;
+      continue;
+    }
+
+    if (io_nanotime() < timeout) {
+      sched_yield();
+      continue;
+    }
+
+    // park
+    pthread_mutex_lock(&ctx->sq_thread_lock);
+    __atomic_fetch_or(&rings->sq_flags, P_IORING_SQ_NEED_WAKEUP, __ATOMIC_RELAXED);
+    // Order the sq_flags store with the SQ tail load in io_sq_thread_should_park.
+    // Pairs with the mbarrier() the application uses between writing the SQ tail
+    // and checking sq_flags for P_IORING_SQ_NEED_WAKEUP.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    while (io_sq_thread_should_park(ctx))
+      pthread_cond_wait(&ctx->sq_thread_cond, &ctx->sq_thread_lock);
+    ctx->sq_thread_wakeup = false;
+    __atomic_fetch_and(&rings->sq_flags, ~P_IORING_SQ_NEED_WAKEUP, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&ctx->sq_thread_lock);
+    timeout = io_nanotime() + idle;
+  }
+
+  return NULL;
+}
+
+
+static err_t io_sq_thread_start(ioringctx_t* ctx) {
+  if (ctx->sq_thread_started)
+    return 0;
+  int e = pthread_create(&ctx->sq_thread, NULL, io_sq_thread, ctx);
+  if (e)
+    return p_err_nomem;
+  ctx->sq_thread_started = true;
+  return 0;
+}
+
+
+static void io_sq_thread_stop(ioringctx_t* ctx) {
+  if (!ctx->sq_thread_started)
+    return;
+  pthread_mutex_lock(&ctx->sq_thread_lock);
+  WRITE_ONCE(ctx->sq_thread_stop, true);
+  pthread_cond_signal(&ctx->sq_thread_cond);
+  pthread_mutex_unlock(&ctx->sq_thread_lock);
+  pthread_join(ctx->sq_thread, NULL);
+  ctx->sq_thread_started = false;
+}
+
+
+// io_sq_thread_wakeup is called for ioring_enter with P_IORING_ENTER_SQ_WAKEUP
+static void io_sq_thread_wakeup(ioringctx_t* ctx) {
+  pthread_mutex_lock(&ctx->sq_thread_lock);
+  ctx->sq_thread_wakeup = true;
+  pthread_cond_signal(&ctx->sq_thread_cond);
+  pthread_mutex_unlock(&ctx->sq_thread_lock);
+}
+
+
+// io_sqpoll_wait_sq waits until the SQ ring has room for at least one more entry
+// (P_IORING_ENTER_SQ_WAIT)
+static void io_sqpoll_wait_sq(ioringctx_t* ctx) {
+  iorings_t* rings = ctx->rings;
+  while (READ_ONCE(rings->sq.tail) - smp_load_acquire(&rings->sq.head) >= ctx->sq_entries &&
+         !READ_ONCE(ctx->closed))
+  {
+    if (READ_ONCE(rings->sq_flags) & P_IORING_SQ_NEED_WAKEUP)
+      io_sq_thread_wakeup(ctx);
+    sched_yield();
+  }
+}
@@ -0,0 +1,121 @@
+// SPDX-License-Identifier: Apache-2.0
+// This file is included by ioring_base.c
+
+// ring statistics: /sys/ioring/stats
+//
+// Every ring counts the SQEs it consumed, the requests it issued inline and handed to
+// io-wq workers, its completions and the completions held back while its CQ ring was
+// full. The time from submission to completion is recorded in a histogram per opcode,
+// in power-of-two buckets of microseconds: bucket 0 counts requests which completed
+// within 1us and bucket b those which took [2^(b-1), 2^b) us; the last bucket has no
+// upper bound. All requests of one ioring_enter call share the time of submission,
+// so that only completions read the clock.
+//
+// FSYNC requests are counted along with the host flushes they took, which shows how
+// well group commit coalesces them (ioring_fsync.c).
+//
+// The counters are updated under the locks which are held anyway at those points
+// (uring_lock, completion_lock and fsync_lock). ioring_stats_format reads them without
+// locking, so a snapshot of a busy ring may be slightly inconsistent. It holds a
+// reference to each ring it reads, which keeps the ring's memory mapped meanwhile.
+#if defined(HAS_LIBC)
+  #include <stdio.h> // snprintf
+#endif
+
+
+// io_stats_now returns the time used for latencies, or 0 if there is no clock
+static u64 io_stats_now() {
+  #if defined(HAS_LIBC)
+  return io_nanotime();
+  #else
+  return 0;
+  #endif
+}
+
+
+// io_stats_bucket returns the latency histogram bucket of a request which took ns
+static u32 io_stats_bucket(u64 ns) {
+  u64 us = ns / 1000;
+  if (us == 0)
+    return 0;
+  u32 b = 64 - (u32)__builtin_clzll(us);
+  return MIN(b, (u32)IO_STATS_BUCKETS - 1);
+}
+
+
+// io_stats_complete accounts for the completion of req.
+// Called with ctx->completion_lock held.
+static void io_stats_complete(ioringctx_t* ctx, const ioreq_t* req) {
+  ctx->stats.nr_completed++;
+  if (!req->submit_ns || req->sqe.opcode >= P_IORING_OP_LAST)
+    return;
+  u64 now = io_stats_now();
+  u64 ns = now > req->submit_ns ? now - req->submit_ns : 0;
+  ctx->stats.latency[req->sqe.opcode][io_stats_bucket(ns)]++;
+}
+
+
+#if defined(HAS_LIBC)
+
+// io_stats_format writes the statistics of ctx to buf as text (see ioring_stats_format)
+static usize io_stats_format(const ioringctx_t* ctx, char* buf, usize cap) {
+  const io_stats_t* st = &ctx->stats;
+  const iorings_t* rings = ctx->rings;
+  usize len = 0;
+  #define APPEND(fmt, ...) { \
+    int n__ = snprintf(buf + MIN(len, cap), cap - MIN(len, cap), fmt, ##__VA_ARGS__); \
+    if (n__ > 0) len += (usize)n__; \
+  }
+  APPEND("ring %d\n", (int)ctx->fd);
+  APPEND("  submitted %llu\n", (unsigned long long)READ_ONCE(st->nr_submitted));
+  APPEND("  completed %llu\n", (unsigned long long)READ_ONCE(st->nr_completed));
+  APPEND("  inline %llu\n", (unsigned long long)READ_ONCE(st->nr_inline));
+  APPEND("  async %llu\n", (unsigned long long)READ_ONCE(st->nr_async));
+  APPEND("  cq_overflowed %llu\n", (unsigned long long)READ_ONCE(st->nr_overflowed));
+  APPEND("  cq_dropped %u\n", READ_ONCE(rings->cq_overflow));
+  APPEND("  sq_dropped %u\n", READ_ONCE(rings->sq_dropped));
+  APPEND("  fsync %llu\n", (unsigned long long)READ_ONCE(st->nr_fsync));
+  APPEND("  fsync_flushes %llu\n", (unsigned long long)READ_ONCE(st->nr_fsync_flushes));
+  for (u32 op = 0; op < P_IORING_OP_LAST; op++) {
+    u32 last = IO_STATS_BUCKETS;
+    while (last > 0 && !READ_ONCE(st->latency[op][last - 1]))
+      last--;
+    if (last == 0)
+      continue;
+    APPEND("  latency %u", op);
+    for (u32 b = 0; b < last; b++)
+      APPEND(" %u", READ_ONCE(st->latency[op][b]));
+    APPEND("\n");
+  }
+  #undef APPEND
+  return len;
+}
+
+
+// ioring_stats_format writes the statistics of all open rings of the portable driver
+// to buf as text, up to cap bytes including a terminating NUL. Returns the length of
+// the complete text, like snprintf.
+usize ioring_stats_format(char* buf, usize cap) {
+  usize len = 0;
+  ioringctx_slot_t* slot = __atomic_load_n(&g_ioring_slots, __ATOMIC_ACQUIRE);
+  for (; slot; slot = slot->next) {
+    // rings being set up or torn down are skipped
+    if (!__atomic_load_n(&slot->inuse, __ATOMIC_ACQUIRE))
+      continue;
+    fd_t fd = READ_ONCE(slot->ctx.fd);
+    if (fd < 0)
+      continue;
+    ioringctx_t* ctx = ioringctx_lookup(fd);
+    if (!ctx)
+      continue;
+    // fd may have been closed and reused by another ring since we read it
+    if (ctx == &slot->ctx)
+      len += io_stats_format(ctx, buf + MIN(len, cap), cap - MIN(len, cap));
+    ioringctx_put(ctx);
+  }
+  if (len == 0 && cap > 0)
+    buf[0] = 0;
+  return len;
+}
+
+#endif // HAS_LIBC
@@ -0,0 +1,613 @@
+// SPDX-License-Identifier: Apache-2.0
+// This file is included by ioring_base.c
+
+// timeouts: P_IORING_OP_TIMEOUT, P_IORING_OP_TIMEOUT_REMOVE and P_IORING_OP_LINK_TIMEOUT
+//
+// Deadlines are kept in a hierarchical timer wheel, so that arming, removing and
+// expiring a timeout costs O(1) no matter how many are pending. The wheel has
+// IO_WHEEL_LEVELS levels of IO_WHEEL_SIZE slots; a slot of level 0 spans one tick
+// and a slot of level n spans IO_WHEEL_SIZE^n ticks. A timer is put into the lowest
+// level which can hold its deadline; timers of higher levels are moved down
+// ("cascaded") as the wheel turns and their slot comes up. Timers further out than
+// the wheel spans are put into the last slot and cascaded until they fit.
+//
+// Each ring has a timer thread, started with the first timeout, which sleeps until
+// the next slot with pending timers comes up and posts the completions of timeouts
+// which expired. Timeout state is guarded by ctx->completion_lock.
+#if !defined(HAS_LIBC)
+  #error timeouts require libc
+#endif
+
+#define IO_TIMER_TICK 1000000 // nanoseconds per wheel tick (wheel resolution)
+
+// io_timeout_t: state of a TIMEOUT or LINK_TIMEOUT request
+typedef struct io_timeout {
+  io_timer_t          timer;
+  ioreq_t*            req;
+  ioreq_t*            prev;    // LINK_TIMEOUT: the request it guards, while in flight
+  struct io_timeout*  next;    // ctx->timeout_list, ctx->timeout_seq_list or fired list
+  struct io_timeout** pprev;   // NULL when not on a list
+  u32                 target;  // counted TIMEOUT: number of completions to wait for
+  i32                 res;     // result, once fired
+} io_timeout_t;
+
+
+static u64 io_nanotime() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec*1000000000ull + (u64)ts.tv_nsec;
+}
+
+
+// ---------------------------------------------------------------------------------------
+// timer wheel
+
+
+// io_timer_next returns the next tick at which the wheel has work to do (a slot of
+// level 0 expiring, or a slot of a higher level being cascaded), or U64_MAX if empty
+static u64 io_timer_next(const io_timer_wheel_t* w) {
+  u64 next = U64_MAX;
+  for (u32 lvl = 0; lvl < IO_WHEEL_LEVELS; lvl++) {
+    u64 pending = w->pending[lvl];
+    if (!pending)
+      continue;
+    // pos is the first slot of this level to come up at or after w->clk
+    u32 shift = lvl * IO_WHEEL_BITS;
+    u64 pos = (w->clk + ((1ull << shift) - 1)) >> shift;
+    u32 rot = (u32)(pos & IO_WHEEL_MASK);
+    if (rot)
+      pending = (pending >> rot) | (pending << (IO_WHEEL_SIZE - rot));
+    u64 t = (pos + (u64)__builtin_ctzll(pending)) << shift;
+    next = MIN(next, t);
+  }
+  return next;
+}
+
+
+static void io_timer_add(io_timer_wheel_t* w, io_timer_t* t) {
+  u64 expires = MAX(t->expires, w->clk);
+  u64 delta = expires - w->clk;
+  u32 lvl = 0;
+  while (lvl < IO_WHEEL_LEVELS - 1 && delta >= (1ull << ((lvl + 1) * IO_WHEEL_BITS)))
+    lvl++;
+  if (delta >= (1ull << (IO_WHEEL_LEVELS * IO_WHEEL_BITS)))
+    expires = w->clk + (1ull << (IO_WHEEL_LEVELS * IO_WHEEL_BITS)) - 1;
+  u32 idx = (u32)((expires >> (lvl * IO_WHEEL_BITS)) & IO_WHEEL_MASK);
+
+  io_timer_t** head = &w->slots[lvl][idx];
+  if ((t->next = *head))
+    t->next->pprev = &t->next;
+  t->pprev = head;
+  *head = t;
+  t->slot = (u16)(lvl * IO_WHEEL_SIZE + idx);
+  w->pending[lvl] |= 1ull << idx;
+  w->nr_timers++;
+}
+
+
+static void io_timer_del(io_timer_wheel_t* w, io_timer_t* t) {
+  if (!t->pprev)
+    return;
+  if ((*t->pprev = t->next))
+    t->next->pprev = t->pprev;
+  u32 lvl = t->slot / IO_WHEEL_SIZE, idx = t->slot % IO_WHEEL_SIZE;
+  if (!w->slots[lvl][idx])
+    w->pending[lvl] &= ~(1ull << idx);
+  t->pprev = NULL;
+  w->nr_timers--;
+}
+
+
+// io_timer_take removes all timers of a slot, returning them as a list
+static io_timer_t* io_timer_take(io_timer_wheel_t* w, u32 lvl, u32 idx) {
+  io_timer_t* list = w->slots[lvl][idx];
+  w->slots[lvl][idx] = NULL;
+  w->pending[lvl] &= ~(1ull << idx);
+  for (io_timer_t* t = list; t; t = t->next) {
+    t->pprev = NULL;
+    w->nr_timers--;
+  }
+  return list;
+}
+
+
+// io_timer_advance turns the wheel up to tick now.
+// Expired timers are removed from the wheel and returned as a list.
+static io_timer_t* io_timer_advance(io_timer_wheel_t* w, u64 now) {
+  io_timer_t* expired = NULL;
+  while (w->nr_timers) {
+    // skip ahead to the next tick with work; no cascade or expiry is missed
+    u64 tick = io_timer_next(w);
+    if (tick > now)
+      break;
+    w->clk = tick;
+    for (u32 lvl = 1; lvl < IO_WHEEL_LEVELS; lvl++) {
+      u32 shift = lvl * IO_WHEEL_BITS;
+      if (tick & ((1ull << shift) - 1))
+        break;
+      io_timer_t* t = io_timer_take(w, lvl, (u32)((tick >> shift) & IO_WHEEL_MASK));
+      while (t) {
+        io_timer_t* next = t->next;
+        io_timer_add(w, t);
+        t = next;
+      }
+    }
+    io_timer_t* t = io_timer_take(w, 0, (u32)(tick & IO_WHEEL_MASK));
+    while (t) {
+      io_timer_t* next = t->next;
+      t->next = expired;
+      expired = t;
+      t = next;
+    }
+    w->clk = tick + 1;
+  }
+  if (w->clk <= now)
+    w->clk = now + 1;
+  return expired;
+}
+
+
+// ---------------------------------------------------------------------------------------
+// timer thread
+
+
+static void io_timeout_list_add(io_timeout_t** head, io_timeout_t* t) {
+  if ((t->next = *head))
+    t->next->pprev = &t->next;
+  t->pprev = head;
+  *head = t;
+}
+
+
+static void io_timeout_list_del(io_timeout_t* t) {
+  if (!t->pprev)
+    return;
+  if ((*t->pprev = t->next))
+    t->next->pprev = t->pprev;
+  t->pprev = NULL;
+}
+
+
+static void io_timeout_free(io_timeout_t* t) {
+  if (!t)
+    return;
+  if (t->req)
+    io_req_free(t->req);
+  free(t);
+}
+
+
+// io_timeout_fire takes a timeout out of the wheel and its list, to be completed with
+// res by whoever called this. Called with ctx->completion_lock held.
+static void io_timeout_fire(ioringctx_t* ctx, io_timeout_t* t, i32 res) {
+  io_timer_del(&ctx->timer_wheel, &t->timer);
+  io_timeout_list_del(t);
+  t->res = res;
+  if (t->req->sqe.opcode == P_IORING_OP_TIMEOUT) {
+    // completions of TIMEOUT operations don't count towards other TIMEOUTs
+    ctx->cq_timeouts++;
+  } else if (t->prev) {
+    t->prev->link_timeout = NULL;
+  }
+}
+
+
+// io_cond_wait waits on cond, initialized with io_cond_init, until the monotonic time
+// deadline (in ns; U64_MAX to wait without a deadline.) Called with mu held.
+static void io_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mu, u64 deadline) {
+  if (deadline == U64_MAX) {
+    pthread_cond_wait(cond, mu);
+    return;
+  }
+  #if defined(__APPLE__)
+    // Darwin does not support pthread_condattr_setclock
+    u64 now = io_nanotime();
+    if (deadline <= now)
+      return;
+    u64 d = deadline - now;
+    struct timespec ts = { .tv_sec = d / 1000000000ull, .tv_nsec = d % 1000000000ull };
+    pthread_cond_timedwait_relative_np(cond, mu, &ts);
+  #else
+    struct timespec ts = { .tv_sec = deadline / 1000000000ull,
+                           .tv_nsec = deadline % 1000000000ull };
+    pthread_cond_timedwait(cond, mu, &ts);
+  #endif
+}
+
+
+// io_cond_init initializes a condition variable for io_cond_wait
+static void io_cond_init(pthread_cond_t* cond) {
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  #if !defined(__APPLE__)
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  #endif
+  pthread_cond_init(cond, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+
+// io_timeouts_complete posts the completions of fired timeouts, and those of requests
+// guarding LINK_TIMEOUTs taken back from io-wq (io_link_timeout_cancel.)
+static void io_timeouts_complete(ioringctx_t* ctx, io_timeout_t* t) {
+  while (t) {
+    io_timeout_t* next = t->next;
+    if (t->prev) // dequeued from io-wq by io_timeouts_expire
+      io_req_complete_async(ctx, t->prev, p_err_canceled);
+    ioreq_t* req = t->req;
+    t->req = NULL;
+    io_req_complete_async(ctx, req, t->res);
+    io_timeout_free(t);
+    t = next;
+  }
+}
+
+
+// io_link_timeout_cancel cancels req, guarded by a LINK_TIMEOUT which fired, like
+// ASYNC_CANCEL does. Returns req if it was still queued for an io-wq worker, to be
+// completed by the caller. A worker executing req is interrupted and an armed poll
+// is disarmed; those complete with p_err_canceled on their own threads. Called with
+// ctx->completion_lock held.
+static ioreq_t* io_link_timeout_cancel(ioringctx_t* ctx, ioreq_t* req) {
+  io_cancel_data_t cd = { .fd = -1, .req = req };
+  u32 nr_running;
+  ioreq_t* queued = io_wq_cancel(&ctx->wq, &cd, &nr_running);
+  if (!queued && !nr_running)
+    __io_poll_cancel(ctx, &cd);
+  return queued;
+}
+
+
+// io_timeouts_expire turns the wheel and returns timeouts which fired, including
+// counted timeouts which reached their count. Called with ctx->completion_lock held.
+static io_timeout_t* io_timeouts_expire(ioringctx_t* ctx) {
+  io_timeout_t* fired = ctx->timeout_fired;
+  ctx->timeout_fired = NULL;
+  io_timer_t* timer = io_timer_advance(&ctx->timer_wheel, io_nanotime() / IO_TIMER_TICK);
+  while (timer) {
+    io_timer_t* next = timer->next;
+    io_timeout_t* t = (io_timeout_t*)timer; // timer is the first member
+    ioreq_t* prev = t->prev;
+    io_timeout_fire(ctx, t, p_err_timedout);
+    t->prev = prev ? io_link_timeout_cancel(ctx, prev) : NULL;
+    t->next = fired;
+    fired = t;
+    timer = next;
+  }
+  return fired;
+}
+
+
+static void* io_timer_thread(void* arg) {
+  ioringctx_t* ctx = arg;
+  io_current_is_worker = true;
+  io_cq_lock(ctx);
+  while (!ctx->timer_stop) {
+    io_timeout_t* fired = io_timeouts_expire(ctx);
+    if (fired) {
+      io_cq_unlock(ctx);
+      io_timeouts_complete(ctx, fired);
+      io_cq_lock(ctx);
+      continue;
+    }
+    u64 next = io_timer_next(&ctx->timer_wheel);
+    ctx->timer_deadline = next == U64_MAX ? U64_MAX : next * IO_TIMER_TICK;
+    io_cond_wait(&ctx->timer_cond, &ctx->completion_lock, ctx->timer_deadline);
+    ctx->timer_deadline = 0;
+  }
+  io_cq_unlock(ctx);
+  return NULL;
+}
+
+
+// io_timer_arm adds timer to the wheel with a deadline in monotonic nanoseconds,
+// starting the timer thread if needed. Called with ctx->completion_lock held.
+static err_t io_timer_arm(ioringctx_t* ctx, io_timer_t* timer, u64 deadline) {
+  io_timer_wheel_t* w = &ctx->timer_wheel;
+  if (!ctx->timer_started) {
+    if (pthread_create(&ctx->timer_thread, NULL, io_timer_thread, ctx))
+      return p_err_nomem;
+    ctx->timer_started = true;
+  }
+  if (w->nr_timers == 0)
+    w->clk = io_nanotime() / IO_TIMER_TICK; // nothing pending; catch up
+  // round up so that a timeout never fires early
+  timer->expires = deadline / IO_TIMER_TICK + (deadline % IO_TIMER_TICK != 0);
+  io_timer_add(w, timer);
+  // wake the timer thread if it's sleeping past the new deadline
+  if (timer->expires * IO_TIMER_TICK < ctx->timer_deadline)
+    pthread_cond_signal(&ctx->timer_cond);
+  return 0;
+}
+
+
+static void io_timer_init(ioringctx_t* ctx) {
+  io_cond_init(&ctx->timer_cond);
+}
+
+
+// io_timer_exit stops the timer thread and frees pending timeouts without completing
+// them. Called without ctx->completion_lock held.
+static void io_timer_exit(ioringctx_t* ctx) {
+  io_cq_lock(ctx);
+  bool started = ctx->timer_started;
+  ctx->timer_stop = true;
+  pthread_cond_signal(&ctx->timer_cond);
+  io_cq_unlock(ctx);
+  if (started)
+    pthread_join(ctx->timer_thread, NULL);
+
+  // LINK_TIMEOUTs are disarmed by the completion of the request they guard; run
+  // after io_wq_exit so that no request completes while the wheel is torn down.
+  io_timer_wheel_t* w = &ctx->timer_wheel;
+  for (u32 lvl = 0; lvl < IO_WHEEL_LEVELS; lvl++) {
+    for (u32 idx = 0; idx < IO_WHEEL_SIZE; idx++) {
+      io_timer_t* timer = io_timer_take(w, lvl, idx);
+      while (timer) {
+        io_timer_t* next = timer->next;
+        io_timeout_t* t = (io_timeout_t*)timer;
+        io_req_free_chain(t->req->link);
+        io_timeout_free(t);
+        timer = next;
+      }
+    }
+  }
+  while (ctx->timeout_fired) {
+    io_timeout_t* t = ctx->timeout_fired;
+    ctx->timeout_fired = t->next;
+    io_req_free_chain(t->req->link);
+    io_timeout_free(t);
+  }
+  pthread_cond_destroy(&ctx->timer_cond);
+}
+
+
+// ---------------------------------------------------------------------------------------
+// operations
+
+
+// io_timeout_parse reads the timespec at addr and returns its deadline in monotonic
+// nanoseconds. With P_IORING_TIMEOUT_ABS the timespec is a CLOCK_MONOTONIC time,
+// otherwise it's relative to now.
+static err_t io_timeout_parse(u64 addr, u32 flags, u64* deadline) {
+  p_timespec_t ts;
+  if (!copy_from_user(&ts, (const void*)(usize)addr, sizeof(ts)))
+    return p_err_mfault;
+  if (ts.tv_sec < 0 || ts.tv_nsec < 0 || ts.tv_nsec >= 1000000000)
+    return p_err_invalid;
+  u64 ns;
+  if (check_mul_overflow((u64)ts.tv_sec, 1000000000ull, &ns) ||
+      check_add_overflow(ns, (u64)ts.tv_nsec, &ns))
+  {
+    ns = U64_MAX / 2; // practically never
+  }
+  if (!(flags & P_IORING_TIMEOUT_ABS)) {
+    u64 now = io_nanotime();
+    ns = MIN(ns, U64_MAX / 2) + now;
+  }
+  *deadline = ns;
+  return 0;
+}
+
+
+// io_timeout_check validates a TIMEOUT or LINK_TIMEOUT SQE
+static err_t io_timeout_check(const p_ioring_sqe_t* sqe, bool is_link) {
+  if (sqe->ioprio || sqe->buf_index || sqe->len != 1 || sqe->file_index)
+    return p_err_invalid;
+  if (is_link && sqe->off)
+    return p_err_invalid;
+  if (sqe->timeout_flags & ~P_IORING_TIMEOUT_ABS)
+    return p_err_invalid;
+  return 0;
+}
+
+
+// P_IORING_OP_TIMEOUT
+//   addr          pointer to p_timespec_t
+//   len           1
+//   off           number of completions to wait for (0 = only wait for the deadline)
+//   timeout_flags P_IORING_TIMEOUT_ABS
+// Completes with p_err_timedout when the deadline passes, or with 0 once off other
+// operations have completed since it was submitted.
+static isize io_timeout(ioringctx_t* ctx, ioreq_t* req) {
+  const p_ioring_sqe_t* sqe = &req->sqe;
+  if (!ctx) // the native driver passes timeouts to Linux
+    return p_err_not_supported;
+  err_t err = io_timeout_check(sqe, false);
+  if (err)
+    return err;
+  u64 deadline;
+  if ((err = io_timeout_parse(sqe->addr, sqe->timeout_flags, &deadline)))
+    return err;
+
+  io_timeout_t* t = calloc(1, sizeof(io_timeout_t));
+  if (!t)
+    return p_err_nomem;
+  io_cq_lock(ctx);
+  ioreq_t* r = io_req_persist(req);
+  if (!r || (err = io_timer_arm(ctx, &t->timer, deadline))) {
+    io_cq_unlock(ctx);
+    if (r && r != req)
+      io_req_free(r);
+    free(t);
+    return r ? err : p_err_nomem;
+  }
+  t->req = r;
+  r->timeout = t;
+  if (sqe->off == 0) {
+    io_timeout_list_add(&ctx->timeout_list, t);
+  } else {
+    // keep counted timeouts sorted by target so that only the head needs checking
+    t->target = ctx->nr_completed - ctx->cq_timeouts + (u32)sqe->off;
+    io_timeout_t** pp = &ctx->timeout_seq_list;
+    while (*pp && (i32)((*pp)->target - t->target) <= 0)
+      pp = &(*pp)->next;
+    io_timeout_list_add(pp, t);
+  }
+  io_cq_unlock(ctx);
+  return IO_ISSUE_QUEUED;
+}
+
+
+// io_flush_timeouts fires counted timeouts which have reached their count.
+// They are completed by the timer thread since the caller holds
+// ctx->completion_lock. Called after a completion, with ctx->completion_lock held.
+static void io_flush_timeouts(ioringctx_t* ctx) {
+  io_timeout_t* t = ctx->timeout_seq_list;
+  if (LIKELY(!t))
+    return;
+  u32 events = ctx->nr_completed - ctx->cq_timeouts;
+  bool fired = false;
+  while (t && (i32)(events - t->target) >= 0) {
+    io_timeout_fire(ctx, t, 0);
+    io_timeout_list_add(&ctx->timeout_fired, t);
+    fired = true;
+    t = ctx->timeout_seq_list;
+  }
+  if (fired)
+    pthread_cond_signal(&ctx->timer_cond);
+}
+
+
+// io_timeout_find returns the pending TIMEOUT with user_data.
+// Called with ctx->completion_lock held.
+static io_timeout_t* io_timeout_find(ioringctx_t* ctx, u64 user_data) {
+  io_timeout_t* lists[] = { ctx->timeout_list, ctx->timeout_seq_list };
+  for (u32 i = 0; i < ARRAY_LEN(lists); i++) {
+    for (io_timeout_t* t = lists[i]; t; t = t->next) {
+      if (t->req->sqe.user_data == user_data)
+        return t;
+    }
+  }
+  return NULL;
+}
+
+
+// io_timeout_cancel takes TIMEOUTs matching cd out of the wheel and returns them
+// (linked by next), to be completed by the caller with p_err_canceled.
+// Only the first match unless io_cancel_all(cd).
+static io_timeout_t* io_timeout_cancel(ioringctx_t* ctx, const io_cancel_data_t* cd) {
+  bool all = io_cancel_all(cd);
+  io_timeout_t* canceled = NULL;
+  io_cq_lock(ctx);
+  io_timeout_t** lists[] = { &ctx->timeout_list, &ctx->timeout_seq_list };
+  for (u32 i = 0; i < ARRAY_LEN(lists) && (all || !canceled); i++) {
+    io_timeout_t* t = *lists[i];
+    while (t && (all || !canceled)) {
+      io_timeout_t* next = t->next;
+      if (io_cancel_match(t->req, cd)) {
+        io_timeout_fire(ctx, t, p_err_canceled);
+        t->next = canceled;
+        canceled = t;
+      }
+      t = next;
+    }
+  }
+  io_cq_unlock(ctx);
+  return canceled;
+}
+
+
+// P_IORING_OP_TIMEOUT_REMOVE
+//   addr          user_data of the TIMEOUT to remove
+//   timeout_flags P_IORING_TIMEOUT_UPDATE to change its deadline instead, to the
+//                 p_timespec_t at addr2 (with P_IORING_TIMEOUT_ABS if absolute)
+// A removed timeout completes with p_err_canceled.
+// Returns p_err_not_found if there is no such timeout (e.g. it already fired.)
+static isize io_timeout_remove(ioringctx_t* ctx, ioreq_t* req) {
+  const p_ioring_sqe_t* sqe = &req->sqe;
+  if (!ctx)
+    return p_err_not_supported;
+  if (sqe->ioprio || sqe->buf_index || sqe->len || sqe->file_index)
+    return p_err_invalid;
+  u32 flags = sqe->timeout_flags;
+  if (flags & ~(P_IORING_TIMEOUT_UPDATE | P_IORING_TIMEOUT_ABS))
+    return p_err_invalid;
+  u64 deadline = 0;
+  if (flags & P_IORING_TIMEOUT_UPDATE) {
+    err_t err = io_timeout_parse(sqe->addr2, flags, &deadline);
+    if (err)
+      return err;
+  } else if (flags || sqe->addr2) {
+    return p_err_invalid;
+  }
+
+  io_cq_lock(ctx);
+  io_timeout_t* t = io_timeout_find(ctx, sqe->addr);
+  if (!t) {
+    io_cq_unlock(ctx);
+    return p_err_not_found;
+  }
+  if (flags & P_IORING_TIMEOUT_UPDATE) {
+    io_timer_del(&ctx->timer_wheel, &t->timer);
+    io_timer_arm(ctx, &t->timer, deadline); // can't fail; the timer thread is running
+    io_cq_unlock(ctx);
+    return 0;
+  }
+  io_timeout_fire(ctx, t, p_err_canceled);
+  io_cq_unlock(ctx);
+
+  ioreq_t* link = io_req_complete(ctx, t->req, p_err_canceled);
+  t->req = NULL;
+  io_timeout_free(t);
+  if (link) { // P_IORING_SQE_IO_HARDLINK
+    io_ring_submit_lock(ctx, req);
+    io_queue_sqe(ctx, link);
+    io_ring_submit_unlock(ctx, req);
+  }
+  return 0;
+}
+
+
+// P_IORING_OP_LINK_TIMEOUT is armed by the request it is linked to (see
+// io_arm_link_timeout) and never issued on its own. One that is reached anyway is not
+// linked to a request, or has an invalid SQE.
+static isize io_link_timeout(ioringctx_t* ctx, ioreq_t* req) {
+  return p_err_invalid;
+}
+
+
+// io_arm_link_timeout starts the LINK_TIMEOUT which follows req in its link chain,
+// as req is about to be issued. The LINK_TIMEOUT is taken out of the chain; req's
+// link is now the request after it. Called with ctx->uring_lock held.
+static void io_arm_link_timeout(ioringctx_t* ctx, ioreq_t* req) {
+  ioreq_t* lt = req->link;
+  u64 deadline;
+  if (io_timeout_check(&lt->sqe, true) ||
+      io_timeout_parse(lt->sqe.addr, lt->sqe.timeout_flags, &deadline))
+  {
+    return;
+  }
+  io_timeout_t* t = calloc(1, sizeof(io_timeout_t));
+  if (!t)
+    return;
+  t->req = lt;
+  t->prev = req;
+  lt->timeout = t;
+  io_cq_lock(ctx);
+  if (io_timer_arm(ctx, &t->timer, deadline)) {
+    io_cq_unlock(ctx);
+    lt->timeout = NULL;
+    free(t);
+    return;
+  }
+  req->link = lt->link;
+  req->link_timeout = t;
+  lt->link = NULL;
+  io_cq_unlock(ctx);
+}
+
+
+// io_disarm_link_timeout stops the LINK_TIMEOUT of req, which completed first, and
+// posts its completion with p_err_canceled. Returns the timeout, to be freed by the
+// caller after releasing ctx->completion_lock.
+// Called with ctx->completion_lock held.
+static io_timeout_t* io_disarm_link_timeout(ioringctx_t* ctx, ioreq_t* req) {
+  io_timeout_t* t = req->link_timeout;
+  if (LIKELY(!t))
+    return NULL;
+  io_timeout_fire(ctx, t, p_err_canceled);
+  io_cqring_fill(ctx, t->req->sqe.user_data, p_err_canceled, 0);
+  ctx->nr_completed++;
+  return t;
+}
@@ -0,0 +1,183 @@
+// SPDX-License-Identifier: Apache-2.0
+// This file is included by ioring_base.c
+
+// completion waits: ioring_enter with P_IORING_ENTER_GETEVENTS
+//
+// A thread waiting for completions first spins for a little while, since CQEs of
+// operations executed by io-wq workers often arrive within microseconds, and then
+// parks until CQEs are published or its deadline (P_IORING_ENTER_EXT_ARG) passes.
+// How long to spin adapts to the ring: the budget (ctx->cq_spin_ns) is doubled when
+// spinning saw the completions arrive and halved when the thread had to park anyway,
+// within [IO_CQ_SPIN_MIN, IO_CQ_SPIN_MAX]. On a single CPU spinning only delays the
+// thread which would post the completions, so waiters park right away.
+//
+// On Linux, waiters park on a futex on the CQ tail. Elsewhere they wait on a
+// condition variable. Either way io_commit_cqring only enters the host to wake them
+// up when ctx->cq_waiters says that someone is parked.
+#if !defined(HAS_LIBC)
+  #error completion waits require libc
+#endif
+
+#if defined(__linux__)
+  #include <linux/futex.h>
+  #include <sys/syscall.h>
+#endif
+
+#define IO_CQ_SPIN_MIN   1000u  // nanoseconds
+#define IO_CQ_SPIN_MAX   64000u // nanoseconds
+#define IO_CQ_SPIN_INIT  8000u  // nanoseconds; budget of a new ring
+#define IO_CQ_SPIN_CHECK 32     // CQ tail checks between clock reads
+
+#if defined(__x86_64__) || defined(__i386__)
+  #define io_cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+  #define io_cpu_relax() __asm__ __volatile__("yield" ::: "memory")
+#else
+  #define io_cpu_relax() ((void)0)
+#endif
+
+
+static u32 g_io_ncpu; // number of online CPUs; 0 until known
+
+
+static bool io_cqring_can_spin() {
+  u32 ncpu = READ_ONCE(g_io_ncpu);
+  if (!ncpu) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    ncpu = n < 1 ? 1 : (u32)n;
+    WRITE_ONCE(g_io_ncpu, ncpu);
+  }
+  return ncpu > 1;
+}
+
+
+// io_cqring_spin busy-waits for min_complete completion events for up to
+// ctx->cq_spin_ns nanoseconds, or until deadline, and adapts ctx->cq_spin_ns.
+// Returns true if the events are available.
+static bool io_cqring_spin(ioringctx_t* ctx, u32 min_complete, u64 deadline) {
+  u32 budget = READ_ONCE(ctx->cq_spin_ns);
+  if (!budget)
+    budget = IO_CQ_SPIN_INIT;
+  u64 now = io_nanotime();
+  u64 end = MIN(now + budget, deadline);
+  do {
+    for (u32 i = 0; i < IO_CQ_SPIN_CHECK; i++) {
+      if (io_cqring_events(ctx) >= min_complete) {
+        WRITE_ONCE(ctx->cq_spin_ns, MIN(budget * 2, IO_CQ_SPIN_MAX));
+        return true;
+      }
+      io_cpu_relax();
+    }
+    now = io_nanotime();
+  } while (now < end);
+  if (now < deadline) // not a timeout; the thread is going to park
+    WRITE_ONCE(ctx->cq_spin_ns, MAX(budget / 2, IO_CQ_SPIN_MIN));
+  return false;
+}
+
+
+#if defined(__linux__)
+
+// io_cqring_park blocks until the CQ tail is no longer tail, io_cqring_wake is called
+// or the monotonic clock passes deadline
+static void io_cqring_park(ioringctx_t* ctx, u32 tail, u64 deadline) {
+  struct timespec ts;
+  struct timespec* tsp = NULL;
+  if (deadline != U64_MAX) {
+    ts.tv_sec = (time_t)(deadline / 1000000000ull);
+    ts.tv_nsec = (long)(deadline % 1000000000ull);
+    tsp = &ts;
+  }
+  // FUTEX_WAIT_BITSET takes an absolute CLOCK_MONOTONIC time.
+  // Returns right away (EAGAIN) if the tail has changed since it was loaded.
+  syscall(SYS_futex, &ctx->rings->cq.tail, FUTEX_WAIT_BITSET | FUTEX_PRIVATE_FLAG,
+          tail, tsp, NULL, FUTEX_BITSET_MATCH_ANY);
+}
+
+
+static void io_cqring_wake(ioringctx_t* ctx) {
+  syscall(SYS_futex, &ctx->rings->cq.tail, FUTEX_WAKE | FUTEX_PRIVATE_FLAG,
+          I32_MAX, NULL, NULL, 0);
+}
+
+#else
+
+static void io_cqring_park(ioringctx_t* ctx, u32 tail, u64 deadline) {
+  pthread_mutex_lock(&ctx->cq_wait_lock);
+  if (READ_ONCE(ctx->rings->cq.tail) != tail) {
+    // published before we took the lock; io_cqring_wake may have missed us
+  } else if (deadline == U64_MAX) {
+    pthread_cond_wait(&ctx->cq_wait_cond, &ctx->cq_wait_lock);
+  } else {
+    // pthread_cond_timedwait takes a CLOCK_REALTIME time
+    u64 now = io_nanotime();
+    u64 timeout = deadline > now ? deadline - now : 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    u64 t = (u64)ts.tv_sec*1000000000ull + (u64)ts.tv_nsec + timeout;
+    ts.tv_sec = (time_t)(t / 1000000000ull);
+    ts.tv_nsec = (long)(t % 1000000000ull);
+    pthread_cond_timedwait(&ctx->cq_wait_cond, &ctx->cq_wait_lock, &ts);
+  }
+  pthread_mutex_unlock(&ctx->cq_wait_lock);
+}
+
+
+static void io_cqring_wake(ioringctx_t* ctx) {
+  pthread_mutex_lock(&ctx->cq_wait_lock);
+  pthread_cond_broadcast(&ctx->cq_wait_cond);
+  pthread_mutex_unlock(&ctx->cq_wait_lock);
+}
+
+#endif // __linux__
+
+
+// io_cqring_wait waits until at least min_complete completion events are available,
+// or until the monotonic clock passes deadline (U64_MAX to wait without a deadline.)
+// Completions are posted asynchronously by io-wq workers and the SQ poll thread.
+// Returns p_err_timedout if the deadline passed first.
+static err_t io_cqring_wait(ioringctx_t* ctx, u32 min_complete, u64 deadline) {
+  iorings_t* rings = ctx->rings;
+  min_complete = MIN(min_complete, ctx->cq_entries);
+  io_cqring_overflow_flush(ctx);
+  if (io_cqring_events(ctx) >= min_complete)
+    return 0;
+  if (io_cqring_can_spin() && io_cqring_spin(ctx, min_complete, deadline))
+    return 0;
+
+  err_t err = 0;
+  __atomic_fetch_add(&ctx->cq_waiters, 1, __ATOMIC_RELAXED);
+  // order the cq_waiters store with the tail load; pairs with io_commit_cqring
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  for (;;) {
+    u32 tail = smp_load_acquire(&rings->cq.tail);
+    if (tail - READ_ONCE(rings->cq.head) >= min_complete)
+      break;
+    if (READ_ONCE(ctx->closed)) { // by another thread; see _ioring_release
+      err = p_err_badfd;
+      break;
+    }
+    u64 now = io_nanotime();
+    if (now >= deadline) {
+      err = p_err_timedout;
+      break;
+    }
+    io_cqring_park(ctx, tail, deadline);
+  }
+  __atomic_fetch_sub(&ctx->cq_waiters, 1, __ATOMIC_RELAXED);
+  return err;
+}
+
+
+// io_get_ext_arg reads the p_ioring_getevents_arg_t of ioring_enter with
+// P_IORING_ENTER_EXT_ARG and sets deadline to the end of its timeout, if it has one
+static err_t io_get_ext_arg(const void* arg, u64* deadline) {
+  p_ioring_getevents_arg_t a;
+  if (!arg || !copy_from_user(&a, arg, sizeof(a)))
+    return p_err_mfault;
+  if (a.sigmask || a.sigmask_sz || a.pad) // signal masks are not supported
+    return p_err_invalid;
+  if (a.ts)
+    return io_timeout_parse(a.ts, 0, deadline);
+  return 0;
+}
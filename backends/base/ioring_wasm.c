@@ -1,2 +1,7 @@
 // SPDX-License-Identifier: Apache-2.0
 // This file is conditionally included by ioring.c and has ioring_base.c included before it
+
+// Programs compiled to WASM don't run this driver: the JS host implements the
+// ioring syscalls itself (IoRing in backends/js/playsys.ts), working on the rings in
+// wasm memory. When the base backend itself is compiled to WASM, the portable driver
+// of ioring_base.c is used.
@@ -1,8 +1,6 @@
 // SPDX-License-Identifier: Apache-2.0
 #include "base.h"
 
-#define SPECIAL_FS_PREFIX "/sys"
-
 
 // implementations
 #if defined(__linux__)
@@ -118,15 +116,18 @@ isize p_syscall(
     case p_sysop_sleep:  FORWARD(_psys_sleep);
     case p_sysop_mmap:   FORWARD(_psys_mmap);
     case p_sysop_pipe:   FORWARD(_psys_pipe);
+    case p_sysop_splice: FORWARD(_psys_splice);
+    case p_sysop_tee:    FORWARD(_psys_tee);
+
+    case p_sysop_statat:   FORWARD(_psys_statat);
+    case p_sysop_removeat: FORWARD(_psys_removeat);
+    case p_sysop_renameat: FORWARD(_psys_renameat);
 
     case p_sysop_ioring_setup:    FORWARD(_psys_ioring_setup);
     case p_sysop_ioring_enter:    FORWARD(_psys_ioring_enter);
     case p_sysop_ioring_register: FORWARD(_psys_ioring_register);
 
     case p_sysop_seek:     FORWARD(_psys_NOT_IMPLEMENTED);
-    case p_sysop_statat:   FORWARD(_psys_NOT_IMPLEMENTED);
-    case p_sysop_removeat: FORWARD(_psys_NOT_IMPLEMENTED);
-    case p_sysop_renameat: FORWARD(_psys_NOT_IMPLEMENTED);
 
     case p_sysop_gpudev:     FORWARD(_psys_gpudev);
     case p_sysop_gui_mksurf: FORWARD(_psys_gui_mksurf);
@@ -0,0 +1,6 @@
+// SPDX-License-Identifier: Apache-2.0
+// This file is conditionally included by syscall.c
+
+// Linux backend; the POSIX backend using host-platform libc
+#define UNAME_OS "linux"
+#include "syscall_posix.c"
@@ -4,11 +4,16 @@
 // POSIX backend using host-platform libc
 
 #include <fcntl.h>  // open
-#include <unistd.h> // close, read, write
+#include <unistd.h> // close, read, write, pread, pwrite
+#include <stdio.h>  // snprintf
 #include <stdlib.h> // exit
 #include <string.h> // memcmp
 #include <time.h>   // nanosleep
 #include <sys/mman.h> // mmap
+#include <sys/stat.h> // fstat, fstatat, statx
+#if defined(__linux__)
+  #include <sys/sysmacros.h> // major, minor
+#endif
 #include <sys/errno.h>
 #include <sys/socket.h> // socketpair
 #include <assert.h>
@@ -16,10 +21,26 @@
 
 extern int errno;
 
-
-static err_t err_from_errno(int e) {
-  // TODO
-  return p_err_invalid;
+#if !defined(EBADFD)
+  #define EBADFD (-1) // Linux only; no host errno has this value
+#endif
+
+#if defined(__linux__)
+  #define X(name, linux_errno, err) static_assert(name == linux_errno, #name);
+  P_ERRNO_ERRS(X)
+  #undef X
+#endif
+
+
+// err_from_errno uses the same table as clients of rings with P_IORING_FEAT_HOST_ERRNO
+// (P_ERRNO_ERRS), so both kinds of ring report the same error for a host errno
+err_t err_from_errno(int e) {
+  switch (e) {
+    #define X(name, linux_errno, err) case name: return err;
+    P_ERRNO_ERRS(X)
+    #undef X
+    default: return p_err_invalid;
+  }
 }
 
 
@@ -67,16 +88,19 @@ static isize _psys_exit(psysop_t op, isize status) {
 
 
 static isize open_special_uname(const char* path, usize flags, isize mode) {
+  #if !defined(UNAME_OS)
+    #define UNAME_OS "macos"
+  #endif
   #if defined(__i386) || defined(__i386__) || defined(_M_IX86)
-    #define UNAME_STR "macos-x86"
+    #define UNAME_STR UNAME_OS "-x86"
   #elif defined(__x86_64__) || defined(__x86_64) || defined(_M_X64) || defined(_M_AMD64)
-    #define UNAME_STR "macos-x64"
+    #define UNAME_STR UNAME_OS "-x64"
   #elif defined(__arm64__) || defined(__aarch64__)
-    #define UNAME_STR "macos-arm64"
+    #define UNAME_STR UNAME_OS "-arm64"
   #elif defined(__arm__) || defined(__arm) || defined(__ARM__) || defined(__ARM)
-    #define UNAME_STR "macos-arm32"
+    #define UNAME_STR UNAME_OS "-arm32"
   #elif defined(__ppc__) || defined(__ppc) || defined(__PPC__)
-    #define UNAME_STR "macos-ppc"
+    #define UNAME_STR UNAME_OS "-ppc"
   #else
     #error
   #endif
@@ -94,6 +118,109 @@ static isize open_special_uname(const char* path, usize flags, isize mode) {
 }
 
 
+// /sys/ioring/max_entries reads as the max number of entries of a ring in decimal.
+// Writing a number to it changes the limit for rings created afterwards.
+static isize special_ioring_max_entries_read(vfile_t* f, char* buf, usize len) {
+  if (f->data) // already read
+    return 0;
+  char tmp[16];
+  int n = snprintf(tmp, sizeof(tmp), "%u\n", ioring_max_entries());
+  if ((usize)n > len)
+    return p_err_overflow;
+  memcpy(buf, tmp, (usize)n);
+  f->data = (void*)1;
+  return (isize)n;
+}
+
+
+static isize special_ioring_max_entries_write(vfile_t* f, const char* buf, usize len) {
+  u64 n = 0;
+  usize i = 0;
+  for (; i < len && buf[i] >= '0' && buf[i] <= '9'; i++) {
+    n = n*10 + (u64)(buf[i] - '0');
+    if (n > U32_MAX)
+      return p_err_invalid;
+  }
+  if (i == 0 || (i < len && !(buf[i] == '\n' && i + 1 == len)))
+    return p_err_invalid;
+  err_t e = ioring_set_max_entries((u32)n);
+  if (e)
+    return e;
+  return (isize)len;
+}
+
+
+static err_t special_release(vfile_t* f) {
+  return 0;
+}
+
+
+static isize open_special_ioring_max_entries(const char* path, usize flags, isize mode) {
+  static const vfile_ops_t fops = {
+    .release = special_release,
+    .read = special_ioring_max_entries_read,
+    .write = special_ioring_max_entries_write,
+  };
+  vfile_t* f;
+  return vfile_open(&f, "[ioring/max_entries]", &fops, 0);
+}
+
+
+// /sys/ioring/stats reads as the statistics of the open rings (ioring_stats_format),
+// as of when it was opened
+typedef struct special_text {
+  usize len;
+  usize offs; // read position
+  char  data[];
+} special_text_t;
+
+
+static isize special_text_read(vfile_t* f, char* buf, usize len) {
+  special_text_t* t = f->data;
+  len = MIN(len, t->len - t->offs);
+  memcpy(buf, t->data + t->offs, len);
+  t->offs += len;
+  return (isize)len;
+}
+
+
+static err_t special_text_release(vfile_t* f) {
+  free(f->data);
+  return 0;
+}
+
+
+static isize open_special_ioring_stats(const char* path, usize flags, isize mode) {
+  static const vfile_ops_t fops = {
+    .release = special_text_release,
+    .read = special_text_read,
+  };
+  // rings may be opened in between; their statistics are cut off
+  usize cap = ioring_stats_format(NULL, 0) + 1;
+  special_text_t* t = malloc(sizeof(special_text_t) + cap);
+  if (!t)
+    return p_err_nomem;
+  t->len = MIN(ioring_stats_format(t->data, cap), cap - 1);
+  t->offs = 0;
+  vfile_t* f;
+  fd_t fd = vfile_open(&f, "[ioring/stats]", &fops, 0);
+  if (fd < 0) {
+    free(t);
+    return fd;
+  }
+  f->data = t;
+  return fd;
+}
+
+
+// path_is_special returns true if path is in the special filesystem (see open_special),
+// which has no metadata to stat and nothing to remove or rename
+static bool path_is_special(const char* path) {
+  return strlen(path) > strlen(SPECIAL_FS_PREFIX) &&
+         memcmp(path, SPECIAL_FS_PREFIX "/", strlen(SPECIAL_FS_PREFIX "/")) == 0;
+}
+
+
 static isize open_special(psysop_t op, const char* path, usize flags, isize mode) {
   path = path + strlen(SPECIAL_FS_PREFIX) + 1; // "/sys/foo/bar" => "foo/bar"
   usize pathlen = strlen(path);
@@ -103,26 +230,23 @@ static isize open_special(psysop_t op, const char* path, usize flags, isize mode
       return (fun)(path, flags, mode)
 
   ROUTE("uname", open_special_uname);
+  ROUTE("ioring/max_entries", open_special_ioring_max_entries);
+  ROUTE("ioring/stats", open_special_ioring_stats);
 
   #undef ROUTE
   return p_err_not_found;
 }
 
 
-static isize _psys_openat(
-  psysop_t op, fd_t atfd, const char* path, usize flags, isize mode)
-{
+fd_t _psys_openat(psysop_t op, fd_t atfd, const char* path, usize flags, isize mode) {
   if (atfd == P_AT_FDCWD) {
     atfd = (fd_t)AT_FDCWD;
   } else {
     VFILE_JUMP_FOP(openat, atfd, p_err_not_supported, path, flags, mode)
   }
 
-  if (strlen(path) > strlen(SPECIAL_FS_PREFIX) &&
-      memcmp(path, SPECIAL_FS_PREFIX "/", 5) == 0)
-  {
+  if (path_is_special(path))
     return open_special(op, path, flags, mode);
-  }
 
   static const int oflag_map[3] = {
     [p_open_ronly] = O_RDONLY,
@@ -141,7 +265,7 @@ static isize _psys_openat(
     return err_from_errno(errno);
   }
 
-  return (isize)fd;
+  return (fd_t)fd;
 }
 
 
@@ -152,29 +276,266 @@ err_t _psys_pipe(psysop_t op, fd_t* fdp, u32 flags) {
 }
 
 
+// g_host_fd_closes counts closes of host fds, in buckets by fd (host_fd_close_count)
+static u32 g_host_fd_closes[64];
+
+
+u32 host_fd_close_count(fd_t fd) {
+  u32 i = (u32)fd % ARRAY_LEN(g_host_fd_closes);
+  return __atomic_load_n(&g_host_fd_closes[i], __ATOMIC_ACQUIRE);
+}
+
+
 err_t _psys_close_host(psysop_t op, fd_t fd) {
-  if (close((int)fd) != 0)
+  int r = close((int)fd);
+  // after close: a property read before the fd number is reused belongs to the old file
+  u32 i = (u32)fd % ARRAY_LEN(g_host_fd_closes);
+  __atomic_fetch_add(&g_host_fd_closes[i], 1, __ATOMIC_RELEASE);
+  if (r != 0)
     return err_from_errno(errno);
   return 0;
 }
 
 
-static isize _psys_read(psysop_t op, fd_t fd, void* data, usize size) {
-  VFILE_JUMP_FOP(read, fd, p_err_not_supported, data, size)
-  isize n = read((int)fd, data, size);
+isize _psys_pread_host(psysop_t op, fd_t fd, void* data, usize size, u64 offs) {
+  isize n = (offs == (u64)-1) ? read((int)fd, data, size) :
+                                pread((int)fd, data, size, (off_t)offs);
   if (n < 0)
     return err_from_errno(errno);
   return (isize)n;
 }
 
-static isize _psys_write(psysop_t op, fd_t fd, const void* data, usize size) {
-  VFILE_JUMP_FOP(write, fd, p_err_not_supported, data, size)
-  isize n = write((int)fd, data, size);
+isize _psys_pwrite_host(psysop_t op, fd_t fd, const void* data, usize size, u64 offs) {
+  isize n = (offs == (u64)-1) ? write((int)fd, data, size) :
+                                pwrite((int)fd, data, size, (off_t)offs);
   if (n < 0)
     return err_from_errno(errno);
   return (isize)n;
 }
 
+isize _psys_read(psysop_t op, fd_t fd, void* data, usize size) {
+  VFILE_JUMP_FOP(read, fd, p_err_not_supported, data, size)
+  return _psys_pread_host(op, fd, data, size, (u64)-1);
+}
+
+isize _psys_write(psysop_t op, fd_t fd, const void* data, usize size) {
+  VFILE_JUMP_FOP(write, fd, p_err_not_supported, data, size)
+  return _psys_pwrite_host(op, fd, data, size, (u64)-1);
+}
+
+isize _psys_pread(psysop_t op, fd_t fd, void* data, usize size, u64 offs) {
+  VFILE_JUMP_FOP(read, fd, p_err_not_supported, data, size) // vfiles are streams
+  return _psys_pread_host(op, fd, data, size, offs);
+}
+
+isize _psys_pwrite(psysop_t op, fd_t fd, const void* data, usize size, u64 offs) {
+  VFILE_JUMP_FOP(write, fd, p_err_not_supported, data, size) // vfiles are streams
+  return _psys_pwrite_host(op, fd, data, size, offs);
+}
+
+
+// SPLICE_BUF_SIZE: size of the buffer _psys_psplice moves data through when the host
+// can't splice the files itself (virtual files; neither file a pipe; not Linux)
+#define SPLICE_BUF_SIZE 16384
+
+
+static bool splice_is_regular(fd_t fd) {
+  struct stat st;
+  return !vfile_lookup(fd) && fstat((int)fd, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+
+// splice_copy implements _psys_psplice by reading into and writing from a buffer.
+// Like splice, it doesn't wait for more data from a stream once it has moved some.
+static isize splice_copy(fd_t fd_in, u64 off_in, fd_t fd_out, u64 off_out, usize len) {
+  char buf[SPLICE_BUF_SIZE];
+  bool regular = splice_is_regular(fd_in);
+  usize total = 0;
+  while (total < len) {
+    usize chunk = MIN(len - total, sizeof(buf));
+    isize n = _psys_pread(0, fd_in, buf, chunk, off_in == (u64)-1 ? off_in : off_in + total);
+    if (n <= 0)
+      return total ? (isize)total : n;
+    isize w = 0;
+    while (w < n) {
+      u64 offs = off_out == (u64)-1 ? off_out : off_out + total + (u64)w;
+      isize r = _psys_pwrite(0, fd_out, buf + w, (usize)(n - w), offs);
+      if (r <= 0) {
+        // put back what was read from a file but not written; data read from a
+        // stream is lost
+        if (regular && off_in == (u64)-1)
+          lseek((int)fd_in, -(off_t)(n - w), SEEK_CUR);
+        total += (usize)w;
+        return total ? (isize)total : r;
+      }
+      w += r;
+    }
+    total += (usize)n;
+    if (!regular || (usize)n < chunk)
+      break;
+  }
+  return (isize)total;
+}
+
+
+isize _psys_psplice(
+  psysop_t op, fd_t fd_in, u64 off_in, fd_t fd_out, u64 off_out, usize len)
+{
+  #if defined(__linux__)
+  // the host moves the data between pipe buffers and files, if one of them is a pipe
+  if (!vfile_lookup(fd_in) && !vfile_lookup(fd_out)) {
+    loff_t oi = (loff_t)off_in, oo = (loff_t)off_out;
+    ssize_t n = splice((int)fd_in, off_in == (u64)-1 ? NULL : &oi,
+                       (int)fd_out, off_out == (u64)-1 ? NULL : &oo, len, 0);
+    if (n >= 0)
+      return (isize)n;
+    if (errno != EINVAL)
+      return err_from_errno(errno);
+  }
+  #endif
+  return splice_copy(fd_in, off_in, fd_out, off_out, len);
+}
+
+
+isize _psys_splice(psysop_t op, fd_t fd_in, i64* off_in, fd_t fd_out, i64* off_out, usize len) {
+  if ((off_in && *off_in < 0) || (off_out && *off_out < 0))
+    return p_err_invalid;
+  u64 oi = off_in ? (u64)*off_in : (u64)-1;
+  u64 oo = off_out ? (u64)*off_out : (u64)-1;
+  isize n = _psys_psplice(op, fd_in, oi, fd_out, oo, len);
+  if (n > 0) {
+    if (off_in)  *off_in += n;
+    if (off_out) *off_out += n;
+  }
+  return n;
+}
+
+
+isize _psys_tee(psysop_t op, fd_t fd_in, fd_t fd_out, usize len, u32 flags) {
+  if (flags & ~(P_SPLICE_F_MOVE | P_SPLICE_F_MORE))
+    return p_err_invalid;
+  #if defined(__linux__)
+  if (!vfile_lookup(fd_in) && !vfile_lookup(fd_out)) {
+    ssize_t n = tee((int)fd_in, (int)fd_out, len, 0);
+    if (n < 0)
+      return err_from_errno(errno);
+    return (isize)n;
+  }
+  #endif
+  // a pipe can't be read without consuming its data
+  return p_err_not_supported;
+}
+
+
+// at_base sets *dirfd to the host fd of the base directory of a *at operation.
+// Returns false if base is a vfile, which can't be a directory.
+static bool at_base(fd_t base, int* dirfd) {
+  *dirfd = (base == P_AT_FDCWD) ? AT_FDCWD : (int)base;
+  return base == P_AT_FDCWD || !vfile_lookup(base);
+}
+
+
+#if defined(__APPLE__)
+  #define ST_ATIM st_atimespec
+  #define ST_MTIM st_mtimespec
+  #define ST_CTIM st_ctimespec
+#else
+  #define ST_ATIM st_atim
+  #define ST_MTIM st_mtim
+  #define ST_CTIM st_ctim
+#endif
+
+static void statx_from_stat(p_statx_t* stx, const struct stat* st) {
+  memset(stx, 0, sizeof(*stx));
+  stx->stx_mask = P_STATX_BASIC_STATS;
+  stx->stx_blksize = (u32)st->st_blksize;
+  stx->stx_nlink = (u32)st->st_nlink;
+  stx->stx_uid = (u32)st->st_uid;
+  stx->stx_gid = (u32)st->st_gid;
+  stx->stx_mode = (u16)st->st_mode;
+  stx->stx_ino = (u64)st->st_ino;
+  stx->stx_size = (u64)st->st_size;
+  stx->stx_blocks = (u64)st->st_blocks;
+  stx->stx_atime = (p_statx_timestamp_t){ st->ST_ATIM.tv_sec, (u32)st->ST_ATIM.tv_nsec };
+  stx->stx_mtime = (p_statx_timestamp_t){ st->ST_MTIM.tv_sec, (u32)st->ST_MTIM.tv_nsec };
+  stx->stx_ctime = (p_statx_timestamp_t){ st->ST_CTIM.tv_sec, (u32)st->ST_CTIM.tv_nsec };
+  #if defined(__APPLE__)
+  stx->stx_mask |= P_STATX_BTIME;
+  stx->stx_btime = (p_statx_timestamp_t){
+    st->st_birthtimespec.tv_sec, (u32)st->st_birthtimespec.tv_nsec };
+  #endif
+  stx->stx_rdev_major = (u32)major(st->st_rdev);
+  stx->stx_rdev_minor = (u32)minor(st->st_rdev);
+  stx->stx_dev_major = (u32)major(st->st_dev);
+  stx->stx_dev_minor = (u32)minor(st->st_dev);
+}
+
+#undef ST_ATIM
+#undef ST_MTIM
+#undef ST_CTIM
+
+
+err_t _psys_statat(psysop_t op, fd_t base, const char* path, p_statx_t* st, u32 flags) {
+  if (flags & ~(P_AT_SYMLINK_NOFOLLOW | P_AT_EMPTY_PATH))
+    return p_err_invalid;
+  if (path_is_special(path))
+    return p_err_not_supported;
+  int dirfd;
+  if (!at_base(base, &dirfd))
+    return p_err_not_supported;
+
+  #if defined(__linux__) && defined(STATX_BASIC_STATS)
+  static_assert(sizeof(struct statx) == sizeof(p_statx_t), "struct statx layout");
+  // the host fills in the same struct, including the creation time if it knows it
+  if (statx(dirfd, path, (int)flags, STATX_BASIC_STATS | STATX_BTIME, (struct statx*)st) == 0)
+    return 0;
+  if (errno != ENOSYS)
+    return err_from_errno(errno);
+  #endif
+
+  int atflags = 0;
+  if (flags & P_AT_SYMLINK_NOFOLLOW) atflags |= AT_SYMLINK_NOFOLLOW;
+  struct stat hst;
+  int r;
+  if ((flags & P_AT_EMPTY_PATH) && *path == 0) {
+    r = (dirfd == AT_FDCWD) ? stat(".", &hst) : fstat(dirfd, &hst);
+  } else {
+    r = fstatat(dirfd, path, &hst, atflags);
+  }
+  if (r != 0)
+    return err_from_errno(errno);
+  statx_from_stat(st, &hst);
+  return 0;
+}
+
+
+err_t _psys_removeat(psysop_t op, fd_t base, const char* path, u32 flags) {
+  if (flags & ~P_AT_REMOVEDIR)
+    return p_err_invalid;
+  if (path_is_special(path))
+    return p_err_not_supported;
+  int dirfd;
+  if (!at_base(base, &dirfd))
+    return p_err_not_supported;
+  if (unlinkat(dirfd, path, (flags & P_AT_REMOVEDIR) ? AT_REMOVEDIR : 0) != 0)
+    return err_from_errno(errno);
+  return 0;
+}
+
+
+err_t _psys_renameat(
+  psysop_t op, fd_t oldbase, const char* oldpath, fd_t newbase, const char* newpath)
+{
+  if (path_is_special(oldpath) || path_is_special(newpath))
+    return p_err_not_supported;
+  int olddirfd, newdirfd;
+  if (!at_base(oldbase, &olddirfd) || !at_base(newbase, &newdirfd))
+    return p_err_not_supported;
+  if (renameat(olddirfd, oldpath, newdirfd, newpath) != 0)
+    return err_from_errno(errno);
+  return 0;
+}
+
 
 static isize _psys_sleep(psysop_t op, usize seconds, usize nanoseconds) {
   struct timespec rqtp = { .tv_sec = seconds, .tv_nsec = nanoseconds };
@@ -4,6 +4,7 @@
 
 #if defined(HAS_LIBC)
   #include <stdlib.h>
+  #include <pthread.h>
   #define memrealloc(ptr,size) realloc(ptr,size)
   #define memfree(ptr)         free(ptr)
 #else
@@ -12,20 +13,40 @@
   #define memfree(ptr)         ((void)0)
 #endif
 
+// g_vfile_lock guards g_vfile_map. Ring operations may be performed by driver threads
+// (e.g. the ioring SQ poll thread) concurrently with syscalls made by the application.
+#if defined(HAS_LIBC)
+  static pthread_rwlock_t g_vfile_lock = PTHREAD_RWLOCK_INITIALIZER;
+  #define vfile_rlock()  pthread_rwlock_rdlock(&g_vfile_lock)
+  #define vfile_wlock()  pthread_rwlock_wrlock(&g_vfile_lock)
+  #define vfile_unlock() pthread_rwlock_unlock(&g_vfile_lock)
+#else
+  #define vfile_rlock()  ((void)0)
+  #define vfile_wlock()  ((void)0)
+  #define vfile_unlock() ((void)0)
+#endif
+
 #define VFILE_MAP_INITCAP  32  // initial capacity
 #define VFILE_FD_MIN  0x40000000  // minimum fd value vfile_map_alloc will return
+#define VFILE_PIN_CLOSED   (1U << 31) // vfile_t.pins: closed; the last unpin releases
 
 // maps file descriptor -> vfile struct
 typedef struct vfile_map {
-  u32      cap;
-  u32      len;
-  fd_t*    keys;
-  vfile_t* vals;
+  u32       cap;
+  u32       len;
+  fd_t*     keys;
+  vfile_t** vals;
 } vfile_map_t;
 
 // storage of open virtual files
 static fd_t     g_keys_st[VFILE_MAP_INITCAP];
-static vfile_t  g_vals_st[VFILE_MAP_INITCAP];
+static vfile_t* g_vals_st[VFILE_MAP_INITCAP];
+
+// vfile_t storage. Entries are recycled but never returned to the heap, so a vfile_t
+// stays valid memory for a thread which looked it up just before it was closed.
+static vfile_t  g_files_st[VFILE_MAP_INITCAP];
+static u32      g_files_st_len = 0;
+static vfile_t* g_files_free = NULL; // linked through vfile_t.data
 static vfile_map_t g_vfile_map = {
   .cap = VFILE_MAP_INITCAP,
   .len = 0,
@@ -42,26 +63,53 @@ static vfile_map_t g_vfile_map = {
 // }
 
 
+static vfile_t* vfile_alloc(fd_t fd) {
+  vfile_t* f = g_files_free;
+  if (f) {
+    g_files_free = f->data;
+  } else if (g_files_st_len < ARRAY_LEN(g_files_st)) {
+    f = &g_files_st[g_files_st_len++];
+  } else if (!(f = memrealloc(NULL, sizeof(vfile_t)))) {
+    return NULL;
+  }
+  u32 gen = f->gen + 1; // zero for new storage
+  memset(f, 0, sizeof(vfile_t));
+  f->fd = fd;
+  f->gen = gen;
+  return f;
+}
+
+
+static void vfile_free(vfile_t* f) {
+  // let holders of stale pointers notice that the file was closed; fops too, as data
+  // no longer is what fops expects
+  f->fd = -1;
+  f->fops = NULL;
+  f->data = g_files_free;
+  g_files_free = f;
+}
+
+
 static bool vfile_map_grow(vfile_map_t* m) {
   u32 cap = m->cap * 2;
   assert(cap > m->cap); // overflow check (also asserts that m->cap > 0)
   usize keysize = cap * sizeof(fd_t);
-  usize valsize = cap * sizeof(vfile_t);
+  usize valsize = cap * sizeof(vfile_t*);
   fd_t* newkeys = memrealloc(m->keys == g_keys_st ? NULL : m->keys, keysize + valsize);
   if (!newkeys)
     return false;
   if (m->keys == g_keys_st) {
     memcpy(newkeys, m->keys, m->len * sizeof(fd_t));
-    memcpy(&newkeys[cap], m->vals, m->len * sizeof(vfile_t));
+    memcpy(&newkeys[cap], m->vals, m->len * sizeof(vfile_t*));
   }
   m->keys = newkeys;
-  m->vals = (vfile_t*)&newkeys[cap];
+  m->vals = (vfile_t**)&newkeys[cap];
   m->cap = cap;
   return true;
 }
 
 
-// note: returned pointer is only valid until next call to a mutating vfile_map_ function
+// note: returned pointer is valid until the entry is deleted
 static vfile_t* vfile_map_get(vfile_map_t* m, fd_t key) {
   // binary search
   assert(m->len*2 >= m->len); // overflow check
@@ -75,14 +123,14 @@ static vfile_t* vfile_map_get(vfile_map_t* m, fd_t key) {
     } else if (d > 0) {
       high = i;
     } else {
-      return &m->vals[i];
+      return m->vals[i];
     }
   }
   return NULL;
 }
 
 
-// note: returned pointer is only valid until next call to a mutating vfile_map_ function
+// note: returned pointer is valid until the entry is deleted
 static vfile_t* vfile_map_set(vfile_map_t* m, fd_t key) {
   assert(m->len*2 >= m->len); // overflow check
   u32 low = 0;
@@ -98,13 +146,16 @@ static vfile_t* vfile_map_set(vfile_map_t* m, fd_t key) {
     } else if (d > 0) {
       high = i;
     } else {
-      return &m->vals[i];
+      return m->vals[i];
     }
   }
 
-  if (m->len == m->cap) {
-    if (!vfile_map_grow(m))
-      return NULL;
+  vfile_t* f = vfile_alloc(key);
+  if (!f)
+    return NULL;
+  if (m->len == m->cap && !vfile_map_grow(m)) {
+    vfile_free(f);
+    return NULL;
   }
 
   if (d > 0) {
@@ -122,12 +173,12 @@ static vfile_t* vfile_map_set(vfile_map_t* m, fd_t key) {
 
   m->len++;
   m->keys[i] = key;
-  m->vals[i].fd = key;
-  return &m->vals[i];
+  m->vals[i] = f;
+  return f;
 }
 
 
-// note: returned pointer is only valid until next call to a mutating vfile_map_ function
+// note: returned pointer is valid until the entry is deleted
 static vfile_t* vfile_map_alloc(vfile_map_t* m) {
   if (m->len == m->cap) {
     if (!vfile_map_grow(m))
@@ -137,16 +188,20 @@ static vfile_t* vfile_map_alloc(vfile_map_t* m) {
   if (m->len == 0) {
     key = VFILE_FD_MIN;
   } else {
-    key = MAX(VFILE_FD_MIN, m->vals[m->len - 1].fd+1);
+    key = MAX(VFILE_FD_MIN, m->keys[m->len - 1]+1);
   }
+  vfile_t* f = vfile_alloc(key);
+  if (!f)
+    return NULL;
   m->keys[m->len] = key;
-  m->vals[m->len].fd = key;
-  vfile_t* f = &m->vals[m->len++];
+  m->vals[m->len++] = f;
   return f;
 }
 
 
-static bool vfile_map_del(vfile_map_t* m, fd_t key) {
+// vfile_map_take removes the entry of key and returns its file, which the caller must
+// vfile_free, or NULL if there's no such entry
+static vfile_t* vfile_map_take(vfile_map_t* m, fd_t key) {
   u32 low = 0;
   u32 high = m->len;
   while (low < high) {
@@ -157,17 +212,27 @@ static bool vfile_map_del(vfile_map_t* m, fd_t key) {
     } else if (d > 0) {
       high = i;
     } else {
+      vfile_t* f = m->vals[i];
       m->len--;
       if (i < m->len) {
         // i=2 [1 2 3 4 5] => [1 2 4 5 5]
         //                         < <
         memcpy(&m->keys[i], &m->keys[i+1], (m->len - i) * sizeof(fd_t));
-        memcpy(&m->vals[i], &m->vals[i+1], (m->len - i) * sizeof(vfile_t));
+        memcpy(&m->vals[i], &m->vals[i+1], (m->len - i) * sizeof(vfile_t*));
       }
-      return true;
+      return f;
     }
   }
-  return false;
+  return NULL;
+}
+
+
+static bool vfile_map_del(vfile_map_t* m, fd_t key) {
+  vfile_t* f = vfile_map_take(m, key);
+  if (!f)
+    return false;
+  vfile_free(f);
+  return true;
 }
 
 
@@ -246,10 +311,62 @@ static void vfile_map_test() {
 
 
 vfile_t* vfile_lookup(fd_t fd) {
+  vfile_rlock();
+  vfile_t* f = vfile_map_get(&g_vfile_map, fd);
+  vfile_unlock();
+  return f;
+}
+
+
+vfile_t* vfile_lookup_hold(fd_t fd) {
+  vfile_rlock();
   return vfile_map_get(&g_vfile_map, fd);
 }
 
 
+void vfile_lookup_done() {
+  vfile_unlock();
+}
+
+
+vfile_t* vfile_lookup_gen(fd_t fd, u32* gen) {
+  vfile_rlock();
+  vfile_t* f = vfile_map_get(&g_vfile_map, fd);
+  if (f)
+    *gen = f->gen;
+  vfile_unlock();
+  return f;
+}
+
+
+bool vfile_pin(vfile_t* f, u32 gen) {
+  // vfile_close takes the file out of the map before it looks at pins
+  vfile_rlock();
+  bool ok = READ_ONCE(f->gen) == gen && vfile_map_get(&g_vfile_map, f->fd) == f;
+  if (ok)
+    __atomic_fetch_add(&f->pins, 1, __ATOMIC_RELAXED);
+  vfile_unlock();
+  return ok;
+}
+
+
+static err_t vfile_release(vfile_t* f) {
+  err_t ret = 0;
+  if (f->fops->release)
+    ret = f->fops->release(f);
+  vfile_wlock();
+  vfile_free(f);
+  vfile_unlock();
+  return ret;
+}
+
+
+void vfile_unpin(vfile_t* f) {
+  if (__atomic_sub_fetch(&f->pins, 1, __ATOMIC_ACQ_REL) == VFILE_PIN_CLOSED)
+    vfile_release(f);
+}
+
+
 fd_t vfile_open(vfile_t** fp, const char* name, const vfile_ops_t* fops, vfile_flag_t flags) {
   assert(fops != NULL);
   assert(name != NULL);
@@ -270,10 +387,20 @@ fd_t vfile_open(vfile_t** fp, const char* name, const vfile_ops_t* fops, vfile_f
       pipefd[1] = fdr;
       // now: pipefd[0] = writable, pipefd[1] readable
     }
+  }
+
+  vfile_wlock();
+  if (flags & (VFILE_PIPE_R | VFILE_PIPE_W)) {
     f = vfile_map_set(&g_vfile_map, pipefd[0]);
   } else {
     f = vfile_map_alloc(&g_vfile_map);
   }
+  if (f) {
+    f->flags = flags;
+    f->name = name;
+    f->fops = fops;
+  }
+  vfile_unlock();
 
   if (!f) {
     if (flags & (VFILE_PIPE_R | VFILE_PIPE_W))
@@ -281,9 +408,6 @@ fd_t vfile_open(vfile_t** fp, const char* name, const vfile_ops_t* fops, vfile_f
     return p_err_nomem;
   }
 
-  f->flags = flags;
-  f->name = name;
-  f->fops = fops;
   *fp = f;
 
   if (flags & (VFILE_PIPE_R | VFILE_PIPE_W))
@@ -293,9 +417,45 @@ fd_t vfile_open(vfile_t** fp, const char* name, const vfile_ops_t* fops, vfile_f
 }
 
 
+fd_t vfile_adopt(vfile_t** fp, fd_t fd, const char* name, const vfile_ops_t* fops) {
+  assert(fops != NULL);
+  assert(name != NULL);
+  assert(fd < VFILE_FD_MIN); // must be a host file descriptor
+  vfile_wlock();
+  if (vfile_map_get(&g_vfile_map, fd)) {
+    vfile_unlock();
+    return p_err_exists;
+  }
+  vfile_t* f = vfile_map_set(&g_vfile_map, fd);
+  if (f) {
+    f->name = name;
+    f->fops = fops;
+  }
+  vfile_unlock();
+  if (!f)
+    return p_err_nomem;
+  *fp = f;
+  return fd;
+}
+
+
+// vfile_close removes f from the map before releasing it: release may close a host fd
+// (e.g. of a native ring), which the host can then hand out again, to be adopted by
+// another thread while we are still in release. A pinned file is released by the
+// last vfile_unpin instead.
 err_t vfile_close(vfile_t* f) {
-  err_t ret = 0;
-  if (f->fops->release)
-    ret = f->fops->release(f);
-  return vfile_map_del(&g_vfile_map, f->fd) ? ret : p_err_badfd;
+  vfile_wlock();
+  fd_t fd = f->fd;
+  bool ok = fd != -1 && vfile_map_get(&g_vfile_map, fd) == f;
+  u32 pins = 0;
+  if (ok) {
+    vfile_map_take(&g_vfile_map, fd);
+    pins = __atomic_fetch_or(&f->pins, VFILE_PIN_CLOSED, __ATOMIC_ACQ_REL);
+  }
+  vfile_unlock();
+  if (!ok)
+    return p_err_badfd; // closed by another thread
+  if (pins)
+    return 0;
+  return vfile_release(f);
 }
@@ -6,6 +6,10 @@ const sys_op_close  = 4 // sys_fd fd
 const sys_op_read   = 5 // sys_fd fd, void* data, usize size
 const sys_op_write  = 6 // sys_fd fd, const void* data, usize size
 const sys_op_sleep  = 7 // usize seconds, usize nanoseconds
+const sys_op_mmap   = 9 // void** addr, usize length, u32 flags, sys_fd fd, usize offs
+const sys_op_ioring_setup    = 425 // u32 entries, ioring_params* params
+const sys_op_ioring_enter    = 426 // sys_fd ring, u32 to_submit, u32 min_complete, u32 flags, void* arg
+const sys_op_ioring_register = 427 // sys_fd ring, u32 opcode, void* arg, u32 nr_args
 
 // enum sys_err
 const sys_err_none          = 0
@@ -20,6 +24,10 @@ const sys_err_not_supported = 8
 const sys_err_exists        = 9
 const sys_err_end           = 10
 const sys_err_access        = 11
+const sys_err_nomem         = 12
+const sys_err_mfault        = 13
+const sys_err_overflow      = 14
+const sys_err_timedout      = 15
 
 // enum sys_open_flags
 const sys_open_ronly  = 0
@@ -30,6 +38,44 @@ const sys_open_create = 1 << 3
 const sys_open_trunc  = 1 << 4
 const sys_open_excl   = 1 << 5
 
+// enum sys_seek_whence
+const sys_seek_set     = 0
+const sys_seek_current = 1
+const sys_seek_end     = 2
+
+// ioring (see spec.md and include/playsys.h)
+const ioring_op_nop     = 0
+const ioring_op_timeout = 11
+const ioring_op_openat  = 18
+const ioring_op_close   = 19
+const ioring_op_read    = 22
+const ioring_op_write   = 23
+const ioring_op_last    = 50
+
+const ioring_off_sq_ring = 0
+const ioring_off_cq_ring = 0x8000000
+const ioring_off_sqes    = 0x10000000
+
+const ioring_setup_cqsize = 1 << 3
+const ioring_setup_clamp  = 1 << 4
+
+const ioring_feat_single_mmap = 1 << 0
+const ioring_feat_nodrop      = 1 << 1
+const ioring_feat_rw_cur_pos  = 1 << 3
+const ioring_feat_ext_arg     = 1 << 8
+
+const ioring_sqe_io_link     = 1 << 2
+const ioring_sqe_io_hardlink = 1 << 3
+const ioring_sqe_async       = 1 << 4
+
+const ioring_sq_cq_overflow  = 1 << 1
+const ioring_enter_getevents = 1 << 0
+const ioring_enter_ext_arg    = 1 << 3
+const ioring_register_probe  = 8
+const ioring_op_supported    = 1 << 0 // ioring_probe_op.flags
+
+const ioring_max_entries = 32768
+
 function assert(cond) {
   if (!cond)
     throw new Error(`assertion failed`)
@@ -40,6 +86,7 @@ function sys_syscall(proc, op, arg1, arg2, arg3, arg4, arg5) { // -> sys_ret
   // console.log("sys_syscall", {proc, op, arg1, arg2, arg3, arg4, arg5})
   if (proc.suspended)
     return proc.resumeFinalize()
+  proc.checkMemory()
   switch (op) {
     case sys_op_test:   return sys_syscall_test(proc, arg1);
     case sys_op_exit:   return sys_syscall_exit(proc, arg1);
@@ -48,6 +95,10 @@ function sys_syscall(proc, op, arg1, arg2, arg3, arg4, arg5) { // -> sys_ret
     case sys_op_read:   return sys_syscall_read(proc, arg1, arg2, arg3);
     case sys_op_write:  return sys_syscall_write(proc, arg1, arg2, arg3);
     case sys_op_sleep:  return sys_syscall_sleep(proc, arg1, arg2);
+    case sys_op_mmap:   return sys_syscall_mmap(proc, arg1, arg2, arg3, arg4, arg5);
+    case sys_op_ioring_setup:    return sys_syscall_ioring_setup(proc, arg1, arg2);
+    case sys_op_ioring_enter:    return sys_syscall_ioring_enter(proc, arg1, arg2, arg3, arg4, arg5);
+    case sys_op_ioring_register: return sys_syscall_ioring_register(proc, arg1, arg2, arg3, arg4);
   }
   console.error("invalid sys_syscall op", {proc, op, arg1, arg2, arg3, arg4, arg5})
   return -sys_err_sys_op;
@@ -94,7 +145,9 @@ async function open_web_fs(proc, pathptr, flags, mode) {
 }
 
 
-function sys_syscall_openat(proc, basefd, pathptr, flags, mode) {
+// openat opens a file. Returns a fd, or a Promise of one when the file is opened
+// asynchronously.
+function openat(proc, basefd, pathptr, flags, mode) {
   const path = proc.cstr(pathptr)
   if (path.length == 0)
     return -sys_err_invalid
@@ -123,16 +176,20 @@ function sys_syscall_openat(proc, basefd, pathptr, flags, mode) {
     return fd
   }
 
-  proc.suspend()
-  open_web_fs(proc, pathptr, flags, mode).then(fd => {
-    proc.resume(fd)
-  }).catch(err => {
+  return open_web_fs(proc, pathptr, flags, mode).catch(err => {
     // console.error("open_web_fs failed:", err, {err})
-    const code = (err.name == "AbortError") ? sys_err_canceled : sys_err_invalid
-    proc.resume(-code)
+    return (err.name == "AbortError") ? -sys_err_canceled : -sys_err_invalid
   })
 }
 
+function sys_syscall_openat(proc, basefd, pathptr, flags, mode) {
+  const result = openat(proc, basefd, pathptr, flags, mode)
+  if (!(result instanceof Promise))
+    return result
+  proc.suspend()
+  result.then(fd => proc.resume(fd))
+}
+
 function sys_syscall_close(proc, fd) {
   const file = proc.files[fd]
   if (!file)
@@ -174,6 +231,38 @@ function sys_syscall_sleep(proc, seconds, nanoseconds) {
   setTimeout(() => { proc.resume(0) }, milliseconds);
 }
 
+function sys_syscall_mmap(proc, addrptr, length, flags, fd, offs) {
+  // only ring memory can be mapped
+  const file = proc.files[fd]
+  if (!file)
+    return -sys_err_badfd
+  if (!(file instanceof IoRing))
+    return -sys_err_not_supported
+  const addr = file.mmap(offs >>> 0, length >>> 0)
+  if (addr < 0)
+    return addr
+  proc.setU32(addrptr, addr)
+  return 0
+}
+
+function sys_syscall_ioring_setup(proc, entries, paramsptr) {
+  return IoRing.setup(proc, entries >>> 0, paramsptr >>> 0)
+}
+
+function sys_syscall_ioring_enter(proc, fd, to_submit, min_complete, flags, argptr) {
+  const ring = proc.files[fd]
+  if (!(ring instanceof IoRing))
+    return -sys_err_badfd
+  return ring.enter(to_submit >>> 0, min_complete >>> 0, flags >>> 0, argptr >>> 0)
+}
+
+function sys_syscall_ioring_register(proc, fd, opcode, argptr, nr_args) {
+  const ring = proc.files[fd]
+  if (!(ring instanceof IoRing))
+    return -sys_err_badfd
+  return ring.register(opcode >>> 0, argptr >>> 0, nr_args >>> 0)
+}
+
 // -------------------------------------------------------------------------
 
 // note: nodejs has require("util").TextEncoder & .TextDecoder
@@ -206,9 +295,6 @@ class SeekableFile extends FileBase {
     this.pos = 0
   }
   seek(offset, whence) {
-    const sys_seek_set = 1
-    const sys_seek_current = 1
-    const sys_seek_end = 1
     switch (whence) {
       case sys_seek_set:     this.pos = offset; break
       case sys_seek_current: this.pos += offset; break
@@ -339,6 +425,381 @@ class LineWriterFile extends FileBase {
 }
 
 
+// IoRing is a ring created with ioring_setup (see spec.md.)
+// The ring lives in wasm memory: SQEs are read from and CQEs written to it directly,
+// without entering wasm. Operations complete through promises, in any order, so the
+// program only has to suspend (asyncify) when it waits for completions with
+// ioring_enter(GETEVENTS).
+//
+// Memory layout; offsets are reported to the program in ioring_params:
+//    0  sq head, tail, ring_mask, ring_entries, flags, dropped
+//   64  cq head, tail, ring_mask, ring_entries, overflow, flags
+//  128  cqes[cq_entries]  (16 bytes each)
+//       sq_array[sq_entries]  (u32)
+//       sqes[sq_entries]  (64 bytes each, cache-line aligned)
+class IoRing extends FileBase {
+  constructor(proc, fd, sq_entries, cq_entries) {
+    super(proc, fd, sys_open_rw)
+    this.sq_entries = sq_entries
+    this.cq_entries = cq_entries
+    this.sq_off = 0
+    this.cq_off = 64
+    this.cqes_off = 128
+    this.sq_array_off = this.cqes_off + cq_entries*16
+    this.sqes_off = align2(this.sq_array_off + sq_entries*4, 64)
+    this.size = this.sqes_off + sq_entries*64
+    this.addr = proc.allocMem(this.size)
+    this.sq_head = 0    // next SQE to consume
+    this.cq_tail = 0    // next CQE to produce
+    this.link = null    // SQEs of a link chain being submitted
+    this.overflow = []  // CQEs held back while the CQ ring is full
+    this.waiter = null  // {min_complete, result, timer} of a suspended ioring_enter
+    this.closed = false
+  }
+
+  // setup creates a ring and fills in params at paramsptr.
+  // Returns the ring's fd.
+  static setup(proc, entries, paramsptr) {
+    const flags = proc.u32(paramsptr + 8)
+    if (flags & ~(ioring_setup_cqsize | ioring_setup_clamp))
+      return -sys_err_not_supported // e.g. SQPOLL, which needs threads
+    if (entries == 0)
+      return -sys_err_invalid
+    if (entries > ioring_max_entries) {
+      if (!(flags & ioring_setup_clamp))
+        return -sys_err_invalid
+      entries = ioring_max_entries
+    }
+    const sq_entries = ceil_pow2(entries)
+    let cq_entries = sq_entries * 2
+    if (flags & ioring_setup_cqsize) {
+      cq_entries = proc.u32(paramsptr + 4)
+      if (cq_entries == 0)
+        return -sys_err_invalid
+      if (cq_entries > ioring_max_entries*2) {
+        if (!(flags & ioring_setup_clamp))
+          return -sys_err_invalid
+        cq_entries = ioring_max_entries*2
+      }
+      cq_entries = ceil_pow2(cq_entries)
+      if (cq_entries < sq_entries)
+        return -sys_err_invalid
+    }
+
+    const fd = proc.allocFd()
+    const ring = new IoRing(proc, fd, sq_entries, cq_entries)
+    proc.files[fd] = ring
+    ring.init()
+
+    // ioring_params
+    const p = paramsptr
+    proc.setU32(p + 0, sq_entries)
+    proc.setU32(p + 4, cq_entries)
+    proc.setU32(p + 20, ioring_feat_single_mmap | ioring_feat_nodrop | ioring_feat_rw_cur_pos |
+      ioring_feat_ext_arg)
+    const sq_off = [0, 4, 8, 12, 16, 20, ring.sq_array_off, 0] // head ... array, resv1
+    const cq_off = [64, 68, 72, 76, 80, ring.cqes_off, 84, 0]  // head ... cqes, flags, resv1
+    for (let i = 0; i < 8; i++) {
+      proc.setU32(p + 40 + i*4, sq_off[i])
+      proc.setU32(p + 80 + i*4, cq_off[i])
+    }
+    return fd
+  }
+
+  init() {
+    const proc = this.proc, a = this.addr
+    proc.mem_u8.fill(0, a, a + this.cqes_off)
+    proc.setU32(a + 8, this.sq_entries - 1)   // sq ring_mask
+    proc.setU32(a + 12, this.sq_entries)      // sq ring_entries
+    proc.setU32(a + 72, this.cq_entries - 1)  // cq ring_mask
+    proc.setU32(a + 76, this.cq_entries)      // cq ring_entries
+  }
+
+  mmap(offs, length) {
+    switch (offs) {
+      case ioring_off_sq_ring:
+      case ioring_off_cq_ring: return this.addr
+      case ioring_off_sqes:    return this.addr + this.sqes_off
+    }
+    return -sys_err_invalid
+  }
+
+  close() {
+    this.closed = true
+    this.overflow = []
+    this.proc.freeMem(this.addr, this.size)
+    return 0
+  }
+
+  // enter implements ioring_enter
+  enter(to_submit, min_complete, flags, argptr) {
+    const proc = this.proc
+    let timeout = -1 // milliseconds; -1 for none
+    if (flags & ioring_enter_ext_arg) {
+      // ioring_getevents_arg {u64 sigmask, u32 sigmask_sz, u32 pad, u64 ts}
+      if (!argptr)
+        return -sys_err_mfault
+      if (proc.u32(argptr) || proc.u32(argptr + 4) || proc.u32(argptr + 8) || proc.u32(argptr + 12))
+        return -sys_err_invalid // signal masks are not supported
+      const tsptr = proc.u32(argptr + 16)
+      if (tsptr)
+        timeout = this.timespecMs(tsptr)
+    } else if (argptr) {
+      return -sys_err_invalid
+    }
+    this.flushOverflow()
+    const submitted = this.submit(to_submit)
+    min_complete = Math.min(min_complete, this.cq_entries)
+    if (!(flags & ioring_enter_getevents) || this.cqReady() >= min_complete)
+      return submitted
+    if (timeout == 0)
+      return submitted || -sys_err_timedout
+    // wait for completions; the only case where the program is suspended
+    if (!proc.canSuspend())
+      return submitted || -sys_err_not_supported
+    proc.suspend()
+    const w = { min_complete, result: submitted, timer: null }
+    if (timeout > 0) {
+      w.timer = setTimeout(() => {
+        if (this.waiter === w) {
+          this.waiter = null
+          proc.resume(submitted || -sys_err_timedout)
+        }
+      }, timeout)
+    }
+    this.waiter = w
+  }
+
+  // timespecMs reads a relative timespec {i64 tv_sec, i64 tv_nsec} in milliseconds
+  timespecMs(p) {
+    const proc = this.proc
+    const sec = proc.u32(p) + proc.i32(p + 4)*0x100000000
+    const nsec = proc.u32(p + 8)
+    return sec*1000 + nsec/1000000
+  }
+
+  // cqReady returns the number of CQEs available to the program
+  cqReady() {
+    return (this.cq_tail - this.proc.u32(this.addr + 64)) >>> 0
+  }
+
+  // submit consumes up to n SQEs. Returns the number of SQEs consumed.
+  submit(n) {
+    const proc = this.proc, a = this.addr
+    const tail = proc.u32(a + 4)
+    n = Math.min(n, (tail - this.sq_head) >>> 0)
+    for (let i = 0; i < n; i++) {
+      const index = proc.u32(a + this.sq_array_off + ((this.sq_head + i) & (this.sq_entries-1))*4)
+      if (index >= this.sq_entries) {
+        proc.setU32(a + 20, proc.u32(a + 20) + 1) // sq dropped
+        continue
+      }
+      this.submitSqe(this.readSqe(a + this.sqes_off + index*64))
+    }
+    // a link chain is cut off at the end of a submission
+    if (this.link) {
+      this.runChain(this.link)
+      this.link = null
+    }
+    this.sq_head = (this.sq_head + n) >>> 0
+    proc.setU32(a + 0, this.sq_head) // hand the SQ slots back to the program
+    return n
+  }
+
+  // readSqe copies the fields of an SQE, which the program may reuse as soon as it
+  // has been consumed
+  readSqe(p) {
+    const proc = this.proc
+    return {
+      opcode:  proc.u8(p),
+      flags:   proc.u8(p + 1),
+      fd:      proc.i32(p + 4),
+      off:     proc.u32(p + 8),
+      off_hi:  proc.u32(p + 12),
+      addr:    proc.u32(p + 16), // wasm32; the upper half is unused
+      len:     proc.u32(p + 24),
+      opflags: proc.u32(p + 28),
+      ud:      proc.u32(p + 32), // user_data
+      ud_hi:   proc.u32(p + 36),
+    }
+  }
+
+  submitSqe(sqe) {
+    const linked = sqe.flags & (ioring_sqe_io_link | ioring_sqe_io_hardlink)
+    if (this.link) {
+      this.link.push(sqe)
+      if (!linked) {
+        this.runChain(this.link)
+        this.link = null
+      }
+    } else if (linked) {
+      this.link = [sqe]
+    } else {
+      const res = this.issue(sqe)
+      if (res instanceof Promise) {
+        res.then(res => this.complete(sqe, res))
+      } else {
+        this.complete(sqe, res)
+      }
+    }
+  }
+
+  // runChain executes the SQEs of a link chain one after the other
+  async runChain(chain) {
+    for (let i = 0; i < chain.length; i++) {
+      const sqe = chain[i]
+      const res = await this.issue(sqe)
+      this.complete(sqe, res)
+      const short = (sqe.opcode == ioring_op_read || sqe.opcode == ioring_op_write) &&
+                    res >= 0 && res < sqe.len
+      if ((res < 0 || short) && !(sqe.flags & ioring_sqe_io_hardlink)) {
+        for (i++; i < chain.length; i++)
+          this.complete(chain[i], -sys_err_canceled)
+        break
+      }
+    }
+  }
+
+  // issue starts the operation of sqe.
+  // Returns its result, or a Promise of it if it completes later.
+  issue(sqe) {
+    const proc = this.proc
+    if (sqe.flags & ~(ioring_sqe_io_link | ioring_sqe_io_hardlink | ioring_sqe_async))
+      return -sys_err_not_supported // FIXED_FILE, IO_DRAIN and BUFFER_SELECT
+    switch (sqe.opcode) {
+      case ioring_op_nop:
+        return 0
+
+      case ioring_op_openat:
+        return openat(proc, sqe.fd, sqe.addr, sqe.opflags, sqe.len)
+
+      case ioring_op_close: {
+        const file = proc.files[sqe.fd]
+        if (!file || file === this)
+          return -sys_err_badfd
+        proc.freeFd(sqe.fd)
+        return Promise.resolve(file.close()).then(() => 0, () => -sys_err_canceled)
+      }
+
+      case ioring_op_read:
+      case ioring_op_write: {
+        const file = proc.files[sqe.fd]
+        if (!file)
+          return -sys_err_badfd
+        const isread = sqe.opcode == ioring_op_read
+        if (isread ? !file.isReadable() : !file.isWritable())
+          return -sys_err_invalid
+        if (sqe.off != 0xffffffff || sqe.off_hi != 0xffffffff) { // not the current position
+          const r = file.seek(sqe.off + sqe.off_hi*0x100000000, sys_seek_set)
+          if (r < 0)
+            return r
+        }
+        const res = isread ? file.read(sqe.addr, sqe.len) : file.write(sqe.addr, sqe.len)
+        if (!(res instanceof Promise))
+          return res
+        return res.catch(err => -sys_err_canceled)
+      }
+
+      case ioring_op_timeout: {
+        // relative timespec at addr
+        if (sqe.len != 1 || sqe.off || sqe.off_hi || sqe.opflags)
+          return -sys_err_not_supported // completion counts and absolute time
+        const ms = this.timespecMs(sqe.addr)
+        return new Promise(resolve => setTimeout(() => resolve(-sys_err_timedout), ms))
+      }
+    }
+    return -sys_err_not_supported
+  }
+
+  static supportsOp(op) {
+    switch (op) {
+      case ioring_op_nop:
+      case ioring_op_openat:
+      case ioring_op_close:
+      case ioring_op_read:
+      case ioring_op_write:
+      case ioring_op_timeout:
+        return true
+    }
+    return false
+  }
+
+  // complete posts the CQE of sqe
+  complete(sqe, res) {
+    if (this.closed)
+      return
+    this.proc.checkMemory() // may be called outside of a syscall
+    if (this.overflow.length || !this.postCqe(sqe.ud, sqe.ud_hi, res)) {
+      // hold back until the program has made room (FEAT_NODROP)
+      this.overflow.push([sqe.ud, sqe.ud_hi, res])
+      const flagsp = this.addr + 16
+      this.proc.setU32(flagsp, this.proc.u32(flagsp) | ioring_sq_cq_overflow)
+    }
+    this.wakeWaiter()
+  }
+
+  // postCqe writes a CQE to the CQ ring. Returns false if the ring is full.
+  postCqe(ud, ud_hi, res) {
+    const proc = this.proc, a = this.addr
+    if (this.cqReady() >= this.cq_entries)
+      return false
+    const p = a + this.cqes_off + (this.cq_tail & (this.cq_entries - 1))*16
+    proc.setU32(p, ud)
+    proc.setU32(p + 4, ud_hi)
+    proc.setI32(p + 8, res)
+    proc.setU32(p + 12, 0)
+    this.cq_tail = (this.cq_tail + 1) >>> 0
+    proc.setU32(a + 68, this.cq_tail)
+    return true
+  }
+
+  flushOverflow() {
+    while (this.overflow.length && this.postCqe(...this.overflow[0]))
+      this.overflow.shift()
+    if (this.overflow.length == 0) {
+      const flagsp = this.addr + 16
+      this.proc.setU32(flagsp, this.proc.u32(flagsp) & ~ioring_sq_cq_overflow)
+    }
+  }
+
+  wakeWaiter() {
+    const w = this.waiter
+    if (w && this.cqReady() >= w.min_complete) {
+      this.waiter = null
+      if (w.timer)
+        clearTimeout(w.timer)
+      this.proc.resume(w.result)
+    }
+  }
+
+  // register implements ioring_register
+  register(opcode, argptr, nr_args) {
+    if (opcode != ioring_register_probe)
+      return -sys_err_not_supported
+    // ioring_probe {u8 last_op, u8 ops_len, u16 resv, u32 resv2[3]} followed by
+    // nr_args ioring_probe_op {u8 op, u8 resv, u16 flags, u32 resv2}
+    const proc = this.proc
+    if (!argptr)
+      return -sys_err_invalid
+    nr_args = Math.min(nr_args, ioring_op_last)
+    const end = argptr + 16 + nr_args*8
+    for (let p = argptr; p < end; p++) {
+      if (proc.u8(p))
+        return -sys_err_invalid // must be zeroed
+    }
+    proc.mem_u8[argptr] = ioring_op_last - 1
+    proc.mem_u8[argptr + 1] = nr_args
+    for (let op = 0; op < nr_args; op++) {
+      const p = argptr + 16 + op*8
+      proc.mem_u8[p] = op
+      if (IoRing.supportsOp(op))
+        proc.mem_u8[p + 2] = ioring_op_supported // u16 flags, little endian
+    }
+    return 0
+  }
+}
+
+
 // fake file system
 class FakeFSEntry {}
 class FakeFS {
@@ -392,6 +853,7 @@ class Process {
     this.main_args_addr = this.suspend_data_addr + this.suspend_stack_size
     this.onStdoutLine = console.log.bind(console)
     this.onStderrLine = console.error.bind(console)
+    this.free_mem = [] // [addr, size] of memory released by closed rings
     this.files = { // open file handles, indexed by fd
       0: /*stdin*/  new FileBase(this, 0, 0), // invalid
       1: /*stdout*/ new LineWriterFile(this, 1, sys_open_wonly, s => this.onStdoutLine(s)),
@@ -470,6 +932,32 @@ class Process {
     this.free_fds.push(fd)
   }
 
+  // checkMemory updates the views of wasm memory after it has grown
+  checkMemory() {
+    if (this.mem_u8.buffer !== this.memory.buffer) {
+      this.mem_u8 = new Uint8Array(this.memory.buffer)
+      this.mem_i32 = new Int32Array(this.memory.buffer)
+      this.mem_u32 = new Uint32Array(this.memory.buffer)
+    }
+  }
+
+  // allocMem returns the address of size bytes of wasm memory owned by the host.
+  // Memory is taken by growing wasm memory, so it does not interfere with the
+  // program's allocator, and is reused when freed with freeMem.
+  allocMem(size) {
+    size = align2(size, 65536)
+    const i = this.free_mem.findIndex(v => v[1] == size)
+    if (i != -1)
+      return this.free_mem.splice(i, 1)[0][0]
+    const addr = this.memory.grow(size / 65536) * 65536
+    this.checkMemory()
+    return addr
+  }
+
+  freeMem(addr, size) {
+    this.free_mem.push([addr, align2(size, 65536)])
+  }
+
   u8(ptr)  { return this.mem_u8[ptr] }
 
   i32(ptr) { return this.mem_i32[ptr >>> 2] }
@@ -548,6 +1036,9 @@ class Process {
   // 0 = normal, 1 = unwinding, 2 = rewinding
   suspendState() { return this.instance.exports.asyncify_get_state() }
 
+  // canSuspend returns true if the program was built with asyncify
+  canSuspend() { return !!this.instance.exports.asyncify_start_unwind }
+
   mkasync(f) {
     const proc = this
     return function() {
@@ -599,6 +1090,12 @@ function align2(u,a) {
 }
 
 
+// ceil_pow2 rounds up unsigned integer u to the closest power of two (u must be >0)
+function ceil_pow2(u) {
+  return u <= 1 ? 1 : (2 ** (32 - Math.clz32((u >>> 0) - 1))) >>> 0
+}
+
+
 // function TODO_open_web_fs() {
 //   // see https://web.dev/file-system-access/
 //   // see https://developer.mozilla.org/en-US/docs/Web/API/window/showSaveFilePicker
@@ -43,6 +43,9 @@ export enum err {
   nomem         = -12, // cannot allocate memory
   mfault        = -13, // bad memory address
   overflow      = -14, // value too large for defined data type
+  timedout      = -15, // timer expired
+  already       = -16, // operation already in progress
+  io            = -17, // input/output error
 }
 
 // open flags
@@ -63,19 +66,75 @@ export enum sysop {
   read            =     0, // fd fd, data mutptr, nbyte usize
   write           =     1, // fd fd, data ptr, nbyte usize
   seek            =     8, // TODO
-  statat          =   262, // TODO (newfstatat in linux, alt: statx 332) -> err
+  statat          =   262, // base fd, path cstr, st *statx, flags u32 -> err
   removeat        =   263, // base fd, path cstr, flags u32 -> err
   renameat        =   264, // oldbase fd, oldpath cstr, newbase fd, newpath cstr -> err
   sleep           =   230, // seconds usize, nanoseconds usize
   exit            =    60, // status_code i32 -> err
   mmap            =     9, // addr *ptr, length usize, flag mmapflag, fd fd, offs usize -> err
   pipe            =   293, // fdv *fd, flags u32 -> err
+  splice          =   275, // fd_in fd, off_in *i64, fd_out fd, off_out *i64, len usize
+  tee             =   276, // fd_in fd, fd_out fd, len usize, flags u32
   test            = 10000, // op psysop -> err
   gpudev          = 10001, // flags gpudevflag -> fd
   gui_mksurf      = 10002, // width u32, height u32, device fd, flags u32 -> fd
   ioring_setup    =   425, // entries u32, params *ioring_params -> fd
-  ioring_enter    =   426, // ring fd, to_submit u32, min_complete u32, flags u32
+  ioring_enter    =   426, // ring fd, to_submit u32, min_complete u32, flags u32, arg ptr
   ioring_register =   427, // ring fd, opcode u32, arg ptr, nr_args u32
 }
 
+// ioring operations (ioring_sqe.opcode)
+export enum ioring_op {
+  NOP             =  0, // No operation
+  READV           =  1, // Read into an array of iovec (addr, len)
+  WRITEV          =  2, // Write from an array of iovec (addr, len)
+  FSYNC           =  3, // Sync a file to storage
+  READ_FIXED      =  4, // Read into a registered buffer
+  WRITE_FIXED     =  5, // Write from a registered buffer
+  POLL_ADD        =  6, // Wait for poll32_events on a file
+  POLL_REMOVE     =  7, // Cancel a POLL_ADD
+  SYNC_FILE_RANGE =  8, // Sync a range of a file to storage
+  SENDMSG         =  9, // Send a message on a socket
+  RECVMSG         = 10, // Receive a message from a socket
+  TIMEOUT         = 11, // Complete after a timeout or a number of completions
+  TIMEOUT_REMOVE  = 12, // Cancel or update a TIMEOUT
+  ACCEPT          = 13, // Accept a connection on a socket
+  ASYNC_CANCEL    = 14, // Cancel an operation in progress
+  LINK_TIMEOUT    = 15, // Limit the time of the linked operation
+  CONNECT         = 16, // Connect a socket
+  FALLOCATE       = 17, // Allocate space of a file
+  OPENAT          = 18, // Open a file
+  CLOSE           = 19, // Close a file
+  FILES_UPDATE    = 20, // Update the registered file table
+  STATX           = 21, // Get file status
+  READ            = 22, // Read into a buffer
+  WRITE           = 23, // Write from a buffer
+  FADVISE         = 24, // Declare file access pattern
+  MADVISE         = 25, // Declare memory access pattern
+  SEND            = 26, // Send data on a socket
+  RECV            = 27, // Receive data from a socket
+  OPENAT2         = 28, // Open a file (with open_how)
+  EPOLL_CTL       = 29, // Control an epoll instance
+  SPLICE          = 30, // Move data between two files, one of which is a pipe
+  PROVIDE_BUFFERS = 31, // Add buffers to a buffer group
+  REMOVE_BUFFERS  = 32, // Remove buffers from a buffer group
+  TEE             = 33, // Duplicate data between two pipes
+  SHUTDOWN        = 34, // Shut down a socket
+  RENAMEAT        = 35, // Rename a file
+  UNLINKAT        = 36, // Remove a file or directory
+  MKDIRAT         = 37, // Create a directory
+  SYMLINKAT       = 38, // Create a symbolic link
+  LINKAT          = 39, // Create a hard link
+  MSG_RING        = 40, // Post a CQE to another ring
+  FSETXATTR       = 41, // Set an extended attribute of a file
+  SETXATTR        = 42, // Set an extended attribute of a path
+  FGETXATTR       = 43, // Get an extended attribute of a file
+  GETXATTR        = 44, // Get an extended attribute of a path
+  SOCKET          = 45, // Create a socket
+  URING_CMD       = 46, // Device-specific command
+  SEND_ZC         = 47, // Send data on a socket without copying
+  SENDMSG_ZC      = 48, // Send a message on a socket without copying
+  READ_MULTISHOT  = 49, // Read repeatedly into selected buffers
+}
+
 // Note: this file is generated from spec.md; edit with caution
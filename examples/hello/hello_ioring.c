@@ -1,57 +1,57 @@
 #include "hello.h"
+#include "sysring.h"
+
+
+// ioring_supports_op asks the driver if it supports ioring operation op
+static bool ioring_supports_op(fd_t ring, u8 op) {
+  struct {
+    p_ioring_probe_t    probe;
+    p_ioring_probe_op_t ops[P_IORING_OP_LAST];
+  } probe = {0};
+  if (p_syscall_ioring_register(ring, P_IORING_REGISTER_PROBE, &probe, P_IORING_OP_LAST))
+    return false;
+  return op < probe.probe.ops_len && (probe.ops[op].flags & P_IO_URING_OP_SUPPORTED);
+}
 
 
-err_t ioring_req_readfile(
-  p_ioring_params_t p,
-  void* ring_sq,
-  void* ring_sqe,
-  const char* filename)
-{
-  u32 tail = 0, next_tail = 0;
-  // next_tail = tail = *sring->tail;
-  next_tail = tail = *(u32*)(ring_sq + p.sq_off.tail);
-  next_tail++;
-  p_mbarrier_r();
-
-  // WIP
-
-  return p_err_not_supported;
+// ioring_openat opens a file via the ring and returns its fd
+static fd_t ioring_openat(sys_ring_t* ring, const char* filename, openflag_t flags) {
+  p_ioring_sqe_t* sqe = sys_ring_get_sqe(ring);
+  if (!sqe)
+    return p_err_overflow;
+  sys_ring_prep_openat(sqe, P_AT_FDCWD, filename, flags, 0);
+  sqe->user_data = 1;
+
+  isize n = sys_ring_submit_and_wait(ring, 1);
+  if (n < 0)
+    return (fd_t)n;
+
+  p_ioring_cqe_t* cqe;
+  err_t err = sys_ring_wait_cqe(ring, &cqe, (void*)0);
+  if (err)
+    return err;
+  fd_t fd = cqe->res;
+  sys_ring_cqe_seen(ring);
+  return fd;
 }
 
 
 void hello_ioring() {
   // ioring
   // https://github.com/torvalds/linux/tree/v5.15/tools/io_uring
-  p_ioring_params_t ringp = {0};
-  fd_t ring = p_syscall_ioring_setup(/*entries*/1, &ringp);
-  print("ring:  ", ring, "\n");
-  check_status(ring, "p_syscall_ioring_setup");
-  print("p_syscall_ioring_setup OK\n");
-
-  // map ring buffer memory
-  usize sring_size = (usize)ringp.sq_off.array + ringp.sq_entries * sizeof(u32);
-  usize cring_size = (usize)ringp.cq_off.cqes + ringp.cq_entries * sizeof(u32);
-  usize ring_size = sring_size > cring_size ? sring_size : cring_size; // max
-  void* ring_sq = NULL;
-  err_t err = p_syscall_mmap(
-    &ring_sq, ring_size,
-    p_mmap_prot_read | p_mmap_prot_write | p_mmap_shared | p_mmap_populate,
-    ring, P_IORING_OFF_SQ_RING);
-  check_status(err, "mmap P_IORING_OFF_SQ_RING");
-
-  // map submission queue entries array (completion queue is in ring_sq)
-  void* ring_sqe = NULL;
-  err = p_syscall_mmap(
-    &ring_sqe, ringp.sq_entries * sizeof(p_ioring_sqe_t),
-    p_mmap_prot_read | p_mmap_prot_write | p_mmap_shared | p_mmap_populate,
-    ring, P_IORING_OFF_SQES);
-  check_status(err, "mmap P_IORING_OFF_SQES");
-
-  // request reading a file (WIP; not yet working)
-  err = ioring_req_readfile(ringp, ring_sq, ring_sqe, "hello.txt");
-  print("ioring_req_readfile => ", p_err_str(err), "\n");
-  // check_status(err, "mmap P_IORING_OFF_SQES");
-
-  // close ring
-  check_status(close(ring), "close(ring)");
+  sys_ring_t ring;
+  err_t err = sys_ring_init(&ring, /*entries*/1, 0);
+  check_status(err, "sys_ring_init");
+  print("ring:  ", ring.fd, "\n");
+
+  if (!ioring_supports_op(ring.fd, P_IORING_OP_OPENAT)) {
+    print("ioring: OPENAT not supported\n");
+  } else {
+    fd_t fd = ioring_openat(&ring, "hello.txt", p_open_ronly);
+    check_status(fd, "ioring_openat");
+    print("ioring_openat => ", fd, "\n");
+    check_status(close(fd), "close");
+  }
+
+  check_status(sys_ring_exit(&ring), "sys_ring_exit");
 }
@@ -0,0 +1,170 @@
+#include "sysring.h"
+
+
+static err_t sys_ring_mmap(void** addr, usize size, fd_t fd, usize offs) {
+  mmapflag_t fl = p_mmap_prot_read | p_mmap_prot_write | p_mmap_shared | p_mmap_populate;
+  return p_syscall_mmap(addr, size, fl, fd, offs);
+}
+
+
+err_t sys_ring_init_params(sys_ring_t* ring, u32 entries, p_ioring_params_t* p) {
+  *ring = (sys_ring_t){ .fd = -1 };
+  fd_t fd = p_syscall_ioring_setup(entries, p);
+  if (fd < 0)
+    return (err_t)fd;
+
+  // The SQ ring ends with the SQ index array and the CQ ring with the CQEs.
+  // With P_IORING_FEAT_SINGLE_MMAP both rings live in one mapping.
+  usize sq_size = (usize)p->sq_off.array + p->sq_entries * sizeof(u32);
+  usize cq_size = (usize)p->cq_off.cqes + p->cq_entries * sizeof(p_ioring_cqe_t);
+  u32 single = p->features & P_IORING_FEAT_SINGLE_MMAP;
+  if (single && cq_size > sq_size)
+    sq_size = cq_size;
+
+  void* sq = (void*)0;
+  void* cq = (void*)0;
+  void* sqes = (void*)0;
+  err_t err = sys_ring_mmap(&sq, sq_size, fd, P_IORING_OFF_SQ_RING);
+  if (!err) {
+    if (single) {
+      cq = sq;
+    } else {
+      err = sys_ring_mmap(&cq, cq_size, fd, P_IORING_OFF_CQ_RING);
+    }
+  }
+  if (!err)
+    err = sys_ring_mmap(&sqes, p->sq_entries * sizeof(p_ioring_sqe_t), fd, P_IORING_OFF_SQES);
+  if (err) {
+    PSYS_UNUSED err_t _ = (err_t)p_syscall_close(fd);
+    return err;
+  }
+
+  ring->fd = fd;
+  ring->flags = p->flags;
+  ring->features = p->features;
+
+  ring->sq_head = sq + p->sq_off.head;
+  ring->sq_tail = sq + p->sq_off.tail;
+  ring->sq_flags = sq + p->sq_off.flags;
+  ring->sq_dropped = sq + p->sq_off.dropped;
+  ring->sq_mask = *(u32*)(sq + p->sq_off.ring_mask);
+  ring->sq_entries = *(u32*)(sq + p->sq_off.ring_entries);
+  ring->sqes = sqes;
+  ring->sqe_head = ring->sqe_tail = *ring->sq_tail;
+
+  ring->cq_head = cq + p->cq_off.head;
+  ring->cq_tail = cq + p->cq_off.tail;
+  ring->cq_overflow = cq + p->cq_off.overflow;
+  ring->cq_mask = *(u32*)(cq + p->cq_off.ring_mask);
+  ring->cq_entries = *(u32*)(cq + p->cq_off.ring_entries);
+  ring->cqes = cq + p->cq_off.cqes;
+  ring->cq_xlat = *ring->cq_head;
+
+  // SQE i is always submitted through slot i of the index array, so it only needs
+  // to be filled in once
+  u32* array = sq + p->sq_off.array;
+  for (u32 i = 0; i < ring->sq_entries; i++)
+    array[i] = i;
+
+  return 0;
+}
+
+
+err_t sys_ring_init(sys_ring_t* ring, u32 entries, u32 flags) {
+  p_ioring_params_t p = { .flags = flags };
+  return sys_ring_init_params(ring, entries, &p);
+}
+
+
+err_t sys_ring_exit(sys_ring_t* ring) {
+  // there's no munmap; mmap returned the driver's own mappings of the ring, which it
+  // releases when the ring is closed
+  err_t err = (err_t)p_syscall_close(ring->fd);
+  ring->fd = -1;
+  return err;
+}
+
+
+// sys_ring_flush_sq publishes the SQEs handed out since the last flush with a single
+// tail store and returns their number
+static u32 sys_ring_flush_sq(sys_ring_t* ring) {
+  u32 n = ring->sqe_tail - ring->sqe_head;
+  if (n == 0)
+    return 0;
+  ring->sqe_head = ring->sqe_tail;
+  p_mbarrier_w(); // make the SQEs visible before the tail which covers them
+  SYS_RING_WRITE(ring->sq_tail, ring->sqe_tail);
+  return n;
+}
+
+
+static isize sys_ring_submit1(sys_ring_t* ring, u32 wait_nr, u32 flags, const void* arg) {
+  u32 to_submit = sys_ring_flush_sq(ring);
+  // With P_IORING_SQ_CQ_OVERFLOW the driver is holding back CQEs because the CQ ring
+  // was full; entering with P_IORING_ENTER_GETEVENTS moves them to the ring.
+  if (wait_nr || (SYS_RING_READ(ring->sq_flags) & P_IORING_SQ_CQ_OVERFLOW))
+    flags |= P_IORING_ENTER_GETEVENTS;
+
+  if (ring->flags & P_IORING_SETUP_SQPOLL) {
+    // the SQ poll thread picks the SQEs up by itself unless it has gone to sleep
+    p_mbarrier(); // order the tail store with the flags load
+    if (SYS_RING_READ(ring->sq_flags) & P_IORING_SQ_NEED_WAKEUP) {
+      flags |= P_IORING_ENTER_SQ_WAKEUP;
+    } else if (!(flags & P_IORING_ENTER_GETEVENTS)) {
+      return (isize)to_submit;
+    }
+  } else if (to_submit == 0 && !(flags & P_IORING_ENTER_GETEVENTS)) {
+    return 0;
+  }
+
+  return p_syscall_ioring_enter(ring->fd, to_submit, wait_nr, flags, arg);
+}
+
+
+isize sys_ring_submit(sys_ring_t* ring) {
+  return sys_ring_submit1(ring, 0, 0, (void*)0);
+}
+
+
+isize sys_ring_submit_and_wait(sys_ring_t* ring, u32 wait_nr) {
+  return sys_ring_submit1(ring, wait_nr, 0, (void*)0);
+}
+
+
+err_t sys_ring_wait_cqe(sys_ring_t* ring, p_ioring_cqe_t** cqe, const p_timespec_t* timeout) {
+  p_ioring_getevents_arg_t arg = { .ts = (u64)(usize)timeout };
+  u32 flags = timeout ? P_IORING_ENTER_EXT_ARG : 0;
+  for (;;) {
+    if (sys_ring_peek_cqe(ring, cqe) == 0)
+      return 0;
+    // also submits SQEs which have not been submitted yet
+    isize n = sys_ring_submit1(ring, 1, flags, timeout ? &arg : (void*)0);
+    if (n < 0)
+      return (err_t)n;
+  }
+}
+
+
+err_t sys_ring_host_err(i32 res) {
+  switch (-res) {
+    #define X(name, linux_errno, err) case linux_errno: return err;
+    P_ERRNO_ERRS(X)
+    #undef X
+    default: return p_err_invalid;
+  }
+}
+
+
+void sys_ring_cq_translate(sys_ring_t* ring, u32 end) {
+  u32 i = ring->cq_xlat;
+  if ((i32)(i - *ring->cq_head) < 0) // advanced past without peeking
+    i = *ring->cq_head;
+  for (; (i32)(end - i) > 0; i++) {
+    p_ioring_cqe_t* cqe = &ring->cqes[i & ring->cq_mask];
+    // res of a message is whatever the sender chose
+    if (cqe->res < 0 && !(cqe->flags & P_IORING_CQE_F_MSG))
+      cqe->res = sys_ring_host_err(cqe->res);
+  }
+  if ((i32)(end - ring->cq_xlat) > 0)
+    ring->cq_xlat = end;
+}
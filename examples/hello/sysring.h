@@ -0,0 +1,278 @@
+#pragma once
+#include <playsys.h>
+
+// sysring: ioring client library, modeled on liburing
+//
+//   sys_ring_t ring;
+//   err_t err = sys_ring_init(&ring, 64, 0);
+//   p_ioring_sqe_t* sqe = sys_ring_get_sqe(&ring);
+//   sys_ring_prep_read(sqe, fd, buf, sizeof(buf), -1);
+//   sqe->user_data = 1;
+//   isize n = sys_ring_submit_and_wait(&ring, 1);
+//   p_ioring_cqe_t* cqe;
+//   if (sys_ring_peek_cqe(&ring, &cqe) == 0) {
+//     // use cqe->res
+//     sys_ring_cqe_seen(&ring);
+//   }
+//   sys_ring_exit(&ring);
+//
+// SQEs handed out by sys_ring_get_sqe are only made visible to the driver by
+// sys_ring_submit, all at once. Likewise, CQEs can be consumed in batches with
+// sys_ring_peek_batch_cqe and sys_ring_cq_advance. A ring must not be used by more
+// than one thread at a time.
+//
+// CQEs of Linux io_uring rings (P_IORING_FEAT_HOST_ERRNO) carry negated Linux errno
+// values; the peek functions translate res of those to err_t values, in place, so
+// that a CQE reads the same with any driver. CQEs posted by MSG_RING
+// (P_IORING_CQE_F_MSG) are left alone, but Linux <6.3 doesn't mark them.
+
+typedef struct sys_ring {
+  fd_t fd;
+  u32  flags;    // P_IORING_SETUP_ flags
+  u32  features; // P_IORING_FEAT_ flags
+
+  // submission queue
+  u32*            sq_head;
+  u32*            sq_tail;
+  u32*            sq_flags;
+  u32*            sq_dropped;
+  u32             sq_mask;
+  u32             sq_entries;
+  p_ioring_sqe_t* sqes;
+  u32             sqe_head; // first SQE not yet submitted
+  u32             sqe_tail; // next SQE to hand out
+
+  // completion queue
+  u32*            cq_head;
+  u32*            cq_tail;
+  u32*            cq_overflow;
+  u32             cq_mask;
+  u32             cq_entries;
+  p_ioring_cqe_t* cqes;
+  u32             cq_xlat; // CQEs up to here have been translated (HOST_ERRNO)
+} sys_ring_t;
+
+// sys_ring_init sets up a ring with at least entries SQEs and maps it
+err_t sys_ring_init(sys_ring_t* ring, u32 entries, u32 flags) PSYS_WARN_UNUSED;
+// sys_ring_init_params is sys_ring_init with all of ioring_setup's parameters;
+// p is updated like ioring_setup does
+err_t sys_ring_init_params(sys_ring_t* ring, u32 entries, p_ioring_params_t* p)
+  PSYS_WARN_UNUSED;
+// sys_ring_exit closes the ring; its memory must not be accessed afterwards
+err_t sys_ring_exit(sys_ring_t* ring);
+
+// sys_ring_submit submits the SQEs handed out since the last call, and has the driver
+// move CQEs it held back while the CQ ring was full (P_IORING_SQ_CQ_OVERFLOW) to the
+// ring. Returns the number of SQEs consumed by the driver.
+isize sys_ring_submit(sys_ring_t* ring);
+// sys_ring_submit_and_wait is sys_ring_submit, also waiting for wait_nr CQEs
+isize sys_ring_submit_and_wait(sys_ring_t* ring, u32 wait_nr);
+
+// sys_ring_wait_cqe returns the next CQE, waiting for one if there is none.
+// Returns p_err_timedout if timeout (relative; may be NULL) passes first.
+err_t sys_ring_wait_cqe(sys_ring_t* ring, p_ioring_cqe_t** cqe, const p_timespec_t* timeout);
+
+// sys_ring_host_err returns the err_t value for res of a CQE which is a negated Linux
+// errno value (P_IORING_FEAT_HOST_ERRNO), per P_ERRNO_ERRS
+err_t sys_ring_host_err(i32 res);
+// sys_ring_cq_translate translates res of the CQEs before end which have not been
+// translated yet; called by sys_ring_peek_batch_cqe
+void sys_ring_cq_translate(sys_ring_t* ring, u32 end);
+
+
+// ---------------------------------------------------------------------------------------
+// ring memory is shared with the driver; see "Notes on the read/write ordering memory
+// barriers" in backends/base/ioring_base.c
+
+#define SYS_RING_READ(p)     (*(volatile u32*)(p))
+#define SYS_RING_WRITE(p, v) (*(volatile u32*)(p) = (v))
+
+
+// sys_ring_sq_space_left returns the number of SQEs sys_ring_get_sqe can hand out
+inline static u32 sys_ring_sq_space_left(const sys_ring_t* ring) {
+  return ring->sq_entries - (ring->sqe_tail - SYS_RING_READ(ring->sq_head));
+}
+
+
+// sys_ring_get_sqe returns a zeroed SQE to prepare, or NULL if the SQ ring is full
+// (submit and try again.)
+inline static p_ioring_sqe_t* sys_ring_get_sqe(sys_ring_t* ring) {
+  u32 head = SYS_RING_READ(ring->sq_head);
+  p_mbarrier_r(); // the driver is done with the SQE before we write to it
+  if (ring->sqe_tail - head >= ring->sq_entries)
+    return (void*)0;
+  p_ioring_sqe_t* sqe = &ring->sqes[ring->sqe_tail++ & ring->sq_mask];
+  *sqe = (p_ioring_sqe_t){0};
+  return sqe;
+}
+
+
+// sys_ring_cq_ready returns the number of CQEs available
+inline static u32 sys_ring_cq_ready(const sys_ring_t* ring) {
+  return SYS_RING_READ(ring->cq_tail) - *ring->cq_head;
+}
+
+
+// sys_ring_peek_batch_cqe stores pointers to up to count available CQEs in cqes and
+// returns their number, without waiting. Consume them with sys_ring_cq_advance.
+inline static u32 sys_ring_peek_batch_cqe(sys_ring_t* ring, p_ioring_cqe_t** cqes, u32 count) {
+  u32 head = *ring->cq_head;
+  u32 ready = SYS_RING_READ(ring->cq_tail) - head;
+  p_mbarrier_r(); // read the tail before the CQEs it covers
+  if (count > ready)
+    count = ready;
+  if (ring->features & P_IORING_FEAT_HOST_ERRNO)
+    sys_ring_cq_translate(ring, head + count);
+  for (u32 i = 0; i < count; i++)
+    cqes[i] = &ring->cqes[(head + i) & ring->cq_mask];
+  return count;
+}
+
+
+// sys_ring_peek_cqe returns the next CQE without waiting, or p_err_not_found
+inline static err_t sys_ring_peek_cqe(sys_ring_t* ring, p_ioring_cqe_t** cqe) {
+  return sys_ring_peek_batch_cqe(ring, cqe, 1) ? 0 : p_err_not_found;
+}
+
+
+// sys_ring_cq_advance hands nr CQEs back to the driver
+inline static void sys_ring_cq_advance(sys_ring_t* ring, u32 nr) {
+  if (nr == 0)
+    return;
+  p_mbarrier(); // finish reading the CQEs before the driver may overwrite them
+  SYS_RING_WRITE(ring->cq_head, *ring->cq_head + nr);
+}
+
+
+inline static void sys_ring_cqe_seen(sys_ring_t* ring) {
+  sys_ring_cq_advance(ring, 1);
+}
+
+
+// ---------------------------------------------------------------------------------------
+// prep_* helpers fill in an SQE from sys_ring_get_sqe; user_data and flags are left
+// to the caller. off -1 reads or writes at the file position.
+
+inline static void sys_ring_prep_rw(
+  p_ioring_sqe_t* sqe, u8 op, fd_t fd, const void* addr, u32 len, u64 off)
+{
+  sqe->opcode = op;
+  sqe->fd = fd;
+  sqe->addr = (u64)(usize)addr;
+  sqe->len = len;
+  sqe->off = off;
+}
+
+inline static void sys_ring_prep_nop(p_ioring_sqe_t* sqe) {
+  sqe->opcode = P_IORING_OP_NOP;
+}
+
+inline static void sys_ring_prep_read(p_ioring_sqe_t* sqe, fd_t fd, void* buf, u32 len, u64 off) {
+  sys_ring_prep_rw(sqe, P_IORING_OP_READ, fd, buf, len, off);
+}
+
+inline static void sys_ring_prep_write(
+  p_ioring_sqe_t* sqe, fd_t fd, const void* buf, u32 len, u64 off)
+{
+  sys_ring_prep_rw(sqe, P_IORING_OP_WRITE, fd, buf, len, off);
+}
+
+inline static void sys_ring_prep_openat(
+  p_ioring_sqe_t* sqe, fd_t dfd, const char* path, openflag_t flags, u32 mode)
+{
+  sys_ring_prep_rw(sqe, P_IORING_OP_OPENAT, dfd, path, mode, 0);
+  sqe->open_flags = flags;
+}
+
+inline static void sys_ring_prep_close(p_ioring_sqe_t* sqe, fd_t fd) {
+  sqe->opcode = P_IORING_OP_CLOSE;
+  sqe->fd = fd;
+}
+
+// path and st must stay valid until the operation completes
+inline static void sys_ring_prep_statx(
+  p_ioring_sqe_t* sqe, fd_t dfd, const char* path, u32 flags, u32 mask, p_statx_t* st)
+{
+  sys_ring_prep_rw(sqe, P_IORING_OP_STATX, dfd, path, mask, (u64)(usize)st);
+  sqe->statx_flags = flags;
+}
+
+inline static void sys_ring_prep_unlinkat(
+  p_ioring_sqe_t* sqe, fd_t dfd, const char* path, u32 flags)
+{
+  sys_ring_prep_rw(sqe, P_IORING_OP_UNLINKAT, dfd, path, 0, 0);
+  sqe->unlink_flags = flags;
+}
+
+inline static void sys_ring_prep_renameat(
+  p_ioring_sqe_t* sqe, fd_t olddfd, const char* oldpath, fd_t newdfd, const char* newpath,
+  u32 flags)
+{
+  sys_ring_prep_rw(sqe, P_IORING_OP_RENAMEAT, olddfd, oldpath, (u32)newdfd,
+                   (u64)(usize)newpath);
+  sqe->rename_flags = flags;
+}
+
+// posts a CQE with user_data data and res len to the ring fd
+inline static void sys_ring_prep_msg_ring(p_ioring_sqe_t* sqe, fd_t fd, u32 len, u64 data) {
+  sys_ring_prep_rw(sqe, P_IORING_OP_MSG_RING, fd, (void*)0, len, data);
+}
+
+// flags is 0 or P_IORING_FSYNC_DATASYNC
+inline static void sys_ring_prep_fsync(p_ioring_sqe_t* sqe, fd_t fd, u32 flags) {
+  sqe->opcode = P_IORING_OP_FSYNC;
+  sqe->fd = fd;
+  sqe->fsync_flags = flags;
+}
+
+inline static void sys_ring_prep_sync_file_range(
+  p_ioring_sqe_t* sqe, fd_t fd, u32 len, u64 off, u32 flags)
+{
+  sys_ring_prep_rw(sqe, P_IORING_OP_SYNC_FILE_RANGE, fd, (void*)0, len, off);
+  sqe->sync_range_flags = flags;
+}
+
+// ts must stay valid until the timeout completes
+inline static void sys_ring_prep_timeout(
+  p_ioring_sqe_t* sqe, const p_timespec_t* ts, u32 count, u32 flags)
+{
+  sys_ring_prep_rw(sqe, P_IORING_OP_TIMEOUT, -1, ts, 1, count);
+  sqe->timeout_flags = flags;
+}
+
+inline static void sys_ring_prep_link_timeout(
+  p_ioring_sqe_t* sqe, const p_timespec_t* ts, u32 flags)
+{
+  sys_ring_prep_rw(sqe, P_IORING_OP_LINK_TIMEOUT, -1, ts, 1, 0);
+  sqe->timeout_flags = flags;
+}
+
+inline static void sys_ring_prep_poll_add(p_ioring_sqe_t* sqe, fd_t fd, u32 poll_mask) {
+  sys_ring_prep_rw(sqe, P_IORING_OP_POLL_ADD, fd, (void*)0, 0, 0);
+  sqe->poll32_events = poll_mask;
+}
+
+// cancels the request with user_data, or per flags (P_IORING_ASYNC_CANCEL_)
+inline static void sys_ring_prep_cancel(p_ioring_sqe_t* sqe, u64 user_data, u32 flags) {
+  sys_ring_prep_rw(sqe, P_IORING_OP_ASYNC_CANCEL, -1, (void*)0, 0, 0);
+  sqe->addr = user_data;
+  sqe->cancel_flags = flags;
+}
+
+// offsets -1 use the file position
+inline static void sys_ring_prep_splice(
+  p_ioring_sqe_t* sqe, fd_t fd_in, i64 off_in, fd_t fd_out, i64 off_out, u32 len, u32 flags)
+{
+  sys_ring_prep_rw(sqe, P_IORING_OP_SPLICE, fd_out, (void*)0, len, (u64)off_out);
+  sqe->splice_off_in = (u64)off_in;
+  sqe->splice_fd_in = fd_in;
+  sqe->splice_flags = flags;
+}
+
+inline static void sys_ring_prep_tee(
+  p_ioring_sqe_t* sqe, fd_t fd_in, fd_t fd_out, u32 len, u32 flags)
+{
+  sys_ring_prep_rw(sqe, P_IORING_OP_TEE, fd_out, (void*)0, len, 0);
+  sqe->splice_fd_in = fd_in;
+  sqe->splice_flags = flags;
+}
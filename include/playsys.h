@@ -64,6 +64,9 @@ enum p_err {
   p_err_nomem         = -12, // cannot allocate memory
   p_err_mfault        = -13, // bad memory address
   p_err_overflow      = -14, // value too large for defined data type
+  p_err_timedout      = -15, // timer expired
+  p_err_already       = -16, // operation already in progress
+  p_err_io            = -17, // input/output error
 };
 
 // open flags (possible bits of type openflag_t)
@@ -112,6 +115,8 @@ enum p_sysop {
   p_sysop_exit            = 60, 
   p_sysop_mmap            = 9, 
   p_sysop_pipe            = 293, 
+  p_sysop_splice          = 275, 
+  p_sysop_tee             = 276, 
   p_sysop_test            = 10000, 
   p_sysop_gpudev          = 10001, 
   p_sysop_gui_mksurf      = 10002, 
@@ -130,6 +135,66 @@ PSYS_EXTERN isize p_syscall(psysop_t,isize,isize,isize,isize,isize) PSYS_WARN_UN
 #define P_IORING_OFF_CQ_RING 0x8000000ULL
 #define P_IORING_OFF_SQES    0x10000000ULL
 
+// P_IORING_REGISTER_FILES_SKIP leaves a slot unchanged in a file table update
+#define P_IORING_REGISTER_FILES_SKIP (-2)
+
+// ioring operations (possible values of p_ioring_sqe_t.opcode)
+enum p_ioring_op {
+  P_IORING_OP_NOP             =  0, // No operation
+  P_IORING_OP_READV           =  1, // Read into an array of iovec (addr, len)
+  P_IORING_OP_WRITEV          =  2, // Write from an array of iovec (addr, len)
+  P_IORING_OP_FSYNC           =  3, // Sync a file to storage
+  P_IORING_OP_READ_FIXED      =  4, // Read into a registered buffer
+  P_IORING_OP_WRITE_FIXED     =  5, // Write from a registered buffer
+  P_IORING_OP_POLL_ADD        =  6, // Wait for poll32_events on a file
+  P_IORING_OP_POLL_REMOVE     =  7, // Cancel a POLL_ADD
+  P_IORING_OP_SYNC_FILE_RANGE =  8, // Sync a range of a file to storage
+  P_IORING_OP_SENDMSG         =  9, // Send a message on a socket
+  P_IORING_OP_RECVMSG         = 10, // Receive a message from a socket
+  P_IORING_OP_TIMEOUT         = 11, // Complete after a timeout or a number of completions
+  P_IORING_OP_TIMEOUT_REMOVE  = 12, // Cancel or update a TIMEOUT
+  P_IORING_OP_ACCEPT          = 13, // Accept a connection on a socket
+  P_IORING_OP_ASYNC_CANCEL    = 14, // Cancel an operation in progress
+  P_IORING_OP_LINK_TIMEOUT    = 15, // Limit the time of the linked operation
+  P_IORING_OP_CONNECT         = 16, // Connect a socket
+  P_IORING_OP_FALLOCATE       = 17, // Allocate space of a file
+  P_IORING_OP_OPENAT          = 18, // Open a file
+  P_IORING_OP_CLOSE           = 19, // Close a file
+  P_IORING_OP_FILES_UPDATE    = 20, // Update the registered file table
+  P_IORING_OP_STATX           = 21, // Get file status
+  P_IORING_OP_READ            = 22, // Read into a buffer
+  P_IORING_OP_WRITE           = 23, // Write from a buffer
+  P_IORING_OP_FADVISE         = 24, // Declare file access pattern
+  P_IORING_OP_MADVISE         = 25, // Declare memory access pattern
+  P_IORING_OP_SEND            = 26, // Send data on a socket
+  P_IORING_OP_RECV            = 27, // Receive data from a socket
+  P_IORING_OP_OPENAT2         = 28, // Open a file (with open_how)
+  P_IORING_OP_EPOLL_CTL       = 29, // Control an epoll instance
+  P_IORING_OP_SPLICE          = 30, // Move data between two files, one of which is a pipe
+  P_IORING_OP_PROVIDE_BUFFERS = 31, // Add buffers to a buffer group
+  P_IORING_OP_REMOVE_BUFFERS  = 32, // Remove buffers from a buffer group
+  P_IORING_OP_TEE             = 33, // Duplicate data between two pipes
+  P_IORING_OP_SHUTDOWN        = 34, // Shut down a socket
+  P_IORING_OP_RENAMEAT        = 35, // Rename a file
+  P_IORING_OP_UNLINKAT        = 36, // Remove a file or directory
+  P_IORING_OP_MKDIRAT         = 37, // Create a directory
+  P_IORING_OP_SYMLINKAT       = 38, // Create a symbolic link
+  P_IORING_OP_LINKAT          = 39, // Create a hard link
+  P_IORING_OP_MSG_RING        = 40, // Post a CQE to another ring
+  P_IORING_OP_FSETXATTR       = 41, // Set an extended attribute of a file
+  P_IORING_OP_SETXATTR        = 42, // Set an extended attribute of a path
+  P_IORING_OP_FGETXATTR       = 43, // Get an extended attribute of a file
+  P_IORING_OP_GETXATTR        = 44, // Get an extended attribute of a path
+  P_IORING_OP_SOCKET          = 45, // Create a socket
+  P_IORING_OP_URING_CMD       = 46, // Device-specific command
+  P_IORING_OP_SEND_ZC         = 47, // Send data on a socket without copying
+  P_IORING_OP_SENDMSG_ZC      = 48, // Send a message on a socket without copying
+  P_IORING_OP_READ_MULTISHOT  = 49, // Read repeatedly into selected buffers
+
+  // this goes last
+  P_IORING_OP_LAST,
+};
+
 // flags for p_ioring_sqe_t
 enum p_ioring_sqeflag {
   P_IORING_SQE_FIXED_FILE    = 1U << 0, // use fixed fileset
@@ -144,6 +209,96 @@ enum p_ioring_sqeflag {
 enum p_ioring_cqeflag {
   P_IORING_CQE_F_BUFFER = 1U << 0, // the upper 16 bits are the buffer ID
   P_IORING_CQE_F_MORE =   1U << 1, // parent SQE will generate more CQE entries
+  P_IORING_CQE_F_MSG =    1U << 12, // posted by P_IORING_OP_MSG_RING (playsys only)
+};
+
+// P_IORING_CQE_BUFFER_SHIFT: cqe.flags >> P_IORING_CQE_BUFFER_SHIFT is the ID of the
+// buffer selected with P_IORING_SQE_BUFFER_SELECT (when P_IORING_CQE_F_BUFFER is set)
+#define P_IORING_CQE_BUFFER_SHIFT 16
+
+// flags for p_ioring_sqe_t.len of P_IORING_OP_POLL_ADD
+enum p_ioring_pollflag {
+  P_IORING_POLL_ADD_MULTI = 1U << 0, // multishot; post a CQE for every event
+};
+
+// poll events (p_ioring_sqe_t.poll32_events and cqe.res of P_IORING_OP_POLL_ADD)
+enum p_pollevent {
+  P_POLLIN   = 0x01, // there is data to read
+  P_POLLPRI  = 0x02, // there is urgent data to read
+  P_POLLOUT  = 0x04, // writing is possible
+  P_POLLERR  = 0x08, // error condition (always reported)
+  P_POLLHUP  = 0x10, // hung up (always reported)
+  P_POLLNVAL = 0x20, // invalid file descriptor (always reported)
+};
+
+// flags for p_ioring_sqe_t.timeout_flags
+enum p_ioring_timeoutflag {
+  P_IORING_TIMEOUT_ABS    = 1U << 0, // absolute time (CLOCK_MONOTONIC)
+  P_IORING_TIMEOUT_UPDATE = 1U << 1, // TIMEOUT_REMOVE updates the timeout instead
+};
+
+// flags for p_ioring_sqe_t.cancel_flags and p_ioring_sync_cancel_reg_t.flags
+enum p_ioring_cancelflag {
+  P_IORING_ASYNC_CANCEL_ALL      = 1U << 0, // cancel all matching requests
+  P_IORING_ASYNC_CANCEL_FD       = 1U << 1, // match requests on fd, not user_data
+  P_IORING_ASYNC_CANCEL_ANY      = 1U << 2, // match any request
+  P_IORING_ASYNC_CANCEL_FD_FIXED = 1U << 3, // fd is an index into the registered files
+};
+
+// flags for the statat and removeat syscalls, p_ioring_sqe_t.statx_flags and
+// p_ioring_sqe_t.unlink_flags (same values as Linux)
+enum p_atflag {
+  P_AT_SYMLINK_NOFOLLOW = 0x100,  // statat: don't follow a symbolic link at the end of path
+  P_AT_REMOVEDIR        = 0x200,  // removeat: remove a directory rather than a file
+  P_AT_EMPTY_PATH       = 0x1000, // statat: path is empty; stat base itself
+};
+
+// p_statx_t.stx_mask bits (same values as Linux)
+enum p_statxmask {
+  P_STATX_TYPE        = 0x1,   // file type in stx_mode
+  P_STATX_MODE        = 0x2,   // permissions in stx_mode
+  P_STATX_NLINK       = 0x4,
+  P_STATX_UID         = 0x8,
+  P_STATX_GID         = 0x10,
+  P_STATX_ATIME       = 0x20,
+  P_STATX_MTIME       = 0x40,
+  P_STATX_CTIME       = 0x80,
+  P_STATX_INO         = 0x100,
+  P_STATX_SIZE        = 0x200,
+  P_STATX_BLOCKS      = 0x400,
+  P_STATX_BASIC_STATS = 0x7ff, // all of the above
+  P_STATX_BTIME       = 0x800, // creation time
+};
+
+// file type in p_statx_t.stx_mode (same values as POSIX hosts)
+enum p_filetype {
+  P_S_IFMT   = 0170000, // mask of the file type bits
+  P_S_IFIFO  = 0010000,
+  P_S_IFCHR  = 0020000,
+  P_S_IFDIR  = 0040000,
+  P_S_IFBLK  = 0060000,
+  P_S_IFREG  = 0100000,
+  P_S_IFLNK  = 0120000,
+  P_S_IFSOCK = 0140000,
+};
+
+// flags for p_ioring_sqe_t.fsync_flags
+enum p_ioring_fsyncflag {
+  P_IORING_FSYNC_DATASYNC = 1U << 0, // only flush data and the metadata needed to read it
+};
+
+// flags for p_ioring_sqe_t.sync_range_flags (same values as Linux sync_file_range)
+enum p_ioring_syncrangeflag {
+  P_SYNC_FILE_RANGE_WAIT_BEFORE = 1U << 0, // wait for writeback already in progress
+  P_SYNC_FILE_RANGE_WRITE       = 1U << 1, // start writeback of dirty pages
+  P_SYNC_FILE_RANGE_WAIT_AFTER  = 1U << 2, // wait for the writeback to finish
+};
+
+// flags for the tee syscall and p_ioring_sqe_t.splice_flags (same values as Linux)
+enum p_spliceflag {
+  P_SPLICE_F_MOVE        = 1U << 0,  // hint: move pages rather than copying them
+  P_SPLICE_F_MORE        = 1U << 2,  // hint: more data will follow
+  P_SPLICE_F_FD_IN_FIXED = 1U << 31, // splice_fd_in is an index into the registered files
 };
 
 // flags for p_ioring_sqoffsets_t
@@ -181,6 +336,8 @@ enum p_ioring_featflag {
   P_IORING_FEAT_EXT_ARG         = 1U << 8,
   P_IORING_FEAT_NATIVE_WORKERS  = 1U << 9,
   P_IORING_FEAT_RSRC_TAGS       = 1U << 10,
+  // res of failed operations are negated Linux errno values (playsys only; see sysring)
+  P_IORING_FEAT_HOST_ERRNO      = 1U << 31,
 };
 
 // flags for ioring_enter syscall
@@ -220,10 +377,33 @@ enum {
   // set/get max number of io-wq workers
   P_IORING_REGISTER_IOWQ_MAX_WORKERS = 19,
 
+  // cancel requests and wait for them (20 and 21 are not supported)
+  P_IORING_REGISTER_SYNC_CANCEL = 22,
+
   // this goes last
   P_IORING_REGISTER_LAST
 };
 
+// P_IORING_REGISTER_PROBE fills in a p_ioring_probe_t followed by nr_args
+// p_ioring_probe_op_t, one per operation
+typedef struct _p_ioring_probe_op {
+  u8  op;
+  u8  resv;
+  u16 flags; // P_IO_URING_OP_ flags
+  u32 resv2;
+} p_ioring_probe_op_t;
+
+typedef struct _p_ioring_probe {
+  u8  last_op; // last opcode supported
+  u8  ops_len; // number of ops[] entries filled in
+  u16 resv;
+  u32 resv2[3];
+  p_ioring_probe_op_t ops[];
+} p_ioring_probe_t;
+
+// flags for p_ioring_probe_op_t
+#define P_IO_URING_OP_SUPPORTED (1U << 0)
+
 // p_ioring_sqoffsets_t describes an ioring submission queue
 typedef struct _p_ioring_sqoffsets {
   u32 head;
@@ -319,6 +499,98 @@ typedef struct _p_ioring_cqe {
   u32 flags;     // P_IORING_CQE_ flags
 } p_ioring_cqe_t;
 
+// p_timespec_t: time value of timeout operations (same layout as Linux's
+// struct __kernel_timespec)
+typedef struct _p_timespec {
+  i64 tv_sec;
+  i64 tv_nsec;
+} p_timespec_t;
+
+// p_statx_t: file status filled in by statat and P_IORING_OP_STATX
+// (same layout as Linux's struct statx)
+typedef struct _p_statx_timestamp {
+  i64 tv_sec;
+  u32 tv_nsec;
+  i32 __reserved;
+} p_statx_timestamp_t;
+
+typedef struct _p_statx {
+  u32 stx_mask;    // P_STATX_ bits of the fields filled in
+  u32 stx_blksize; // preferred block size for I/O
+  u64 stx_attributes;
+  u32 stx_nlink;
+  u32 stx_uid;
+  u32 stx_gid;
+  u16 stx_mode;    // file type (P_S_IF*) and permissions
+  u16 __spare0[1];
+  u64 stx_ino;
+  u64 stx_size;    // bytes
+  u64 stx_blocks;  // 512-byte blocks allocated
+  u64 stx_attributes_mask;
+  p_statx_timestamp_t stx_atime; // last access
+  p_statx_timestamp_t stx_btime; // creation
+  p_statx_timestamp_t stx_ctime; // last status change
+  p_statx_timestamp_t stx_mtime; // last modification
+  u32 stx_rdev_major; // device, for device files
+  u32 stx_rdev_minor;
+  u32 stx_dev_major;  // device the file lives on
+  u32 stx_dev_minor;
+  u64 __spare2[14];
+} p_statx_t;
+
+// argument to ioring_enter with P_IORING_ENTER_EXT_ARG
+// (same layout as Linux's struct io_uring_getevents_arg)
+typedef struct _p_ioring_getevents_arg {
+  u64 sigmask;    // must be 0 (signal masks are not supported)
+  u32 sigmask_sz; // must be 0
+  u32 pad;
+  u64 ts;         // pointer to p_timespec_t; timeout relative to now, or 0 for none
+} p_ioring_getevents_arg_t;
+
+// p_iovec_t describes a memory region (same layout as struct iovec)
+typedef struct _p_iovec {
+  void* base;
+  usize len;
+} p_iovec_t;
+
+// argument to P_IORING_REGISTER_SYNC_CANCEL
+// (same layout as Linux's struct io_uring_sync_cancel_reg)
+typedef struct _p_ioring_sync_cancel_reg {
+  u64 addr;    // user_data of the requests to cancel
+  fd_t fd;     // file of the requests to cancel (with P_IORING_ASYNC_CANCEL_FD)
+  u32 flags;   // P_IORING_ASYNC_CANCEL_ flags
+  p_timespec_t timeout; // max time to wait; -1 in tv_sec and tv_nsec for none
+  u8  opcode;  // must be 0
+  u8  pad[7];
+  u64 pad2[3];
+} p_ioring_sync_cancel_reg_t;
+
+// argument to P_IORING_REGISTER_FILES2 and P_IORING_REGISTER_BUFFERS2
+typedef struct _p_ioring_rsrc_register {
+  u32 nr;   // number of entries in data
+  u32 resv;
+  u64 resv2;
+  u64 data; // pointer to array of entries
+  u64 tags; // pointer to array of u64 tags (must be 0; tags are not supported)
+} p_ioring_rsrc_register_t;
+
+// argument to P_IORING_REGISTER_FILES_UPDATE2 and P_IORING_REGISTER_BUFFERS_UPDATE
+typedef struct _p_ioring_rsrc_update2 {
+  u32 offset; // index of first entry to update
+  u32 resv;
+  u64 data;   // pointer to array of nr entries
+  u64 tags;   // pointer to array of u64 tags (must be 0; tags are not supported)
+  u32 nr;
+  u32 resv2;
+} p_ioring_rsrc_update2_t;
+
+// argument to P_IORING_REGISTER_FILES_UPDATE
+typedef struct _p_ioring_files_update {
+  u32 offset; // index of first entry to update
+  u32 resv;
+  u64 fds;    // pointer to array of fd_t
+} p_ioring_files_update_t;
+
 
 // --- syscall interface functions ---
 
@@ -326,6 +598,7 @@ static fd_t p_syscall_openat(fd_t base, const char* path, openflag_t flags, usiz
 static err_t p_syscall_close(fd_t fd);
 static isize p_syscall_read(fd_t fd, void* data, usize nbyte);
 static isize p_syscall_write(fd_t fd, const void* data, usize nbyte);
+static err_t p_syscall_statat(fd_t base, const char* path, p_statx_t* st, u32 flags);
 static err_t p_syscall_removeat(fd_t base, const char* path, u32 flags);
 static err_t p_syscall_renameat(fd_t oldbase, const char* oldpath, fd_t newbase,
   const char* newpath);
@@ -334,11 +607,15 @@ static err_t p_syscall_exit(i32 status_code);
 static err_t p_syscall_mmap(void** addr, usize length, mmapflag_t flag, fd_t fd,
   usize offs);
 static err_t p_syscall_pipe(fd_t* fdv, u32 flags);
+static isize p_syscall_splice(fd_t fd_in, i64* off_in, fd_t fd_out, i64* off_out,
+  usize len);
+static isize p_syscall_tee(fd_t fd_in, fd_t fd_out, usize len, u32 flags);
 static err_t p_syscall_test(psysop_t op);
 static fd_t p_syscall_gpudev(gpudevflag_t flags);
 static fd_t p_syscall_gui_mksurf(u32 width, u32 height, fd_t device, u32 flags);
 static fd_t p_syscall_ioring_setup(u32 entries, p_ioring_params_t* params);
-static isize p_syscall_ioring_enter(fd_t ring, u32 to_submit, u32 min_complete, u32 flags);
+static isize p_syscall_ioring_enter(fd_t ring, u32 to_submit, u32 min_complete, u32 flags,
+  const void* arg);
 static isize p_syscall_ioring_register(fd_t ring, u32 opcode, const void* arg,
   u32 nr_args);
 
@@ -369,6 +646,11 @@ inline static isize p_syscall_read(fd_t fd, void* data, usize nbyte) {
 inline static isize p_syscall_write(fd_t fd, const void* data, usize nbyte) {
   return _p_syscall3(p_sysop_write, (isize)fd, (isize)data, (isize)nbyte);
 }
+inline static err_t p_syscall_statat(fd_t base, const char* path, p_statx_t* st,
+  u32 flags) {
+  return (err_t)_p_syscall4(p_sysop_statat, (isize)base, (isize)path, (isize)st,
+    (isize)flags);
+}
 inline static err_t p_syscall_removeat(fd_t base, const char* path, u32 flags) {
   return (err_t)_p_syscall3(p_sysop_removeat, (isize)base, (isize)path, (isize)flags);
 }
@@ -391,6 +673,14 @@ inline static err_t p_syscall_mmap(void** addr, usize length, mmapflag_t flag, f
 inline static err_t p_syscall_pipe(fd_t* fdv, u32 flags) {
   return (err_t)_p_syscall2(p_sysop_pipe, (isize)fdv, (isize)flags);
 }
+inline static isize p_syscall_splice(fd_t fd_in, i64* off_in, fd_t fd_out, i64* off_out,
+  usize len) {
+  return _p_syscall5(p_sysop_splice, (isize)fd_in, (isize)off_in, (isize)fd_out,
+    (isize)off_out, (isize)len);
+}
+inline static isize p_syscall_tee(fd_t fd_in, fd_t fd_out, usize len, u32 flags) {
+  return _p_syscall4(p_sysop_tee, (isize)fd_in, (isize)fd_out, (isize)len, (isize)flags);
+}
 inline static err_t p_syscall_test(psysop_t op) {
   return (err_t)_p_syscall1(p_sysop_test, (isize)op);
 }
@@ -405,9 +695,9 @@ inline static fd_t p_syscall_ioring_setup(u32 entries, p_ioring_params_t* params
   return (fd_t)_p_syscall2(p_sysop_ioring_setup, (isize)entries, (isize)params);
 }
 inline static isize p_syscall_ioring_enter(fd_t ring, u32 to_submit, u32 min_complete,
-  u32 flags) {
-  return _p_syscall4(p_sysop_ioring_enter, (isize)ring, (isize)to_submit,
-    (isize)min_complete, (isize)flags);
+  u32 flags, const void* arg) {
+  return _p_syscall5(p_sysop_ioring_enter, (isize)ring, (isize)to_submit,
+    (isize)min_complete, (isize)flags, (isize)arg);
 }
 inline static isize p_syscall_ioring_register(fd_t ring, u32 opcode, const void* arg,
   u32 nr_args) {
@@ -433,17 +723,69 @@ inline static const char* p_err_str(err_t e) {
   case p_err_nomem:         return "nomem";
   case p_err_mfault:        return "mfault";
   case p_err_overflow:      return "overflow";
+  case p_err_timedout:      return "timedout";
+  case p_err_already:       return "already";
+  case p_err_io:            return "io";
   }
   return "?";
 }
 
+// P_ERRNO_ERRS(X) is the error of each host errno value, as X(name, Linux value, err).
+// The first errno of an error is the one an error maps back to. Rings with
+// P_IORING_FEAT_HOST_ERRNO complete with negated Linux errno values, which
+// clients translate with it; the drivers use it for host errors. Other errno values,
+// including EINVAL, are p_err_invalid.
+#define P_ERRNO_ERRS(X) \
+  X(EBADF,             9, p_err_badfd) \
+  X(EBADFD,           77, p_err_badfd) \
+  X(ENOENT,            2, p_err_not_found) \
+  X(ESRCH,             3, p_err_not_found) \
+  X(ENODEV,           19, p_err_not_found) \
+  X(ENOTDIR,          20, p_err_not_found) \
+  X(ENAMETOOLONG,     36, p_err_name_too_long) \
+  X(ECANCELED,       125, p_err_canceled) \
+  X(EINTR,             4, p_err_canceled) \
+  X(EOPNOTSUPP,       95, p_err_not_supported) \
+  X(ENOSYS,           38, p_err_not_supported) \
+  X(ENXIO,             6, p_err_not_supported) \
+  X(ENOTTY,           25, p_err_not_supported) \
+  X(ESPIPE,           29, p_err_not_supported) \
+  X(EXDEV,            18, p_err_not_supported) \
+  X(EAFNOSUPPORT,     97, p_err_not_supported) \
+  X(EPROTONOSUPPORT,  93, p_err_not_supported) \
+  X(EEXIST,           17, p_err_exists) \
+  X(ENOTEMPTY,        39, p_err_exists) \
+  X(ENODATA,          61, p_err_end) \
+  X(EPIPE,            32, p_err_end) \
+  X(EACCES,           13, p_err_access) \
+  X(EPERM,             1, p_err_access) \
+  X(EROFS,            30, p_err_access) \
+  X(ENOMEM,           12, p_err_nomem) \
+  X(EAGAIN,           11, p_err_nomem) \
+  X(ENOBUFS,         105, p_err_nomem) \
+  X(EMFILE,           24, p_err_nomem) \
+  X(ENFILE,           23, p_err_nomem) \
+  X(EFAULT,           14, p_err_mfault) \
+  X(EOVERFLOW,        75, p_err_overflow) \
+  X(EFBIG,            27, p_err_overflow) \
+  X(ERANGE,           34, p_err_overflow) \
+  X(E2BIG,             7, p_err_overflow) \
+  X(ETIMEDOUT,       110, p_err_timedout) \
+  X(ETIME,            62, p_err_timedout) \
+  X(EALREADY,        114, p_err_already) \
+  X(EINPROGRESS,     115, p_err_already) \
+  X(EBUSY,            16, p_err_already) \
+  X(EIO,               5, p_err_io) \
+  X(ENOSPC,           28, p_err_io) \
+  X(EDQUOT,          122, p_err_io)
+
 // SMP memory operations
 #if defined(__wasm__)
   #define p_mbarrier()   ((void)0)
   #define p_mbarrier_r() ((void)0)
   #define p_mbarrier_w() ((void)0)
 #elif defined(__has_builtin) && __has_builtin(__c11_atomic_thread_fence)
-  #define p_mbarrier()   __c11_atomic_thread_fence(__ATOMIC_ACQ_REL)
+  #define p_mbarrier()   __c11_atomic_thread_fence(__ATOMIC_SEQ_CST)
   #define p_mbarrier_r() __c11_atomic_thread_fence(__ATOMIC_ACQUIRE)
   #define p_mbarrier_w() __c11_atomic_thread_fence(__ATOMIC_RELEASE)
 #elif defined(__i386__)
@@ -456,8 +798,8 @@ inline static const char* p_err_str(err_t e) {
   #define p_mbarrier_w() __asm__ volatile("sfence" ::: "memory")
 #elif defined(__arm__) || defined(__arm64__) || defined(__aarch64__)
   #define p_mbarrier()   __asm__ volatile("dmb ish" ::: "memory")
-  #define p_mbarrier_r() __asm__ volatile("dmb ishst" ::: "memory")
-  #define p_mbarrier_w() __asm__ volatile("dmb ishld" ::: "memory")
+  #define p_mbarrier_r() __asm__ volatile("dmb ishld" ::: "memory")
+  #define p_mbarrier_w() __asm__ volatile("dmb ishst" ::: "memory")
 #else
   #error
 #endif
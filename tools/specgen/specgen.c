@@ -438,8 +438,10 @@ static bool gen_c(FILE* outf, doc_t* spec, const char* tplfile, void** mnext) {
   str_appendcstr(ALLOCVAR("mutptr"), "void*");
   str_appendcstr(ALLOCVAR("*ptr"), "void**");
   str_appendcstr(ALLOCVAR("*fd"), "fd" TYPE_SUFFIX "*");
+  str_appendcstr(ALLOCVAR("*i64"), "i64*");
   str_appendcstr(ALLOCVAR("ioring_params"), ns "ioring_params" TYPE_SUFFIX);
   str_appendcstr(ALLOCVAR("*ioring_params"), ns "ioring_params" TYPE_SUFFIX "*");
+  str_appendcstr(ALLOCVAR("*statx"), ns "statx" TYPE_SUFFIX "*");
 
   // add types to set of vars
   t = get_table(spec, "types");
@@ -457,6 +459,7 @@ static bool gen_c(FILE* outf, doc_t* spec, const char* tplfile, void** mnext) {
     {"OPENFLAG_ENUM", "open_flags",     "  " ns "open_{0}\t=\t{1>},\t// {2}\n"},
     {"MMAPFLAG_ENUM", "mmap_flags",     "  " ns "mmap_{0}\t=\t{1>},\t// {2}\n"},
     {"GPUDEVFLAG_ENUM", "gpudev_flags", "  " ns "gpudev_{0}\t=\t{1>},\t// {2}\n"},
+    {"IORING_OP_ENUM", "ioring_ops",   "  " NS "IORING_OP_{0}\t=\t{1>},\t// {2}\n"},
   };
   varc += fmt_table_entries(
     spec, &vars[varc], countof(vars)-varc, entries, countof(entries));
@@ -580,6 +583,7 @@ static bool gen_js(FILE* outf, doc_t* spec, const char* tplfile, void** mnext) {
     {"ERR_ENUM",   "errors",     "  {0}\t=\t{R>},\t// {1}\n"},
     {"OFLAG_ENUM", "open_flags", "  {0}\t=\t{1>},\t// {2}\n"},
     {"SYSOP_ENUM", "sysops",     "  {0}\t=\t{1>},\t// {2}\n"},
+    {"IORING_OP_ENUM", "ioring_ops", "  {0}\t=\t{1>},\t// {2}\n"},
   };
   tplvar_t vars[countof(entries)] = {0};
   int varc = fmt_table_entries(spec, vars, countof(vars), entries, countof(entries));